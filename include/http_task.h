@@ -0,0 +1,108 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef HTTP_TASK_H
+#define HTTP_TASK_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "frame_sub.h"
+#include "system_utilities.h"
+
+
+
+//
+// HTTP Task Constants
+//
+
+// Task stack size (bytes)
+#define HTTP_TASK_STACK_SIZE 3072
+
+// Longest http_task blocks waiting for work before running its housekeeping
+#define HTTP_TASK_HOUSEKEEPING_MSEC 1000
+
+// Interval between statistics log messages when LOG_HTTP_STATS is defined
+#define HTTP_STATS_LOG_SECS 10
+
+// HTTP Task notifications
+#define HTTP_NOTIFY_LEP_FRAME_MASK     0x00000010
+#define HTTP_NOTIFY_CLIENT_MASK        0x00000020
+
+// Server port and the most stream and WebSocket clients served at once.  esp_http_server takes
+// three sockets of its own beyond its sessions, so with CONFIG_LWIP_MAX_SOCKETS 10 and
+// send_task's stream connection this leaves room for a couple of snapshot requests.
+#define HTTP_SERVER_PORT        80
+#define HTTP_MAX_STREAM_CLIENTS 3
+#define HTTP_MAX_SESSIONS       (HTTP_MAX_STREAM_CLIENTS + 2)
+
+// Frames each stream client may have waiting.  A client that falls further behind
+// loses its oldest frames (a WebSocket client skips to the newest one whenever it is
+// behind at all); every waiting frame holds a pool frame.
+#define HTTP_CLIENT_QUEUE_DEPTH 2
+
+// A stream client that loses this many frames within FRAME_SUB_EVICT_WINDOW published
+// frames is evicted rather than left to stall the frames it does get (0 never evicts)
+#define HTTP_CLIENT_EVICT_OVERRUNS 24
+
+// Pool frames the server may hold: each stream client's quota, the latest frame kept
+// for snapshots and an older one a snapshot may still be sending
+#define HTTP_POOL_FRAMES (HTTP_MAX_STREAM_CLIENTS * FRAME_SUB_POOL_QUOTA(HTTP_CLIENT_QUEUE_DEPTH) + 2)
+
+// Longest a frame may take to write to a stream client before the client is dropped
+#define HTTP_SEND_TIMEOUT_MSEC  2000
+
+// Longest http_task waits on the sockets at a time while frames are in flight
+#define HTTP_IO_POLL_MSEC       20
+
+// Multipart boundary between the frames of a stream
+#define HTTP_STREAM_BOUNDARY    "rspframe"
+
+
+
+//
+// HTTP Task Data structures
+//
+typedef struct {
+	uint32_t clients;            // Stream clients accepted
+	uint32_t clients_refused;    // Stream requests refused because every slot was taken
+	uint32_t clients_dropped;    // Stream clients dropped after a send error or timeout
+	uint32_t clients_closed;     // Stream clients that went away
+	uint32_t frames;             // Frames written to stream clients
+	uint32_t overruns;           // Frames lost because a stream client fell behind
+	uint32_t skipped;            // Frames a WebSocket client skipped to get the newest
+	uint32_t decimated;          // Frames not queued for a client to hold it to its fps
+	uint32_t evictions;          // Stream clients evicted for falling behind
+	uint32_t over_quota;         // Frames not queued while a client held its pool quota
+	uint32_t encoded;            // Frames Rice coded for a client
+	uint32_t partial_writes;     // Sends a socket took only part of
+	uint32_t send_timeouts;      // Frames not written within HTTP_SEND_TIMEOUT_MSEC
+	uint32_t snapshots;          // Snapshot requests served
+	uint64_t bytes;              // Bytes written to stream clients
+} http_task_stats_t;
+
+
+
+//
+// HTTP Task API
+//
+bool http_buffer_init();
+bool http_server_init();
+void http_task();
+void http_publish_frame(lep_buffer_t* bufP);
+void http_get_stats(http_task_stats_t* statsP);
+
+#endif /* HTTP_TASK_H */
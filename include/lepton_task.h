@@ -27,12 +27,36 @@
 // LEP Task Constants
 //
 
-// Number of consecutive VoSPI resynchronization attempts before attempting to reset
-#define LEP_SYNC_FAIL_FAULT_LIMIT 10
+// Task stack size (bytes)
+#define LEP_TASK_STACK_SIZE 2048
+
+// VoSPI resynchronization thresholds and steps are in vospi_resync.h
 
 // Reset fail delay before attempting a re-init (seconds)
 #define LEP_RESET_FAIL_RETRY_SECS 60
 
+// Maximum time to wait for a VSYNC interrupt before counting a failed vsync (mSec)
+#define LEP_VSYNC_TIMEOUT_MSEC 100
+
+// Interval between acquisition statistics log messages when LOG_ACQ_STATS is defined
+#define LEP_STATS_LOG_SECS 10
+
+
+
+//
+// LEP Task Data structures
+//
+typedef struct {
+	uint32_t vsync_edges;          // VSYNC interrupts
+	uint32_t vsync_missed;         // VSYNC edges that did not start a segment read
+	uint32_t vsync_timeouts;       // VSYNC waits that timed out
+	uint32_t first_pkt_count;      // Segment reads that saw at least one packet
+	uint32_t first_pkt_usec_last;  // VSYNC to first packet latency
+	uint32_t first_pkt_usec_max;
+	uint64_t first_pkt_usec_sum;
+	uint32_t segments_dropped;     // Segments not queued for send_task (SEGMENT_STREAMING)
+} lep_task_stats_t;
+
 
 
 //
@@ -41,6 +65,7 @@
 void lepton_task();
 bool lepton_io_init();
 bool lepton_buffer_init();
+void lepton_get_stats(lep_task_stats_t* statsP);
 
 
 #endif /* LEP_TASK_H */
\ No newline at end of file
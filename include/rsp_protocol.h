@@ -0,0 +1,134 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Wire format of the frame stream sent by send_task.  Everything is little-endian and
+ * this header only depends on stdint.h so that host tools can share it.
+ *
+ * TCP stream: each frame is an rsp_frame_hdr_t, then telem_words 16-bit telemetry
+ * words, then payload_len bytes of image encoded as described by encoding.  A
+ * receiver finds the next frame from hdr_len, telem_words and payload_len, so fields
+ * added at the end of the header in a later minor version are skipped by older
+ * receivers.  A new version number means an incompatible change.
+ *
+ * UDP stream (UDP_STREAMING): each datagram is an rsp_udp_hdr_t followed by a fragment
+ * of the frame.  Fragment 0 holds the rsp_frame_hdr_t and the telemetry, the others
+ * hold the payload bytes starting at payload_offset.  A RAW16 frame with lost
+ * fragments can still be shown with rows missing; an encoded payload cannot be
+ * decoded unless every fragment arrived.
+ *
+ * RSP_ENC_TILE_DELTA payload: an rsp_delta_hdr_t, a bitmap of (tiles + 7) / 8 bytes
+ * with bit (i % 8) of byte i / 8 set for each tile present (tiles numbered row by row,
+ * those on the right and bottom edges may be smaller), then for each present tile a
+ * 16-bit length and that many bytes: the tile's raw 16-bit pixels if the length equals
+ * its raw size, RSP_ENC_RICE coded pixels otherwise.  Tiles that are not present are
+ * unchanged from frame base_seq, so a receiver that did not decode that frame has to
+ * wait for the next keyframe.
+ *
+ * SEGMENT_STREAMING sends rsp_segment_hdr_t and raw segment pixels instead.
+ */
+#ifndef RSP_PROTOCOL_H
+#define RSP_PROTOCOL_H
+
+#include <stdint.h>
+
+
+//
+// RSP Protocol Constants
+//
+
+// Frame header identification ("LEPF" in stream order) and version
+#define RSP_PROTO_MAGIC   0x4650454C
+#define RSP_PROTO_VERSION 1
+
+// rsp_frame_hdr_t flags
+#define RSP_FLAG_TELEMETRY 0x01    // telem_words of Lepton telemetry follow the header
+#define RSP_FLAG_CRC       0x02    // payload_crc is valid
+
+// Payload encodings
+#define RSP_ENC_RAW16      0       // width * height little-endian 16-bit pixels
+#define RSP_ENC_RICE       1       // Lossless predictive Rice code (lib/codec/frame_codec.h)
+#define RSP_ENC_TILE_DELTA 2       // Changed tiles only (rsp_delta_hdr_t, lib/codec/frame_delta.h)
+
+// rsp_delta_hdr_t flags
+#define RSP_DELTA_KEYFRAME 0x01    // Every tile is present and base_seq is not used
+
+
+
+//
+// RSP Protocol Data structures
+//
+
+// Frame header (naturally aligned so there is no padding).  Times are the camera's
+// esp_timer microseconds since boot; the stages let the receiver separate acquisition,
+// queueing and network delays, and frame_seq / lep_frame_count gaps show frames lost
+// in the camera and in the Lepton.
+typedef struct {
+	uint32_t magic;              // RSP_PROTO_MAGIC
+	uint8_t version;             // RSP_PROTO_VERSION
+	uint8_t hdr_len;             // Bytes in this header
+	uint8_t encoding;            // RSP_ENC_* of the payload
+	uint8_t flags;               // RSP_FLAG_*
+	uint16_t width;              // Sensor geometry
+	uint16_t height;
+	uint32_t frame_seq;          // Local frame sequence number
+	uint32_t lep_frame_count;    // Lepton telemetry frame counter (0 without telemetry)
+	uint16_t min_val;            // Pixel range of the frame
+	uint16_t max_val;
+	int64_t vsync_usec;          // VSYNC that started the frame
+	int64_t acq_usec;            // Frame acquired by lepton_task
+	int64_t publish_usec;        // Frame handed to the consumers
+	int64_t dequeue_usec;        // Frame taken by send_task
+	int64_t send_usec;           // Frame written to the socket
+	uint16_t bad_rows;           // Rows that failed their CRC check or were missed
+	uint16_t telem_words;        // Telemetry words following the header
+	uint32_t payload_len;        // Encoded image bytes following the telemetry
+	uint32_t payload_crc;        // CRC-32 (zlib) of the telemetry and payload
+	uint32_t reserved;
+} rsp_frame_hdr_t;
+_Static_assert(sizeof(rsp_frame_hdr_t) == 80, "rsp_frame_hdr_t must not be padded");
+
+// Header at the start of each UDP_STREAMING datagram
+typedef struct {
+	uint32_t frame_seq;
+	uint16_t frag_index;         // 0 - frag_count-1
+	uint16_t frag_count;
+	uint32_t payload_offset;     // Where this fragment's bytes go in the payload (0 for fragment 0)
+} rsp_udp_hdr_t;
+_Static_assert(sizeof(rsp_udp_hdr_t) == 12, "rsp_udp_hdr_t must not be padded");
+
+// Header at the start of an RSP_ENC_TILE_DELTA payload
+typedef struct {
+	uint32_t base_seq;           // frame_seq of the frame this one updates
+	uint8_t flags;               // RSP_DELTA_*
+	uint8_t tile_w;              // Tile size in pixels
+	uint8_t tile_h;
+	uint8_t reserved;
+	uint16_t tiles;              // Tiles in the frame
+	uint16_t tiles_sent;         // Tiles present in this payload
+} rsp_delta_hdr_t;
+_Static_assert(sizeof(rsp_delta_hdr_t) == 12, "rsp_delta_hdr_t must not be padded");
+
+// Header sent ahead of each segment's pixels in SEGMENT_STREAMING mode
+typedef struct __attribute__((packed)) {
+	uint32_t frame_seq;
+	uint16_t first_pixel;
+	uint16_t num_pixels;
+	uint8_t segment;
+} rsp_segment_hdr_t;
+
+#endif /* RSP_PROTOCOL_H */
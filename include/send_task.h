@@ -18,19 +18,49 @@
 #ifndef RSP_TASK_H
 #define RSP_TASK_H
 
+#include <stdbool.h>
 #include <stdint.h>
+#include "frame_delta.h"
+#include "frame_ring.h"
+#include "frame_sub.h"
+#include "rate_ctrl.h"
+#include "rsp_protocol.h"
 
 
 //
 // RSP Task Constants
 //
 
-// Task evaluation interval
-#define RSP_TASK_SLEEP_MSEC 20
+// Task stack sizes (bytes)
+#define RSP_TASK_STACK_SIZE 3072
+#define RSP_ANNOUNCE_TASK_STACK_SIZE 3072
+
+// Longest send_task blocks waiting for work before running its housekeeping
+#define RSP_TASK_HOUSEKEEPING_MSEC 1000
+
+// Interval between send statistics log messages when LOG_SEND_STATS is defined
+#define RSP_STATS_LOG_SECS 10
 
 // Response Task notifications
-#define RSP_NOTIFY_LEP_FRAME_MASK_0    0x00000010
-#define RSP_NOTIFY_LEP_FRAME_MASK_1    0x00000020
+#define RSP_NOTIFY_LEP_FRAME_MASK      0x00000010
+#define RSP_NOTIFY_LEP_SEGMENT_MASK    0x00000040
+
+
+// Stream connection retry backoff, doubling from min to max while the server is unreachable
+#define RSP_RECONNECT_MIN_MSEC 250
+#define RSP_RECONNECT_MAX_MSEC 8000
+
+// Longest a frame may take to write (the socket is non-blocking, so a frame in flight
+// holds its slot for at most this long) before the connection is considered dead
+#define RSP_SEND_TIMEOUT_MSEC    2000
+
+// Longest a connection attempt may take, and the HTTP announcement announce_task makes
+// once it is up (TCP only)
+#define RSP_CONNECT_TIMEOUT_MSEC 3000
+#define RSP_HTTP_TIMEOUT_MSEC    2000
+
+// Longest send_task waits on the socket at a time while a frame is in flight
+#define RSP_IO_POLL_MSEC         20
 
 
 #define WEB_SERVER "192.168.4.2"
@@ -41,14 +71,96 @@
 #define MAX_HTTP_RECV_BUFFER 512
 #define MAX_HTTP_OUTPUT_BUFFER 2048
 
+// Largest UDP payload that fits a 1500 byte MTU unfragmented and the raw image rows
+// that fit in one fragment after its header
+#define RSP_UDP_MAX_PAYLOAD    1472
+#define RSP_UDP_ROWS_PER_FRAG  ((int) ((RSP_UDP_MAX_PAYLOAD - sizeof(rsp_udp_hdr_t)) / (LEP_WIDTH * 2)))
+
+// Compute the payload CRC (costs a pass over every frame; 0 to skip)
+#define RSP_PAYLOAD_CRC 1
+
+// Payload encoding of the frame stream (tools/codec/codec_bench measures them):
+//   RSP_ENC_RAW16       the pixels as they are
+//   RSP_ENC_RICE        lossless compression to roughly a third of the bytes, for a few
+//                       mSec of send_task time per frame and a frame sized encode buffer
+//   RSP_ENC_TILE_DELTA  only the tiles that changed since the last frame sent, each
+//                       compressed as RSP_ENC_RICE, for a second frame sized buffer
+#define RSP_STREAM_ENCODING RSP_ENC_RAW16
+
+// RSP_ENC_TILE_DELTA tuning: the largest pixel change (counts, 0.01 K in TLinear mode)
+// a tile may skip, 0 for lossless, and the frames between keyframes (about 10 seconds)
+#define RSP_DELTA_THRESHOLD       0
+#define RSP_DELTA_KEYFRAME_FRAMES 90
+
+// Adaptive rate control (rate_ctrl.h): send only as many frames as the link sustains
+// (1), or every frame (0).  The send interval backs off as far as
+// RSP_RATE_MAX_INTERVAL_MSEC when sends block, fail or frames are dropped, or when
+// frames take longer than RSP_RATE_TARGET_LATENCY_MSEC from publish to sent.  Queued
+// frames older than RSP_MAX_FRAME_AGE_MSEC (system_config.h) are never sent.
+#define RSP_RATE_CONTROL             1
+#define RSP_RATE_MAX_INTERVAL_MSEC   2000
+#define RSP_RATE_TARGET_LATENCY_MSEC 300
+
+// With RSP_ENC_TILE_DELTA rate control also coarsens the tile threshold by this many
+// counts per level under congestion, up to RSP_RATE_MAX_LEVEL levels
+#define RSP_RATE_LEVEL_THRESHOLD     10
+#define RSP_RATE_MAX_LEVEL           3
+
+// Encode buffer size; a frame that does not encode smaller than this is sent raw
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+#define RSP_ENC_BUF_BYTES FRAME_DELTA_MAX_BYTES(LEP_WIDTH, LEP_HEIGHT)
+#else
+#define RSP_ENC_BUF_BYTES (LEP_NUM_PIXELS * 2)
+#endif
+
+typedef struct {
+	uint32_t dequeue_count;          // Frames taken from send_frame_sub
+	uint32_t dequeue_usec_last;      // lepton_task publish to send_task dequeue latency
+	uint32_t dequeue_usec_max;
+	uint64_t dequeue_usec_sum;
+	uint32_t wire_count;             // Frames or segments handed to the network stack
+	uint32_t wire_usec_last;         // Acquisition to network stack latency
+	uint32_t wire_usec_max;
+	uint64_t wire_usec_sum;
+	uint32_t connects;               // Stream connections established
+	uint32_t connect_failures;       // Connection attempts that failed
+	uint32_t disconnects;            // Established connections lost
+	uint32_t unsent;                 // Frames or segments dropped with no connection
+	uint32_t datagrams;              // UDP fragments sent (UDP_STREAMING)
+	uint32_t datagram_errors;        // UDP fragments lwIP could not take (rest of frame dropped)
+	uint64_t payload_bytes;          // Image payload bytes of the frames sent
+	uint32_t encoded;                // Frames encoded with RSP_STREAM_ENCODING
+	uint32_t encode_fallbacks;       // Frames sent raw because they did not encode smaller
+	uint32_t encode_usec_max;        // Time spent encoding frames
+	uint64_t encode_usec_sum;
+	uint32_t stale;                  // Frames older than RSP_MAX_FRAME_AGE_MSEC and segments whose
+	                                 // pixels may have been reused, dropped
+	uint32_t partial_writes;         // Sends the socket took only part of
+	uint32_t send_timeouts;          // Frames or segments not written within RSP_SEND_TIMEOUT_MSEC
+	uint32_t connect_timeouts;       // Connection attempts not completed within RSP_CONNECT_TIMEOUT_MSEC
+	uint32_t reconnects;             // Connections established after the first
+	uint32_t announce_failures;      // HTTP announcements of a new connection that failed
+} rsp_task_stats_t;
+
 typedef enum protocol {
     TCP_FLAG,
     UDP_FLAG
 } t_protocol;
 
+// send_task's subscription to the frames lepton_task publishes
+extern frame_sub_t send_frame_sub;
+
 //
 // RSP Task API
 //
+bool send_buffer_init();
 void send_task();
+void announce_task();
+void send_get_stats(rsp_task_stats_t* statsP);
+void send_get_rate_stats(rate_ctrl_stats_t* statsP);
+
+// Frame headers for any transport
+void rsp_frame_hdr_init(rsp_frame_hdr_t* hdrP, const lep_buffer_t* bufP, int64_t dequeue_usec);
+void rsp_frame_hdr_crc(rsp_frame_hdr_t* hdrP, const uint16_t* telemP, const void* payloadP);
 
 #endif /* RSP_TASK_H */
\ No newline at end of file
@@ -52,5 +52,92 @@
 #define LEP_DMA_NUM     2
 #define LEP_SPI_FREQ_HZ 16000000
 
+// Lepton sensor geometry (a LEP_PROFILE_* from vospi.h)
+#ifndef LEP_PROFILE
+#define LEP_PROFILE     LEP_PROFILE_LEPTON3
+#endif
+
+// VoSPI packet CRC handling (a vospi_crc_mode_t)
+#define LEP_CRC_MODE    VOSPI_CRC_DROP_ROW
+
+
+//
+// Streaming Configuration
+//
+
+// Uncomment to publish each completed VoSPI segment to send_task as soon as it
+// arrives (cut-through) instead of only whole frames
+//#define SEGMENT_STREAMING
+
+// Uncomment to stream frames as UDP datagrams of a few rows each instead of over a
+// TCP connection.  Lost datagrams lose their rows but never delay later frames.
+//#define UDP_STREAMING
+
+// Uncomment to also serve frames to clients on the soft AP from an on-device HTTP
+// server (GET /stream, /snapshot and /ws on HTTP_SERVER_PORT, see http_task.c).  Each
+// stream client holds up to HTTP_CLIENT_QUEUE_DEPTH frames plus the one it is being
+// sent, and the server keeps the latest frame for snapshots (HTTP_POOL_FRAMES in
+// all), which the frame pool below makes room for.  Needs PSRAM.
+//#define HTTP_STREAMING
+
+#if defined(UDP_STREAMING) && defined(SEGMENT_STREAMING)
+#error "UDP_STREAMING sends whole frames and cannot be combined with SEGMENT_STREAMING"
+#endif
+
+// Oldest frame send_task sends (older ones are dropped so that after a stall the stream
+// resumes with current frames).  send_task's ring never holds more frames than arrive
+// in this time: a frame any further back could only ever be dropped.
+#define RSP_MAX_FRAME_AGE_MSEC 1000
+#define RSP_MAX_FRAME_AGE_FRAMES (RSP_MAX_FRAME_AGE_MSEC * 1000 / LEP_FRAME_PERIOD_USEC)
+
+// Frame buffer placement (heap capabilities, or section attribute for STATIC_ALLOCATION)
+// and depth.  Only the VoSPI packet buffer is a DMA target (packets are unpacked from
+// it into the frames), so frames can live anywhere.  With
+// PSRAM (WROVER modules, enable it in menuconfig) send_task's ring covers
+// RSP_MAX_FRAME_AGE_MSEC and the pool has room for the HTTP clients, leaving internal
+// RAM to lwIP; without it a few frames have to fit in internal RAM.
+//
+// Each consumer may hold its ring depth plus the frame it is working on (its quota,
+// see frame_sub.h) and lepton_task needs one more to load.  The pool covers every
+// quota so a slow consumer never starves the others; lepton_task.c refuses to build
+// if it doesn't.
+#if defined(CONFIG_SPIRAM_SUPPORT) || defined(CONFIG_ESP32_SPIRAM_SUPPORT)
+#define LEP_FRAME_MEM_CAPS    (MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT)
+#define LEP_FRAME_MEM_ATTR    EXT_RAM_ATTR
+#define LEP_FRAME_RING_DEPTH  RSP_MAX_FRAME_AGE_FRAMES
+#ifdef HTTP_STREAMING
+#define LEP_FRAME_POOL_SIZE   (LEP_FRAME_RING_DEPTH + 2 + HTTP_POOL_FRAMES)
+#else
+#define LEP_FRAME_POOL_SIZE   (LEP_FRAME_RING_DEPTH + 2)
+#endif
+#else
+#define LEP_FRAME_MEM_CAPS    (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT)
+#define LEP_FRAME_MEM_ATTR
+#define LEP_FRAME_POOL_SIZE   3
+#define LEP_FRAME_RING_DEPTH  1
+#ifdef HTTP_STREAMING
+#error "HTTP_STREAMING needs PSRAM: the stream clients' frame quotas do not fit in internal RAM"
+#endif
+#endif
+
+// What to discard when send_task falls behind (see frame_ring.h)
+#define LEP_FRAME_RING_POLICY FRAME_RING_DROP_OLDEST
+
+
+//
+// Memory Configuration
+//
+
+// Uncomment to allocate every task stack, queue, mutex and buffer the firmware owns
+// statically instead of from the heap during startup, so none of them can fail to
+// allocate or fragment the heap on a long running unit.  app_main logs the memory
+// budget either way.
+//#define STATIC_ALLOCATION
+
+#if defined(STATIC_ALLOCATION) && (defined(CONFIG_SPIRAM_SUPPORT) || defined(CONFIG_ESP32_SPIRAM_SUPPORT)) && \
+    !defined(CONFIG_SPIRAM_ALLOW_BSS_SEG_EXTERNAL_MEMORY)
+#error "STATIC_ALLOCATION with PSRAM frames needs CONFIG_SPIRAM_ALLOW_BSS_SEG_EXTERNAL_MEMORY"
+#endif
+
 
 #endif // SYSTEM_CONFIG_H
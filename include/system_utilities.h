@@ -21,11 +21,24 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "system_config.h"
 #include <stdbool.h>
 #include <stdint.h>
 
 
+//
+// System Utilities constants
+//
+
+// Coarse frame histogram: LEP_HIST_BINS bins of (1 << LEP_HIST_SHIFT) counts each
+#define LEP_HIST_SHIFT 10
+#define LEP_HIST_BINS  (65536 >> LEP_HIST_SHIFT)
+
+// Completed segments that may be waiting for send_task in SEGMENT_STREAMING mode
+#define LEP_SEGMENT_QUEUE_LEN 4
+
+
 //
 // System Utilities typedefs
 //
@@ -36,29 +49,52 @@
 #define Notification(var, mask) ((var & mask) == mask)
 
 
-// Buffer typedef
+// Buffer typedef - one frame, shared between tasks through the frame pool
 typedef struct {
 	bool telem_valid;
 	uint16_t lep_min_val;
 	uint16_t lep_max_val;
+	uint32_t lep_sum;
+	uint16_t lep_hist[LEP_HIST_BINS];
+	uint16_t bad_rows;           // Rows in this frame that failed their CRC check or were missed
 	uint16_t* lep_bufferP;
 	uint16_t* lep_telemP;
-	SemaphoreHandle_t lep_mutex;
+	uint32_t frame_seq;          // Frames completed before this one (matches lep_segment_t)
+	uint32_t lep_frame_count;    // Lepton telemetry frame counter (0 without telemetry)
+	int64_t vsync_usec;          // VSYNC that started the frame's first segment
+	int64_t acq_usec;            // When the frame was completed
+	int64_t publish_usec;        // When lepton_task handed the frame to the consumers
 } lep_buffer_t;
 
+// Segment typedef - one completed VoSPI segment of the frame being acquired.
+// The pixels stay in place for at least LEP_FRAME_PERIOD_USEC after acq_usec, until
+// the frame after next is being acquired, so consumers copy them out first.  A frame
+// abandoned during resynchronization may overwrite its published segments, so
+// receivers should treat a frame_seq without its last segment as incomplete.
+typedef struct {
+	uint32_t frame_seq;          // Frames completed before the one this segment belongs to
+	uint8_t segment;             // 1 - LEP_SEGMENTS
+	uint16_t first_pixel;        // Offset of the segment's first pixel in the frame
+	uint16_t num_pixels;         // Image pixels in the segment (telemetry excluded)
+	uint16_t* pixelsP;
+	int64_t acq_usec;            // When the segment was completed
+} lep_segment_t;
+
 
 //
 // Task handle externs for use by tasks to communicate with each other
 //
 extern TaskHandle_t task_handle_lepton;
 extern TaskHandle_t task_handle_send;
+extern TaskHandle_t task_handle_announce;
+extern TaskHandle_t task_handle_http;
 
 //
 // Global buffer pointers for allocated memory
 //
 
 // Shared memory data structures
-extern lep_buffer_t lep_buffer[2];   // Ping-pong buffer loaded by lepton_task for send_task
+extern QueueHandle_t lep_segment_queue;  // Completed segments for send_task (SEGMENT_STREAMING)
 
 
 #endif /* SYSTEM_UTILITIES_H */
\ No newline at end of file
@@ -0,0 +1,272 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Lossless frame codec for 16-bit thermal images.
+ *
+ * Each pixel is predicted from its already coded neighbours with the LOCO-I median
+ * edge detector (left, up and up-left; left only on the first row and up only in the
+ * first column) and the prediction error is Rice coded.  Thermal scenes are smooth,
+ * so the errors are mostly a few counts of sensor noise and cost a handful of bits
+ * instead of 16.
+ *
+ * Bitstream (MSB first, no header; the geometry comes from the frame header):
+ *   rows top to bottom, each split into blocks of FRAME_CODEC_BLOCK_PIXELS pixels
+ *   (the last one of a row may be shorter), each block being
+ *     4 bits   Rice parameter k for the block
+ *     per pixel, the error e = (pixel - prediction) mod 2^16 taken as signed and
+ *     mapped to u = 2e (e >= 0) or -2e-1 (e < 0), coded as
+ *       q = u >> k ones, a zero, then the k low bits of u     (q < FRAME_CODEC_ESCAPE_Q)
+ *       FRAME_CODEC_ESCAPE_Q ones then the 16 bits of u       (otherwise)
+ *   zero padding to a byte boundary.
+ *
+ * k is chosen per block from the mean of its mapped errors so the code follows the
+ * local noise level (flat background vs. edges of warm objects).  Encoding is one
+ * pass over the frame with no tables, which keeps it cheap enough for send_task.
+ */
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "frame_codec.h"
+
+
+
+//
+// Frame Codec Data structures
+//
+typedef struct {
+	uint8_t* p;
+	uint8_t* end;
+	uint32_t acc;              // Pending bits are the low n bits
+	int n;
+	bool overflow;
+} bit_writer_t;
+
+typedef struct {
+	const uint8_t* p;
+	const uint8_t* end;
+	uint32_t acc;
+	int n;
+} bit_reader_t;
+
+
+
+//
+// Frame Codec Forward Declarations for internal functions
+//
+static inline int predict(const uint16_t* rowP, const uint16_t* upP, int x);
+static inline int rice_k(uint32_t sum, int n);
+static inline void put_bits(bit_writer_t* bwP, uint32_t v, int nbits);
+static inline void put_rice(bit_writer_t* bwP, uint32_t u, int k);
+static inline bool get_bits(bit_reader_t* brP, int nbits, uint32_t* vP);
+static inline bool get_rice(bit_reader_t* brP, int k, uint32_t* uP);
+
+
+
+//
+// Frame Codec API
+//
+
+/**
+ * Encode a width x height image whose rows are stride pixels apart (a whole frame, or
+ * a tile of one) into out.  Returns the encoded length, or 0 if it does not fit in
+ * cap bytes (FRAME_CODEC_MAX_BYTES always fits).
+ */
+int frame_codec_encode(const uint16_t* pixels, int width, int height, int stride, uint8_t* out, int cap)
+{
+	bit_writer_t bw;
+	uint16_t u[FRAME_CODEC_BLOCK_PIXELS];
+	const uint16_t* rowP;
+	const uint16_t* upP;
+	uint32_t sum;
+	int16_t e;
+	int r, c, i, n, k;
+	
+	bw.p = out;
+	bw.end = out + cap;
+	bw.acc = 0;
+	bw.n = 0;
+	bw.overflow = false;
+	
+	for (r = 0; r < height; r++) {
+		rowP = &pixels[r * stride];
+		upP = (r == 0) ? NULL : rowP - stride;
+		for (c = 0; c < width; c += n) {
+			n = width - c;
+			if (n > FRAME_CODEC_BLOCK_PIXELS) n = FRAME_CODEC_BLOCK_PIXELS;
+			
+			sum = 0;
+			for (i = 0; i < n; i++) {
+				e = (int16_t) (rowP[c+i] - predict(rowP, upP, c+i));
+				u[i] = (e >= 0) ? (uint16_t) (2 * e) : (uint16_t) (-2 * e - 1);
+				sum += u[i];
+			}
+			
+			k = rice_k(sum, n);
+			put_bits(&bw, k, 4);
+			for (i = 0; i < n; i++) {
+				put_rice(&bw, u[i], k);
+			}
+			if (bw.overflow) return 0;
+		}
+	}
+	
+	// Pad the last byte
+	if (bw.n != 0) put_bits(&bw, 0, 8 - bw.n);
+	
+	return bw.overflow ? 0 : (int) (bw.p - out);
+}
+
+
+/**
+ * Decode an image encoded by frame_codec_encode into rows stride pixels apart.
+ * Returns false if in is truncated or does not end where the image does.
+ */
+bool frame_codec_decode(const uint8_t* in, int len, int width, int height, int stride, uint16_t* pixels)
+{
+	bit_reader_t br;
+	uint16_t* rowP;
+	const uint16_t* upP;
+	uint32_t k, u;
+	int r, c, i, n;
+	
+	br.p = in;
+	br.end = in + len;
+	br.acc = 0;
+	br.n = 0;
+	
+	for (r = 0; r < height; r++) {
+		rowP = &pixels[r * stride];
+		upP = (r == 0) ? NULL : rowP - stride;
+		for (c = 0; c < width; c += n) {
+			n = width - c;
+			if (n > FRAME_CODEC_BLOCK_PIXELS) n = FRAME_CODEC_BLOCK_PIXELS;
+			
+			if (!get_bits(&br, 4, &k)) return false;
+			for (i = 0; i < n; i++) {
+				if (!get_rice(&br, k, &u)) return false;
+				rowP[c+i] = (uint16_t) (predict(rowP, upP, c+i) + (int) ((u >> 1) ^ -(u & 1)));
+			}
+		}
+	}
+	
+	return (br.p == br.end);
+}
+
+
+
+//
+// Frame Codec internal functions
+//
+
+/**
+ * LOCO-I median edge detector prediction of pixel x of a row (upP is NULL on the
+ * first row)
+ */
+static inline int predict(const uint16_t* rowP, const uint16_t* upP, int x)
+{
+	int a, b, c;
+	
+	if (upP == NULL) return (x == 0) ? 0 : rowP[x-1];
+	if (x == 0) return upP[0];
+	
+	a = rowP[x-1];
+	b = upP[x];
+	c = upP[x-1];
+	if (c >= a && c >= b) return (a < b) ? a : b;
+	if (c <= a && c <= b) return (a > b) ? a : b;
+	return a + b - c;
+}
+
+
+/**
+ * Smallest k (up to 15) with n * 2^k >= sum, i.e. 2^k at least the mean mapped error
+ */
+static inline int rice_k(uint32_t sum, int n)
+{
+	int k = 0;
+	
+	while ((k < 15) && (((uint32_t) n << k) < sum)) k++;
+	return k;
+}
+
+
+/**
+ * Append the low nbits (at most 24) of v
+ */
+static inline void put_bits(bit_writer_t* bwP, uint32_t v, int nbits)
+{
+	bwP->acc = (bwP->acc << nbits) | v;
+	bwP->n += nbits;
+	while (bwP->n >= 8) {
+		bwP->n -= 8;
+		if (bwP->p < bwP->end) {
+			*bwP->p++ = (uint8_t) (bwP->acc >> bwP->n);
+		} else {
+			bwP->overflow = true;
+		}
+	}
+}
+
+
+static inline void put_rice(bit_writer_t* bwP, uint32_t u, int k)
+{
+	uint32_t q = u >> k;
+	
+	if (q < FRAME_CODEC_ESCAPE_Q) {
+		put_bits(bwP, ((1UL << q) - 1) << 1, q + 1);
+		if (k != 0) put_bits(bwP, u & ((1UL << k) - 1), k);
+	} else {
+		put_bits(bwP, (1UL << FRAME_CODEC_ESCAPE_Q) - 1, FRAME_CODEC_ESCAPE_Q);
+		put_bits(bwP, u, 16);
+	}
+}
+
+
+/**
+ * Read the next nbits (at most 24)
+ */
+static inline bool get_bits(bit_reader_t* brP, int nbits, uint32_t* vP)
+{
+	while (brP->n < nbits) {
+		if (brP->p >= brP->end) return false;
+		brP->acc = (brP->acc << 8) | *brP->p++;
+		brP->n += 8;
+	}
+	brP->n -= nbits;
+	*vP = (brP->acc >> brP->n) & ((1UL << nbits) - 1);
+	return true;
+}
+
+
+static inline bool get_rice(bit_reader_t* brP, int k, uint32_t* uP)
+{
+	uint32_t q, bit, r;
+	
+	for (q = 0; q < FRAME_CODEC_ESCAPE_Q; q++) {
+		if (!get_bits(brP, 1, &bit)) return false;
+		if (bit == 0) break;
+	}
+	if (q == FRAME_CODEC_ESCAPE_Q) {
+		return get_bits(brP, 16, uP);
+	}
+	
+	r = 0;
+	if ((k != 0) && !get_bits(brP, k, &r)) return false;
+	*uP = (q << k) | r;
+	return true;
+}
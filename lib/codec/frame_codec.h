@@ -0,0 +1,47 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef FRAME_CODEC_H
+#define FRAME_CODEC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+//
+// Frame Codec Constants
+//
+
+// Pixels sharing one Rice parameter (rows are split into blocks of this many pixels)
+#define FRAME_CODEC_BLOCK_PIXELS 16
+
+// Unary quotient that escapes to a raw 16-bit residual
+#define FRAME_CODEC_ESCAPE_Q     20
+
+// Worst case encoded size of a frame (every residual escaped)
+#define FRAME_CODEC_MAX_BYTES(w, h) \
+	((((w) * (h) * (FRAME_CODEC_ESCAPE_Q + 16)) + ((((w) + FRAME_CODEC_BLOCK_PIXELS - 1) / FRAME_CODEC_BLOCK_PIXELS) * (h) * 4) + 7) / 8)
+
+
+
+//
+// Frame Codec API
+//
+int frame_codec_encode(const uint16_t* pixels, int width, int height, int stride, uint8_t* out, int cap);
+bool frame_codec_decode(const uint8_t* in, int len, int width, int height, int stride, uint16_t* pixels);
+
+#endif /* FRAME_CODEC_H */
@@ -0,0 +1,292 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Temporal tile delta encoding.
+ *
+ * A camera watching static equipment sees almost the same image every frame, so
+ * instead of the whole frame only the tiles that changed since the image the
+ * receiver already holds are sent, each compressed with the frame codec (see
+ * RSP_ENC_TILE_DELTA in rsp_protocol.h for the payload layout).  A tile counts as
+ * changed when any of its pixels differs from the reference by more than the
+ * threshold; 0 sends every change and is lossless, a few counts of sensor noise
+ * lets a static scene skip most tiles.
+ *
+ * Keyframes send every tile.  One is sent for the first frame, after a reset (a new
+ * connection, or the receiver losing a frame) and every keyframe_frames frames so a
+ * receiver that joins or loses data recovers in bounded time.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "frame_codec.h"
+#include "frame_delta.h"
+
+
+
+//
+// Frame Delta Forward Declarations for internal functions
+//
+static bool tile_changed(const frame_delta_t* dP, const uint16_t* pixels, int x0, int y0, int tw, int th);
+static void copy_tile(void* dstP, int dst_stride, const void* srcP, int src_stride, int tw, int th);
+static void update_stats(frame_delta_t* dP, bool key, int tiles_sent, int len);
+
+
+
+//
+// Frame Delta API
+//
+
+/**
+ * Set up one end of a delta stream using refP (width * height pixels) as its
+ * reference image
+ */
+bool frame_delta_init(frame_delta_t* dP, int width, int height, uint16_t* refP, uint16_t threshold, int keyframe_frames)
+{
+	if ((refP == NULL) || (FRAME_DELTA_TILES(width, height) > 0xFFFF)) {
+		return false;
+	}
+	
+	memset(dP, 0, sizeof(frame_delta_t));
+	dP->width = width;
+	dP->height = height;
+	dP->tiles_x = (width + FRAME_DELTA_TILE_W - 1) / FRAME_DELTA_TILE_W;
+	dP->tiles_y = (height + FRAME_DELTA_TILE_H - 1) / FRAME_DELTA_TILE_H;
+	dP->threshold = threshold;
+	dP->keyframe_frames = keyframe_frames;
+	dP->refP = refP;
+	
+	return true;
+}
+
+
+/**
+ * Forget the reference so that the next frame is a keyframe
+ */
+void frame_delta_reset(frame_delta_t* dP)
+{
+	dP->ref_valid = false;
+}
+
+
+/**
+ * Change the threshold of an encoder.  Raising it takes effect at once; after
+ * lowering it, tiles the receiver holds within the old threshold are refreshed as
+ * they change or at the next keyframe.
+ */
+void frame_delta_set_threshold(frame_delta_t* dP, uint16_t threshold)
+{
+	dP->threshold = threshold;
+}
+
+
+/**
+ * Encode frame seq into out (cap must be at least FRAME_DELTA_MAX_BYTES) and make it
+ * the reference.  Returns the encoded length, or 0 if out is too small.
+ */
+int frame_delta_encode(frame_delta_t* dP, const uint16_t* pixels, uint32_t seq, uint8_t* out, int cap)
+{
+	rsp_delta_hdr_t hdr;
+	const int tiles = dP->tiles_x * dP->tiles_y;
+	uint8_t* bitmapP = out + sizeof(rsp_delta_hdr_t);
+	uint8_t* p = bitmapP + (tiles + 7) / 8;
+	bool key;
+	int tx, ty, x0, y0, tw, th, i, len, raw;
+	int sent = 0;
+	
+	if (cap < (int) FRAME_DELTA_MAX_BYTES(dP->width, dP->height)) {
+		return 0;
+	}
+	
+	key = !dP->ref_valid || ((dP->keyframe_frames != 0) && (dP->since_keyframe >= dP->keyframe_frames));
+	memset(bitmapP, 0, (tiles + 7) / 8);
+	
+	for (ty = 0, i = 0; ty < dP->tiles_y; ty++) {
+		y0 = ty * FRAME_DELTA_TILE_H;
+		th = ((dP->height - y0) < FRAME_DELTA_TILE_H) ? dP->height - y0 : FRAME_DELTA_TILE_H;
+		for (tx = 0; tx < dP->tiles_x; tx++, i++) {
+			x0 = tx * FRAME_DELTA_TILE_W;
+			tw = ((dP->width - x0) < FRAME_DELTA_TILE_W) ? dP->width - x0 : FRAME_DELTA_TILE_W;
+			
+			if (!key && !tile_changed(dP, pixels, x0, y0, tw, th)) continue;
+			
+			// Compressed unless that is no smaller than the raw pixels
+			raw = tw * th * 2;
+			len = frame_codec_encode(&pixels[y0 * dP->width + x0], tw, th, dP->width, p + 2, raw - 1);
+			if (len == 0) {
+				copy_tile(p + 2, tw * 2, &pixels[y0 * dP->width + x0], dP->width * 2, tw, th);
+				len = raw;
+			}
+			p[0] = len & 0xFF;
+			p[1] = len >> 8;
+			p += 2 + len;
+			
+			// The receiver now holds this tile
+			copy_tile(&dP->refP[y0 * dP->width + x0], dP->width * 2, &pixels[y0 * dP->width + x0], dP->width * 2, tw, th);
+			bitmapP[i / 8] |= 1 << (i % 8);
+			sent++;
+		}
+	}
+	
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.base_seq = dP->ref_seq;
+	hdr.flags = key ? RSP_DELTA_KEYFRAME : 0;
+	hdr.tile_w = FRAME_DELTA_TILE_W;
+	hdr.tile_h = FRAME_DELTA_TILE_H;
+	hdr.tiles = tiles;
+	hdr.tiles_sent = sent;
+	memcpy(out, &hdr, sizeof(hdr));
+	
+	dP->ref_valid = true;
+	dP->ref_seq = seq;
+	dP->since_keyframe = key ? 1 : dP->since_keyframe + 1;
+	len = p - out;
+	update_stats(dP, key, sent, len);
+	
+	return len;
+}
+
+
+/**
+ * Apply encoded frame seq to the reference image.  Returns false if the payload is
+ * malformed or is a delta against a frame that was not decoded, in which case
+ * decoding resumes at the next keyframe.
+ */
+bool frame_delta_decode(frame_delta_t* dP, const uint8_t* in, int len, uint32_t seq)
+{
+	rsp_delta_hdr_t hdr;
+	const int tiles = dP->tiles_x * dP->tiles_y;
+	const uint8_t* end = in + len;
+	const uint8_t* bitmapP = in + sizeof(rsp_delta_hdr_t);
+	const uint8_t* p = bitmapP + (tiles + 7) / 8;
+	uint16_t* tileP;
+	bool key;
+	int tx, ty, x0, y0, tw, th, i, tl;
+	int sent = 0;
+	
+	if (len < (int) (sizeof(rsp_delta_hdr_t) + (tiles + 7) / 8)) {
+		dP->ref_valid = false;
+		return false;
+	}
+	memcpy(&hdr, in, sizeof(hdr));
+	key = (hdr.flags & RSP_DELTA_KEYFRAME) != 0;
+	if ((hdr.tile_w != FRAME_DELTA_TILE_W) || (hdr.tile_h != FRAME_DELTA_TILE_H) || (hdr.tiles != tiles) ||
+	    (!key && (!dP->ref_valid || (hdr.base_seq != dP->ref_seq)))) {
+		dP->ref_valid = false;
+		return false;
+	}
+	
+	// From here on a failure leaves the reference part updated
+	dP->ref_valid = false;
+	for (ty = 0, i = 0; ty < dP->tiles_y; ty++) {
+		y0 = ty * FRAME_DELTA_TILE_H;
+		th = ((dP->height - y0) < FRAME_DELTA_TILE_H) ? dP->height - y0 : FRAME_DELTA_TILE_H;
+		for (tx = 0; tx < dP->tiles_x; tx++, i++) {
+			if ((bitmapP[i / 8] & (1 << (i % 8))) == 0) continue;
+			
+			x0 = tx * FRAME_DELTA_TILE_W;
+			tw = ((dP->width - x0) < FRAME_DELTA_TILE_W) ? dP->width - x0 : FRAME_DELTA_TILE_W;
+			if ((end - p) < 2) return false;
+			tl = p[0] | (p[1] << 8);
+			p += 2;
+			if ((end - p) < tl) return false;
+			
+			tileP = &dP->refP[y0 * dP->width + x0];
+			if (tl == tw * th * 2) {
+				copy_tile(tileP, dP->width * 2, p, tw * 2, tw, th);
+			} else if (!frame_codec_decode(p, tl, tw, th, dP->width, tileP)) {
+				return false;
+			}
+			p += tl;
+			sent++;
+		}
+	}
+	if ((p != end) || (sent != hdr.tiles_sent)) {
+		return false;
+	}
+	
+	dP->ref_valid = true;
+	dP->ref_seq = seq;
+	update_stats(dP, key, sent, len);
+	
+	return true;
+}
+
+
+void frame_delta_get_stats(const frame_delta_t* dP, frame_delta_stats_t* statsP)
+{
+	*statsP = dP->stats;
+}
+
+
+
+//
+// Frame Delta internal functions
+//
+
+/**
+ * True if any pixel of the tile moved more than the threshold from the reference
+ */
+static bool tile_changed(const frame_delta_t* dP, const uint16_t* pixels, int x0, int y0, int tw, int th)
+{
+	const uint16_t* curP;
+	const uint16_t* refP;
+	int r, c, d;
+	
+	for (r = 0; r < th; r++) {
+		curP = &pixels[(y0 + r) * dP->width + x0];
+		refP = &dP->refP[(y0 + r) * dP->width + x0];
+		if (dP->threshold == 0) {
+			if (memcmp(curP, refP, tw * 2) != 0) return true;
+		} else {
+			for (c = 0; c < tw; c++) {
+				d = curP[c] - refP[c];
+				if ((d > dP->threshold) || (d < -dP->threshold)) return true;
+			}
+		}
+	}
+	
+	return false;
+}
+
+
+/**
+ * Copy a tile's pixels between buffers whose rows are the given number of bytes apart
+ * (bytewise, as packed tiles in a payload are not aligned)
+ */
+static void copy_tile(void* dstP, int dst_stride, const void* srcP, int src_stride, int tw, int th)
+{
+	uint8_t* d = (uint8_t*) dstP;
+	const uint8_t* s = (const uint8_t*) srcP;
+	int r;
+	
+	for (r = 0; r < th; r++) {
+		memcpy(&d[r * dst_stride], &s[r * src_stride], tw * 2);
+	}
+}
+
+
+static void update_stats(frame_delta_t* dP, bool key, int tiles_sent, int len)
+{
+	dP->stats.frames++;
+	if (key) dP->stats.keyframes++;
+	dP->stats.tiles += dP->tiles_x * dP->tiles_y;
+	dP->stats.tiles_sent += tiles_sent;
+	dP->stats.bytes_last = len;
+	if ((uint32_t) len > dP->stats.bytes_max) dP->stats.bytes_max = len;
+	dP->stats.bytes_sum += len;
+}
@@ -0,0 +1,90 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef FRAME_DELTA_H
+#define FRAME_DELTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "rsp_protocol.h"
+
+
+//
+// Frame Delta Constants
+//
+
+// Tile size (tiles on the right and bottom edges are cut to fit the frame)
+#define FRAME_DELTA_TILE_W 16
+#define FRAME_DELTA_TILE_H 16
+
+#define FRAME_DELTA_TILES(w, h) \
+	((((w) + FRAME_DELTA_TILE_W - 1) / FRAME_DELTA_TILE_W) * (((h) + FRAME_DELTA_TILE_H - 1) / FRAME_DELTA_TILE_H))
+
+// Largest encoded frame (a keyframe none of whose tiles compress)
+#define FRAME_DELTA_MAX_BYTES(w, h) \
+	(sizeof(rsp_delta_hdr_t) + (FRAME_DELTA_TILES(w, h) + 7) / 8 + FRAME_DELTA_TILES(w, h) * 2 + (w) * (h) * 2)
+
+
+
+//
+// Frame Delta Data structures
+//
+typedef struct {
+	uint32_t frames;           // Frames encoded (or decoded)
+	uint32_t keyframes;
+	uint64_t tiles;            // Tiles examined
+	uint64_t tiles_sent;       // Tiles that were sent (hit rate is 1 - tiles_sent / tiles)
+	uint32_t bytes_last;       // Encoded frame size
+	uint32_t bytes_max;
+	uint64_t bytes_sum;
+} frame_delta_stats_t;
+
+// One end of a delta stream.  The reference is the image the receiver holds: the
+// encoder updates only the tiles it sends, so with a threshold no pixel the
+// receiver shows is ever further than threshold from the frame it was sent.
+typedef struct {
+	int width;
+	int height;
+	int tiles_x;
+	int tiles_y;
+	uint16_t threshold;        // Largest pixel change a tile may skip (0 = lossless)
+	int keyframe_frames;       // Frames between keyframes (0 = only after a reset)
+	uint16_t* refP;            // Reference image (width * height pixels)
+	bool ref_valid;
+	uint32_t ref_seq;          // frame_seq of the last frame encoded or decoded
+	int since_keyframe;
+	frame_delta_stats_t stats;
+} frame_delta_t;
+
+
+
+//
+// Frame Delta API
+//
+bool frame_delta_init(frame_delta_t* dP, int width, int height, uint16_t* refP, uint16_t threshold, int keyframe_frames);
+void frame_delta_reset(frame_delta_t* dP);
+void frame_delta_set_threshold(frame_delta_t* dP, uint16_t threshold);
+
+// Sender side
+int frame_delta_encode(frame_delta_t* dP, const uint16_t* pixels, uint32_t seq, uint8_t* out, int cap);
+
+// Receiver side (the decoded image is left in refP)
+bool frame_delta_decode(frame_delta_t* dP, const uint8_t* in, int len, uint32_t seq);
+
+void frame_delta_get_stats(const frame_delta_t* dP, frame_delta_stats_t* statsP);
+
+#endif /* FRAME_DELTA_H */
@@ -0,0 +1,149 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Reference counted frame pool.
+ *
+ * A fixed set of caller allocated frames (pixels, telemetry and metadata) each with
+ * an atomic reference count.  The producer acquires an unreferenced frame (count 0
+ * to 1), loads it and hands a reference to every consumer that wants it, typically
+ * by pushing it into each consumer's frame ring, then drops its own reference.
+ * Consumers read the shared frame in place and release it when done.  The frame is
+ * recycled when the last reference is released, so any number of consumers share
+ * one copy of the data.
+ *
+ * A referenced frame is read-only; only the producer writes a frame, and only while
+ * it holds the sole reference.
+ */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "frame_pool.h"
+
+
+
+//
+// Frame Pool Variables
+//
+static const char* TAG = "frame_pool";
+
+static lep_buffer_t* poolBufs;
+static int poolCount;
+static int nextIndex;                            // Where the next acquire starts looking
+static atomic_uint refCount[FRAME_POOL_MAX_FRAMES];
+static atomic_int inUse;
+
+// Statistics (only written by the producer)
+static frame_pool_stats_t stats;
+
+
+
+//
+// Frame Pool API
+//
+
+/**
+ * Set up the pool with count caller allocated frames, all initially unreferenced.
+ * Must be called before any task uses the pool.
+ */
+bool frame_pool_init(lep_buffer_t* bufs, int count)
+{
+	int i;
+
+	if ((count < 1) || (count > FRAME_POOL_MAX_FRAMES)) {
+		ESP_LOGE(TAG, "illegal pool size %d", count);
+		return false;
+	}
+
+	poolBufs = bufs;
+	poolCount = count;
+	nextIndex = 0;
+	for (i = 0; i < count; i++) {
+		atomic_store(&refCount[i], 0);
+	}
+	atomic_store(&inUse, 0);
+
+	return true;
+}
+
+
+/**
+ * Get an unreferenced frame for the producer to load, holding one reference.
+ * Never blocks.  Returns NULL if every frame is still referenced.
+ */
+lep_buffer_t* frame_pool_acquire()
+{
+	unsigned int expected;
+	int i, n, u;
+
+	for (n = 0; n < poolCount; n++) {
+		i = nextIndex;
+		if (++nextIndex == poolCount) nextIndex = 0;
+
+		expected = 0;
+		if (atomic_compare_exchange_strong(&refCount[i], &expected, 1)) {
+			stats.acquired++;
+			u = atomic_fetch_add(&inUse, 1) + 1;
+			if (u > (int) stats.max_in_use) stats.max_in_use = u;
+			return &poolBufs[i];
+		}
+	}
+
+	stats.exhausted++;
+	return NULL;
+}
+
+
+/**
+ * Take an additional reference on a frame the caller already holds a reference to
+ */
+void frame_pool_ref(lep_buffer_t* bufP)
+{
+	atomic_fetch_add_explicit(&refCount[bufP - poolBufs], 1, memory_order_relaxed);
+}
+
+
+/**
+ * Drop a reference.  The caller must not touch the frame afterwards.
+ */
+void frame_pool_release(lep_buffer_t* bufP)
+{
+	// Release ordering keeps the caller's reads of the frame ahead of its reuse
+	if (atomic_fetch_sub_explicit(&refCount[bufP - poolBufs], 1, memory_order_acq_rel) == 1) {
+		atomic_fetch_sub(&inUse, 1);
+	}
+}
+
+
+/**
+ * Number of frames currently referenced
+ */
+int frame_pool_in_use()
+{
+	return atomic_load(&inUse);
+}
+
+
+/**
+ * Get a snapshot of the pool statistics
+ */
+void frame_pool_get_stats(frame_pool_stats_t* statsP)
+{
+	*statsP = stats;
+}
@@ -0,0 +1,61 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef FRAME_POOL_H
+#define FRAME_POOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "system_utilities.h"
+
+
+//
+// Frame Pool Constants
+//
+
+// Maximum number of frames the pool can manage
+#define FRAME_POOL_MAX_FRAMES 64
+
+
+
+//
+// Frame Pool Data structures
+//
+typedef struct {
+	uint32_t acquired;         // Frames handed to the producer
+	uint32_t exhausted;        // Acquires that failed because every frame was referenced
+	uint32_t max_in_use;       // High water mark of referenced frames
+} frame_pool_stats_t;
+
+
+
+//
+// Frame Pool API
+//
+bool frame_pool_init(lep_buffer_t* bufs, int count);
+
+// Producer side (one task)
+lep_buffer_t* frame_pool_acquire();
+
+// Any task holding a reference
+void frame_pool_ref(lep_buffer_t* bufP);
+void frame_pool_release(lep_buffer_t* bufP);
+int frame_pool_in_use();
+
+void frame_pool_get_stats(frame_pool_stats_t* statsP);
+
+#endif /* FRAME_POOL_H */
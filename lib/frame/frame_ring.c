@@ -0,0 +1,178 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Lock-free single producer / single consumer frame ring.
+ *
+ * Each ring is one consumer's queue of frame pool references.  The producer pushes
+ * a frame it holds a reference to and the ring takes a reference of its own, so
+ * the same frame can be pushed into any number of rings without being copied.  The
+ * consumer pops a frame, reads it in place and drops the reference with
+ * frame_pool_release().
+ *
+ * The head index is a free running 32-bit count that only the producer advances, so
+ * the producer never waits for the consumer.  The tail is normally advanced by the
+ * consumer, but under FRAME_RING_DROP_OLDEST the producer may also claim the oldest
+ * entry when the ring is full; both sides claim an entry with a compare-and-swap on
+ * the tail and a side that loses the race simply tries again.
+ */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "frame_ring.h"
+#include "frame_pool.h"
+
+
+
+//
+// Frame Ring Variables
+//
+static const char* TAG = "frame_ring";
+
+
+
+//
+// Frame Ring Forward Declarations for internal functions
+//
+static lep_buffer_t* claim_oldest(frame_ring_t* ringP);
+
+
+
+//
+// Frame Ring API
+//
+
+/**
+ * Set up an empty ring holding up to depth frames.  Must be called before either
+ * task uses the ring.
+ */
+bool frame_ring_init(frame_ring_t* ringP, int depth, frame_ring_policy_t policy)
+{
+	if ((depth < 1) || (depth > FRAME_RING_MAX_DEPTH)) {
+		ESP_LOGE(TAG, "illegal ring depth %d", depth);
+		return false;
+	}
+
+	ringP->depth = depth;
+	ringP->policy = policy;
+	atomic_store(&ringP->head, 0);
+	atomic_store(&ringP->tail, 0);
+	memset(&ringP->stats, 0, sizeof(frame_ring_stats_t));
+
+	return true;
+}
+
+
+/**
+ * Queue a frame the caller holds a reference to for the consumer.  Never blocks.
+ * Returns true if the frame was queued (the ring took its own reference) or false if
+ * it was discarded under FRAME_RING_DROP_NEWEST.
+ */
+bool frame_ring_push(frame_ring_t* ringP, lep_buffer_t* bufP)
+{
+	unsigned int h = atomic_load_explicit(&ringP->head, memory_order_relaxed);
+	unsigned int n;
+	lep_buffer_t* oldP;
+
+	while ((h - atomic_load(&ringP->tail)) >= (unsigned int) ringP->depth) {
+		// The consumer has fallen behind
+		if (ringP->policy == FRAME_RING_DROP_NEWEST) {
+			ringP->stats.overruns++;
+			ringP->stats.dropped_newest++;
+			return false;
+		}
+		if ((oldP = claim_oldest(ringP)) != NULL) {
+			frame_pool_release(oldP);
+			ringP->stats.overruns++;
+			ringP->stats.dropped_oldest++;
+		}
+		// else the consumer just took it, which made room anyway
+	}
+
+	frame_pool_ref(bufP);
+	atomic_store_explicit(&ringP->q[h % ringP->depth], bufP, memory_order_relaxed);
+	atomic_store_explicit(&ringP->head, h + 1, memory_order_release);
+
+	ringP->stats.published++;
+	n = h + 1 - atomic_load_explicit(&ringP->tail, memory_order_relaxed);
+	if (n > ringP->stats.max_queued) ringP->stats.max_queued = n;
+
+	return true;
+}
+
+
+/**
+ * Number of frames waiting for the consumer (it may take some at any time)
+ */
+int frame_ring_count(frame_ring_t* ringP)
+{
+	return (int) (atomic_load_explicit(&ringP->head, memory_order_relaxed) - atomic_load(&ringP->tail));
+}
+
+
+/**
+ * Take the oldest frame for the consumer.  Returns NULL if there is none.  The
+ * caller owns the ring's reference and must give it up with frame_pool_release().
+ */
+lep_buffer_t* frame_ring_pop(frame_ring_t* ringP)
+{
+	lep_buffer_t* bufP = claim_oldest(ringP);
+
+	if (bufP != NULL) {
+		ringP->stats.consumed++;
+	}
+	return bufP;
+}
+
+
+/**
+ * Get a snapshot of a ring's statistics
+ */
+void frame_ring_get_stats(frame_ring_t* ringP, frame_ring_stats_t* statsP)
+{
+	*statsP = ringP->stats;
+}
+
+
+
+//
+// Frame Ring internal functions
+//
+
+/**
+ * Claim the oldest entry.  An entry read while the other side claims it may already
+ * be stale, but then the tail has moved and the compare-and-swap fails, so only a
+ * successfully claimed entry is used.
+ */
+static lep_buffer_t* claim_oldest(frame_ring_t* ringP)
+{
+	unsigned int t = atomic_load(&ringP->tail);
+	lep_buffer_t* bufP;
+
+	while (t != atomic_load_explicit(&ringP->head, memory_order_acquire)) {
+		bufP = atomic_load_explicit(&ringP->q[t % ringP->depth], memory_order_relaxed);
+		if (atomic_compare_exchange_weak(&ringP->tail, &t, t + 1)) {
+			return bufP;
+		}
+		// t now holds the current tail
+	}
+
+	return NULL;
+}
@@ -0,0 +1,82 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "system_utilities.h"
+
+
+//
+// Frame Ring Constants
+//
+
+// Maximum number of frames a ring can hold
+#define FRAME_RING_MAX_DEPTH 64
+
+
+
+//
+// Frame Ring Data structures
+//
+
+// What the producer gives up when the ring is full
+typedef enum {
+	FRAME_RING_DROP_OLDEST,    // Discard the oldest unread frame to make room
+	FRAME_RING_DROP_NEWEST     // Keep the queued frames and discard the new one
+} frame_ring_policy_t;
+
+typedef struct {
+	uint32_t published;        // Frames queued for the consumer
+	uint32_t consumed;         // Frames taken by the consumer
+	uint32_t overruns;         // Frames lost because the consumer fell behind
+	uint32_t dropped_oldest;   // Overruns that discarded a queued frame
+	uint32_t dropped_newest;   // Overruns that discarded the new frame
+	uint32_t max_queued;       // High water mark of frames waiting for the consumer
+} frame_ring_stats_t;
+
+// One consumer's queue of frame pool references.  Indices are free running counts;
+// head is only advanced by the producer, tail is claimed by compare-and-swap.
+typedef struct {
+	int depth;
+	frame_ring_policy_t policy;
+	_Atomic(lep_buffer_t*) q[FRAME_RING_MAX_DEPTH];
+	atomic_uint head;
+	atomic_uint tail;
+	frame_ring_stats_t stats;  // Each counter is only written by one side
+} frame_ring_t;
+
+
+
+//
+// Frame Ring API
+//
+bool frame_ring_init(frame_ring_t* ringP, int depth, frame_ring_policy_t policy);
+
+// Producer side (one task)
+bool frame_ring_push(frame_ring_t* ringP, lep_buffer_t* bufP);
+int frame_ring_count(frame_ring_t* ringP);
+
+// Consumer side (one task)
+lep_buffer_t* frame_ring_pop(frame_ring_t* ringP);
+
+void frame_ring_get_stats(frame_ring_t* ringP, frame_ring_stats_t* statsP);
+
+#endif /* FRAME_RING_H */
@@ -0,0 +1,267 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Frame subscriber registry.
+ *
+ * Every consumer of the producer's frames (send_task's stream, each HTTP and
+ * WebSocket client) is a subscriber with its own frame ring, so one that falls
+ * behind only loses its own frames.  frame_sub_publish() queues a reference to a new
+ * frame for every attached subscriber, holding each to the rate it asked for and to
+ * its pool quota, and evicts a subscriber that overruns its ring (or its quota)
+ * evict_overruns times within a window of FRAME_SUB_EVICT_WINDOW frames offered to
+ * it.  The producer never waits; an evicted subscriber gets no more frames until its
+ * consumer notices, drops the client and attaches a new one.
+ *
+ * Consumers take frames with frame_sub_pop(), take any extra references with
+ * frame_sub_ref() and give every one up with frame_sub_release(), so the registry
+ * knows how many pool frames each holds.  A subscriber that already holds its ring
+ * depth plus one gets no new frame until it releases one; with a pool sized for every
+ * quota (see lepton_task.c) the producer can always load the next frame.
+ *
+ * Subscribers are registered once during startup and never removed, so the producer
+ * walks the registry without locking.  A subscriber is attached by whichever task
+ * accepts its client and detached by its consumer; popping is a compare-and-swap, so
+ * either may drain the ring.
+ */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "esp_system.h"
+#include "esp_log.h"
+#include "frame_sub.h"
+#include "frame_ring.h"
+#include "frame_pool.h"
+
+
+
+//
+// Frame Subscriber Variables
+//
+static const char* TAG = "frame_sub";
+
+static frame_sub_t* subs[FRAME_SUB_MAX];
+static int num_subs;
+
+
+
+//
+// Frame Subscriber API
+//
+
+/**
+ * Add a detached subscriber with a ring of depth frames to the registry.  Must be
+ * called before the producer starts publishing.
+ */
+bool frame_sub_register(frame_sub_t* subP, const char* name, int depth, frame_ring_policy_t policy,
+                        frame_sub_notify_t notify, void* notify_arg)
+{
+	if (num_subs >= FRAME_SUB_MAX) {
+		ESP_LOGE(TAG, "no room to register %s", name);
+		return false;
+	}
+	if (!frame_ring_init(&subP->ring, depth, policy)) {
+		return false;
+	}
+
+	subP->name = name;
+	subP->notify = notify;
+	subP->notify_arg = notify_arg;
+	memset(&subP->prefs, 0, sizeof(frame_sub_prefs_t));
+	memset(&subP->stats, 0, sizeof(frame_sub_stats_t));
+	atomic_store(&subP->active, false);
+	atomic_store(&subP->evicted, false);
+	atomic_store(&subP->held, 0);
+	subs[num_subs++] = subP;
+
+	return true;
+}
+
+
+/**
+ * Start queueing frames for a subscriber with the given preferences
+ */
+void frame_sub_attach(frame_sub_t* subP, const frame_sub_prefs_t* prefsP)
+{
+	// Anything left from the last client is stale
+	frame_sub_drain(subP);
+
+	subP->prefs = *prefsP;
+	subP->next_usec = 0;
+	subP->window_frames = 0;
+	subP->window_overruns = 0;
+	subP->last_overruns = subP->ring.stats.overruns;
+	subP->stats.attaches++;
+	atomic_store(&subP->evicted, false);
+	atomic_store(&subP->active, true);
+}
+
+
+/**
+ * Stop queueing frames for a subscriber and release the ones waiting.  The producer
+ * may still queue a frame it was about to when this was called, so consumers call it
+ * again before they give the subscriber up for good.
+ */
+void frame_sub_detach(frame_sub_t* subP)
+{
+	atomic_store(&subP->active, false);
+	frame_sub_drain(subP);
+}
+
+
+/**
+ * Release every frame waiting for a subscriber without changing whether it is
+ * attached, so it is safe while another task may be attaching it
+ */
+void frame_sub_drain(frame_sub_t* subP)
+{
+	lep_buffer_t* bufP;
+
+	while ((bufP = frame_ring_pop(&subP->ring)) != NULL) {
+		frame_pool_release(bufP);
+	}
+}
+
+
+/**
+ * Take the oldest frame waiting for a subscriber (NULL if none).  The caller owns the
+ * reference.
+ */
+lep_buffer_t* frame_sub_pop(frame_sub_t* subP)
+{
+	lep_buffer_t* bufP = frame_ring_pop(&subP->ring);
+
+	if (bufP != NULL) {
+		atomic_fetch_add(&subP->held, 1);
+	}
+	return bufP;
+}
+
+
+/**
+ * Take another reference to a frame the subscriber's consumer holds (e.g. one it
+ * keeps in flight after giving up the one it popped)
+ */
+void frame_sub_ref(frame_sub_t* subP, lep_buffer_t* bufP)
+{
+	frame_pool_ref(bufP);
+	atomic_fetch_add(&subP->held, 1);
+}
+
+
+/**
+ * Give up a reference from frame_sub_pop() or frame_sub_ref()
+ */
+void frame_sub_release(frame_sub_t* subP, lep_buffer_t* bufP)
+{
+	atomic_fetch_sub(&subP->held, 1);
+	frame_pool_release(bufP);
+}
+
+
+/**
+ * True once the producer has evicted the subscriber for falling behind
+ */
+bool frame_sub_evicted(frame_sub_t* subP)
+{
+	return atomic_load(&subP->evicted);
+}
+
+
+/**
+ * Get a snapshot of a subscriber's statistics (frame_ring_get_stats() has its ring's)
+ */
+void frame_sub_get_stats(frame_sub_t* subP, frame_sub_stats_t* statsP)
+{
+	*statsP = subP->stats;
+}
+
+
+/**
+ * Queue a frame the producer holds a reference to for every attached subscriber that
+ * is due one and within its pool quota.  Returns the number of subscribers it was
+ * queued for.
+ */
+int frame_sub_publish(lep_buffer_t* bufP)
+{
+	frame_sub_t* subP;
+	uint32_t overruns;
+	int waiting;
+	bool over_quota;
+	bool wake;
+	int queued = 0;
+	int i;
+
+	for (i = 0; i < num_subs; i++) {
+		subP = subs[i];
+		if (!atomic_load(&subP->active) || atomic_load(&subP->evicted)) {
+			continue;
+		}
+
+		// Hold the subscriber to its rate, on average over the frames it gets
+		if (subP->prefs.min_interval_usec != 0) {
+			if (bufP->publish_usec < subP->next_usec) {
+				subP->stats.decimated++;
+				continue;
+			}
+			subP->next_usec += subP->prefs.min_interval_usec;
+			if (subP->next_usec < bufP->publish_usec) {
+				subP->next_usec = bufP->publish_usec;
+			}
+		}
+
+		// Hold the subscriber to its share of the pool.  Under FRAME_RING_DROP_OLDEST a
+		// full ring trades its oldest frame for this one, which holds no more.
+		waiting = frame_ring_count(&subP->ring);
+		if (waiting >= subP->ring.depth) {
+			waiting = subP->ring.depth - 1;
+		}
+		over_quota = (waiting + 1 + atomic_load(&subP->held)) > FRAME_SUB_POOL_QUOTA(subP->ring.depth);
+		if (over_quota) {
+			subP->stats.over_quota++;
+			wake = false;
+		} else {
+			wake = frame_ring_push(&subP->ring, bufP);
+		}
+		if (wake) {
+			subP->stats.published++;
+			queued++;
+		}
+
+		// Evict a subscriber that keeps overrunning its ring or its quota
+		overruns = subP->ring.stats.overruns;
+		subP->window_overruns += overruns - subP->last_overruns + (over_quota ? 1 : 0);
+		subP->last_overruns = overruns;
+		if (++subP->window_frames >= FRAME_SUB_EVICT_WINDOW) {
+			subP->window_frames = 0;
+			subP->window_overruns = 0;
+		}
+		if ((subP->prefs.evict_overruns != 0) && (subP->window_overruns >= subP->prefs.evict_overruns)) {
+			ESP_LOGW(TAG, "%s fell behind, evicting it", subP->name);
+			subP->stats.evictions++;
+			atomic_store(&subP->evicted, true);
+			wake = true;
+		}
+
+		if (wake && (subP->notify != NULL)) {
+			subP->notify(subP->notify_arg);
+		}
+	}
+
+	return queued;
+}
@@ -0,0 +1,110 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef FRAME_SUB_H
+#define FRAME_SUB_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "frame_ring.h"
+#include "system_utilities.h"
+
+
+//
+// Frame Subscriber Constants
+//
+
+// Maximum number of subscribers in the registry
+#define FRAME_SUB_MAX 8
+
+// Pool frames a subscriber with a ring of depth frames may hold.  The frame pool must
+// cover every subscriber's quota, plus any frames held outside the registry and the
+// one the producer is loading, or a slow subscriber can starve the others.
+#define FRAME_SUB_POOL_QUOTA(depth) ((depth) + 1)
+
+// Frames over which a subscriber's overruns are counted towards eviction
+#define FRAME_SUB_EVICT_WINDOW 32
+
+
+
+//
+// Frame Subscriber Data structures
+//
+
+// Called by the producer after it queues a frame for a subscriber (or evicts it)
+typedef void (*frame_sub_notify_t)(void* arg);
+
+// What a subscriber asks for while it is attached
+typedef struct {
+	int64_t min_interval_usec;   // At most one frame this often (0 for every frame)
+	int encoding;                // Payload encoding it wants (RSP_ENC_* for the streaming tasks)
+	int evict_overruns;          // Overruns within FRAME_SUB_EVICT_WINDOW frames that evict it (0 never)
+} frame_sub_prefs_t;
+
+typedef struct {
+	uint32_t attaches;           // Times the subscriber was attached
+	uint32_t published;          // Frames queued for the subscriber
+	uint32_t decimated;          // Frames skipped to hold the subscriber to its rate
+	uint32_t over_quota;         // Frames skipped because the subscriber held its pool quota
+	uint32_t evictions;          // Times the subscriber fell far enough behind to be evicted
+} frame_sub_stats_t;
+
+// One consumer of the producer's frames.  Registered once; attached and detached as
+// the client behind it comes and goes.  It may hold at most its ring depth plus one
+// frames of the pool (FRAME_SUB_POOL_QUOTA), counting those waiting in its ring and
+// those its consumer has taken.
+typedef struct {
+	const char* name;
+	frame_ring_t ring;           // Frames waiting for the consumer
+	frame_sub_notify_t notify;
+	void* notify_arg;
+	frame_sub_prefs_t prefs;
+	atomic_bool active;          // Attached; the producer queues frames for it
+	atomic_bool evicted;         // Set by the producer, cleared on attach
+	atomic_int held;             // Frames the consumer has taken and not released
+	int64_t next_usec;           // Producer side rate and eviction state
+	int window_frames;
+	int window_overruns;
+	uint32_t last_overruns;
+	frame_sub_stats_t stats;     // Each counter is only written by one side
+} frame_sub_t;
+
+
+
+//
+// Frame Subscriber API
+//
+
+// Setup (before the producer runs)
+bool frame_sub_register(frame_sub_t* subP, const char* name, int depth, frame_ring_policy_t policy,
+                        frame_sub_notify_t notify, void* notify_arg);
+
+// Consumer side (one task at a time)
+void frame_sub_attach(frame_sub_t* subP, const frame_sub_prefs_t* prefsP);
+void frame_sub_detach(frame_sub_t* subP);
+void frame_sub_drain(frame_sub_t* subP);
+lep_buffer_t* frame_sub_pop(frame_sub_t* subP);
+void frame_sub_ref(frame_sub_t* subP, lep_buffer_t* bufP);
+void frame_sub_release(frame_sub_t* subP, lep_buffer_t* bufP);
+bool frame_sub_evicted(frame_sub_t* subP);
+void frame_sub_get_stats(frame_sub_t* subP, frame_sub_stats_t* statsP);
+
+// Producer side (one task)
+int frame_sub_publish(lep_buffer_t* bufP);
+
+#endif /* FRAME_SUB_H */
@@ -26,6 +26,9 @@
 // I2C variables
 //
 static SemaphoreHandle_t i2c_mutex;
+#ifdef STATIC_ALLOCATION
+static StaticSemaphore_t i2c_mutex_buf;
+#endif
 
 
 
@@ -41,7 +44,11 @@ esp_err_t i2c_master_init()
     int i2c_master_port = I2C_MASTER_NUM;
     i2c_config_t conf = { 0 };
     
+#ifdef STATIC_ALLOCATION
+    i2c_mutex = xSemaphoreCreateMutexStatic(&i2c_mutex_buf);
+#else
     i2c_mutex = xSemaphoreCreateMutex();
+#endif
     
     conf.mode = I2C_MODE_MASTER;
     conf.sda_io_num = I2C_MASTER_SDA_IO;
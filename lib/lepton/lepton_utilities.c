@@ -207,6 +207,15 @@ uint32_t lepton_get_tel_status(uint16_t* tel_buf)
 }
 
 
+/**
+ * Return the Lepton's frame counter from a frame's telemetry
+ */
+uint32_t lepton_get_tel_frame_count(uint16_t* tel_buf)
+{
+	return ((uint32_t) tel_buf[LEP_TEL_FC_HIGH] << 16) | tel_buf[LEP_TEL_FC_LOW];
+}
+
+
 /**
  * Convert a temperature reading from the lepton (in units of K * 100) to C
  */
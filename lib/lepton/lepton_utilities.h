@@ -139,6 +139,7 @@ void lepton_spotmeter(uint16_t r1, uint16_t c1, uint16_t r2, uint16_t c2);
 void lepton_emissivity(uint16_t e);
 
 uint32_t lepton_get_tel_status(uint16_t* tel_buf);
+uint32_t lepton_get_tel_frame_count(uint16_t* tel_buf);
 
 float lepton_kelvin_to_C(uint32_t k, float lep_res);
 
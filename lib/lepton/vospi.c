@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include "esp_system.h"
+#include "esp_attr.h"
 #include "esp_log.h"
 #include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
@@ -28,6 +29,22 @@
 #include "driver/spi_master.h"
 #include "system_config.h"
 #include "vospi.h"
+#include "vospi_crc.h"
+#include "vospi_unpack.h"
+
+
+
+//
+// VoSPI internal constants
+//
+
+// process_packet() results
+#define SEG_CONTINUE 0
+#define SEG_DONE     1
+#define SEG_FRAME    2
+
+// Segment-less sensors only output valid frames so the segment region is always valid
+#define SEG_REGION_IDLE (LEP_SEGMENTS == 1)
 
 
 
@@ -42,31 +59,74 @@ static const char* TAG = "vospi";
 static spi_device_handle_t spi;
 static spi_transaction_t lep_spi_trans;
 
-// Pointer to allocated array to store one Lepton packet (DMA capable)
+// Pointer to allocated array to store up to LEP_MAX_PKTS_PER_XFER Lepton packets (DMA capable)
 static uint8_t* lepPacketP;
+static int pktsPerXfer = LEP_MAX_PKTS_PER_XFER;
+
+// Packet CRC handling
+static vospi_crc_mode_t crcMode = LEP_CRC_MODE;
 
-// Lepton Frame buffer (16-bit values)
-static uint16_t lepBuffer[LEP_NUM_PIXELS];
+// Acquisition frame being assembled (16-bit values, LEP_FRAME_MEM_CAPS).  It is exchanged
+// with a shared system buffer by vospi_get_frame() when the frame is complete.
+static uint16_t* acqBufferP;
 
-// Lepton Telemetry buffer (16-bit values)
-static uint16_t lepTelem[LEP_TEL_WORDS];
+// Pixels of the last frame vospi_get_frame() published (NULL before the first).  Rows
+// dropped from the acquisition frame are repaired from it.  A published frame is never
+// written, and its buffer can only come back as the acquisition frame when a newer
+// frame replaces it here.
+static const uint16_t* lastFrameP;
+
+// Acquisition telemetry buffer (16-bit values, LEP_FRAME_MEM_CAPS)
+static uint16_t* acqTelemP;
+
+#ifdef STATIC_ALLOCATION
+// Backing memory for the buffers above
+static DMA_ATTR uint8_t lepPacketMem[LEP_MAX_PKTS_PER_XFER*LEP_PKT_LENGTH];
+static LEP_FRAME_MEM_ATTR uint16_t acqBufferMem[LEP_NUM_PIXELS];
+static LEP_FRAME_MEM_ATTR uint16_t acqTelemMem[LEP_TEL_WORDS];
+#endif
+
+// Image statistics for each segment of the acquisition frame, accumulated as
+// packets are unpacked and reset whenever a segment is read again
+static vospi_stats_t segStats[LEP_SEGMENTS];
 
 // Processing State
 static int curSegment = 1;
 static int curLinesPerSeg = LEP_NOTEL_PKTS_PER_SEG;
 static int curWordsPerSeg = LEP_NOTEL_WORDS_PER_SEG;
-static bool validSegmentRegion = false;
+static bool validSegmentRegion = SEG_REGION_IDLE;
 static bool includeTelemetry = false;
 
+// Per-segment parse state
+static uint8_t prevLine;
+static bool beforeValidData;
+static uint16_t* segBaseP;       // Where curSegment starts in the acquisition frame
+
+// Rows of the acquisition frame that failed their CRC check or were missed
+static int frameBadRows;
+
+// VSYNC that started the current transfer and the one that started the acquisition frame
+static int64_t xferVsyncUsec;
+static int64_t frameVsyncUsec;
+
+// Valid segment (1 - LEP_SEGMENTS) completed by the last vospi_transfer_segment(), 0 if none
+static int lastSegment;
+
+// Stream state seen by the last vospi_transfer_segment()
+static vospi_sync_t lastSync;
+static int badHeaders;
+
+// Acquisition counters
+static vospi_counters_t counters;
 
 
 
 //
 // VoSPI Forward Declarations for internal functions
 //
-static bool transfer_packet(uint8_t* line, uint8_t* seg);
-static void copy_packet_to_lepton_buffer(uint8_t line);
-static void copy_packet_to_telem_buffer(uint8_t line);
+static void transfer_packets(int n);
+static int process_packet(uint8_t* pktP, bool crcOk);
+static void repair_row(uint8_t line);
 
 
 
@@ -95,8 +155,12 @@ int vospi_init()
 	if ((ret=spi_bus_add_device(LEP_SPI_HOST, &devcfg, &spi)) != ESP_OK) {
 		ESP_LOGE(TAG, "failed to add lepton spi device");
 	} else {
-		// Allocate DMA capable memory for the lepton packet
-		lepPacketP = (uint8_t*) heap_caps_malloc(LEP_PKT_LENGTH, MALLOC_CAP_DMA);
+		// Allocate DMA capable memory for the lepton packets
+#ifdef STATIC_ALLOCATION
+		lepPacketP = lepPacketMem;
+#else
+		lepPacketP = (uint8_t*) heap_caps_malloc(LEP_MAX_PKTS_PER_XFER*LEP_PKT_LENGTH, MALLOC_CAP_DMA);
+#endif
 		if (lepPacketP != NULL) {
 			ret = ESP_OK;
 		} else {
@@ -105,120 +169,194 @@ int vospi_init()
 		}
 	}
 
+	if (ret == ESP_OK) {
+		// Allocate the acquisition frame the same way as the shared system buffers
+		// since they are exchanged with each other.  It is only written by the CPU
+		// unpacking packets out of the DMA buffer, so it may be in PSRAM.
+#ifdef STATIC_ALLOCATION
+		acqBufferP = acqBufferMem;
+		acqTelemP = acqTelemMem;
+#else
+		acqBufferP = (uint16_t*) heap_caps_malloc(LEP_NUM_PIXELS*2, LEP_FRAME_MEM_CAPS);
+		acqTelemP = (uint16_t*) heap_caps_malloc(LEP_TEL_WORDS*2, LEP_FRAME_MEM_CAPS);
+#endif
+		if ((acqBufferP == NULL) || (acqTelemP == NULL)) {
+			ESP_LOGE(TAG, "failed to allocate lepton acquisition frame buffer");
+			ret = ESP_FAIL;
+		}
+	}
+
 	return ret;
 }
 
 
 /**
  * Attempt to read a complete segment from the Lepton
- *  - Data loaded into lepBuffer
+ *  - Data loaded into the acquisition frame
  *  - Returns true when last successful segment read, false otherwise
+ *
+ * Packets are read one at a time until the first non-discard packet locates the
+ * start of the segment, then the remainder of the segment is read in transactions
+ * of up to pktsPerXfer packets and parsed out of the DMA buffer.
+ *
+ * When dropping bad packets, a packet that fails its CRC check cannot be trusted
+ * to locate the segment so it is skipped while hunting.  Once synchronized it is
+ * taken to be the next line since packets arrive in order within a segment.
+ *
+ * Headers that cannot occur in an aligned stream are counted so that the caller
+ * can tell a misaligned stream (vospi_get_sync()) from one that is just out of
+ * step with VSYNC.
  */
 bool vospi_transfer_segment(uint64_t vsyncDetectedUsec)
 {
-	uint8_t line, prevLine;
-	uint8_t segment;
-	bool done = false;
-	bool beforeValidData = true;
-	bool success = false;
+	uint8_t* pktP;
+	uint8_t* endP;
+	bool crcOk;
+	int n;
+	int remaining = 1;
+	int status = SEG_CONTINUE;
 
 	prevLine = 255;
-
-	while (!done) {
-		if (transfer_packet(&line, &segment)) {
-			// Saw a valid packet
-			if (line == prevLine) {
-			// This is garbage data since line numbers should always increment
-			done = true;
-			} else {
-				// Check for termination or completion conditions
-				if (line == 20) {
-					// Check segment
-					if (!validSegmentRegion) {
-						// Look for start of valid segment data
-						if (segment == 1) {
-							beforeValidData = false;
-							validSegmentRegion = true;
-						}
-					} else if ((segment < 2) || (segment > 4)) {
-						// Hold/Reset in starting position (always collecting in segment 1 buffer locations)
-						validSegmentRegion = false;  // In case it was set
-						curSegment = 1;
-					}
-				}
-        
-				// Copy the data to the lepton frame buffer or telemetry buffer
-				//  - beforeValidData is used to collect data before we know if the current segment (1) is valid
-				//  - then we use validSegmentRegion for remaining data once we know we're seeing valid data
-				if (includeTelemetry && validSegmentRegion && (curSegment == 4) && (line >= 57)) {
-					copy_packet_to_telem_buffer(line - 57);
-				}
-				else if ((beforeValidData || validSegmentRegion) && (line < curLinesPerSeg)) {
-					copy_packet_to_lepton_buffer(line);
+	beforeValidData = true;
+	lastSegment = 0;
+	xferVsyncUsec = vsyncDetectedUsec;
+	badHeaders = 0;
+	counters.first_pkt_usec = 0;
+
+	while (status == SEG_CONTINUE) {
+		n = (remaining < pktsPerXfer) ? remaining : pktsPerXfer;
+		transfer_packets(n);
+
+		pktP = lepPacketP;
+		endP = lepPacketP + n*LEP_PKT_LENGTH;
+		while ((status == SEG_CONTINUE) && (pktP < endP)) {
+			// Skip discard packets
+			if ((*pktP & 0x0F) != 0x0F) {
+				crcOk = (crcMode == VOSPI_CRC_OFF) || vospi_crc_check(pktP);
+				if (!crcOk) {
+					counters.crc_errors++;
 				}
-	
-				if (line == (curLinesPerSeg-1)) {
-					// Saw a complete segment, move to next segment or complete frame aquisition if possible
-					if (validSegmentRegion) {
-						if (curSegment < 4) {
-							// Setup to get next segment
-							curSegment++;
-						} else {
-							// Got frame
-							success = true;
-
-							// Setup to get the next frame
-							curSegment = 1;
-							validSegmentRegion = false;
-						}
+				if (crcOk || (crcMode == VOSPI_CRC_COUNT) || (prevLine != 255)) {
+					if (counters.first_pkt_usec == 0) {
+						counters.first_pkt_usec = esp_timer_get_time();
 					}
-					done = true;
+					counters.packets++;
+					status = process_packet(pktP, crcOk);
+				} else {
+					badHeaders++;
 				}
+			} else {
+				counters.discards++;
+			}
+			pktP += LEP_PKT_LENGTH;
+		}
+
+		if (status == SEG_CONTINUE) {
+			if ((esp_timer_get_time() - vsyncDetectedUsec) > LEP_MAX_FRAME_XFER_WAIT_USEC) {
+				// Did not see a complete segment within this segment interval
+				break;
 			}
-			prevLine = line;
-		} else if ((esp_timer_get_time() - vsyncDetectedUsec) > LEP_MAX_FRAME_XFER_WAIT_USEC) {
-			// Did not see a valid packet within this segment interval
-      		done = true;
-    	}
+
+			// Read the rest of the segment if we are synchronized to it, otherwise keep hunting
+			remaining = (prevLine < curLinesPerSeg) ? curLinesPerSeg - 1 - prevLine : 1;
+		}
+	}
+
+	if (status == SEG_FRAME) {
+		counters.frames++;
 	}
-	
-  	return success;
+
+	// Classify the stream for resynchronization decisions
+	if ((status != SEG_CONTINUE) && (prevLine == (curLinesPerSeg-1))) {
+		lastSync = VOSPI_SYNC_OK;
+	} else if (badHeaders != 0) {
+		lastSync = VOSPI_SYNC_LOST;
+		counters.sync_lost++;
+	} else if (counters.first_pkt_usec == 0) {
+		lastSync = VOSPI_SYNC_NO_DATA;
+		counters.no_data++;
+	} else {
+		lastSync = VOSPI_SYNC_PARTIAL;
+	}
+	counters.bad_headers += badHeaders;
+
+	return (status == SEG_FRAME);
 }
 
 
 /**
- * Load the a system buffer from our buffers for another task
+ * Publish the completed acquisition frame into a system buffer for another task.
+ * The buffers are exchanged by pointer so the caller's mutex is held only briefly and
+ * the system buffer's previous contents become the next acquisition frame.
  */
 void vospi_get_frame(lep_buffer_t* sys_bufP)
 {
-	uint16_t* sptr = sys_bufP->lep_bufferP;
-	uint16_t* lptr = &lepBuffer[0];
-	uint16_t min = 0xFFFF;
-	uint16_t max = 0x0000;
-	uint16_t t16;
-
-	// Load lepton image data
-	while (lptr < &lepBuffer[LEP_NUM_PIXELS]) {
-		t16 = *lptr++;
-		if (t16 < min) min = t16;
-		if (t16 > max) max = t16;
-		*sptr++ = t16;
+	uint16_t* t;
+	vospi_stats_t st;
+	int i;
+
+	// Frame statistics were accumulated per segment as packets were unpacked
+	vospi_stats_reset(&st);
+	for (i = 0; i < LEP_SEGMENTS; i++) {
+		vospi_stats_merge(&st, &segStats[i]);
 	}
-	sys_bufP->lep_min_val = min;
-	sys_bufP->lep_max_val = max;
-	
-	// Optionally load telemetry
+	sys_bufP->lep_min_val = st.min;
+	sys_bufP->lep_max_val = st.max;
+	sys_bufP->lep_sum = st.sum;
+	memcpy(sys_bufP->lep_hist, st.hist, sizeof(st.hist));
+	sys_bufP->bad_rows = frameBadRows;
+	sys_bufP->frame_seq = counters.frames - 1;
+	sys_bufP->vsync_usec = frameVsyncUsec;
+	sys_bufP->acq_usec = esp_timer_get_time();
+
+	// Swap lepton image data
+	t = sys_bufP->lep_bufferP;
+	sys_bufP->lep_bufferP = acqBufferP;
+	acqBufferP = t;
+	lastFrameP = sys_bufP->lep_bufferP;
+
+	// Optionally swap telemetry
 	sys_bufP->telem_valid = includeTelemetry;
 	if (includeTelemetry) {
-		sptr = sys_bufP->lep_telemP;
-		lptr = &lepTelem[0];
-		while (lptr < &lepTelem[LEP_TEL_WORDS]) {
-			*sptr++ = *lptr++;
-		}
+		t = sys_bufP->lep_telemP;
+		sys_bufP->lep_telemP = acqTelemP;
+		acqTelemP = t;
 	}
 }
 
 
+/**
+ * Describe the valid segment completed by the last vospi_transfer_segment() call.
+ * Returns false if it did not complete one.  Must be called before vospi_get_frame()
+ * publishes the frame the segment belongs to.
+ */
+bool vospi_get_segment(lep_segment_t* segP)
+{
+	int first;
+
+	if (lastSegment == 0) return false;
+
+	first = (lastSegment - 1) * curWordsPerSeg;
+	segP->frame_seq = counters.frames - ((lastSegment == LEP_SEGMENTS) ? 1 : 0);
+	segP->segment = lastSegment;
+	segP->first_pixel = first;
+	segP->num_pixels = ((first + curWordsPerSeg) > LEP_NUM_PIXELS) ? LEP_NUM_PIXELS - first : curWordsPerSeg;
+	segP->pixelsP = &acqBufferP[first];
+	segP->acq_usec = esp_timer_get_time();
+
+	return true;
+}
+
+
+/**
+ * Return what the last vospi_transfer_segment() call saw of the packet stream
+ */
+vospi_sync_t vospi_get_sync()
+{
+	return lastSync;
+}
+
+
 /**
  * Configure the pipeline to include telemetry or not.
  * This should be done during initialization
@@ -232,91 +370,214 @@ void vospi_include_telem(bool en)
 
 
 
+/**
+ * Set the maximum number of packets read per SPI transaction once a segment has
+ * been located (1 reads packet by packet).
+ */
+void vospi_set_packets_per_xfer(int n)
+{
+	if (n < 1) n = 1;
+	if (n > LEP_MAX_PKTS_PER_XFER) n = LEP_MAX_PKTS_PER_XFER;
+	pktsPerXfer = n;
+}
+
+
+
+/**
+ * Set how packets failing their CRC check are handled
+ */
+void vospi_set_crc_mode(vospi_crc_mode_t mode)
+{
+	crcMode = mode;
+}
+
+
+
+/**
+ * Get a snapshot of the acquisition counters
+ */
+void vospi_get_counters(vospi_counters_t* cntP)
+{
+	*cntP = counters;
+}
+
+
+
 //
-// VoSPI Forward Declarations for internal functions
+// VoSPI internal functions
 //
 
 /**
- * Attempt to read one packet from the lepton
- *  - Return false for discard packets
- *  - Return true otherwise
- *    - line contains the packet line number for all valid packets
- *    - seg contains the packet segment number if the line number is 20
+ * Read n packets from the lepton into lepPacketP in one transaction
  */
-static bool transfer_packet(uint8_t* line, uint8_t* seg)
+static void transfer_packets(int n)
 {
-	bool valid = false;
 	esp_err_t ret;
 
-	// *seg will be set if possible
-	*seg = 0;
-
 	// Setup our SPI transaction
 	memset(&lep_spi_trans, 0, sizeof(spi_transaction_t));
 	lep_spi_trans.tx_buffer = NULL;
 	lep_spi_trans.rx_buffer = lepPacketP;
-	lep_spi_trans.rxlength = LEP_PKT_LENGTH*8;
+	lep_spi_trans.rxlength = n*LEP_PKT_LENGTH*8;
 
 	/************************************************************************************/
     /* Note: queued transactions cause a panic when a task yields and I can't figure    */
     /* it out.  Disabling queuing gets rid of the panic at some performance hit.        */
+    /* Reading multiple packets per transaction recovers most of that performance.      */
     /************************************************************************************/
-	// Get a packet using the interrupt method and DMA engine to free the CPU some
+	// Get packets using the interrupt method and DMA engine to free the CPU some
 	//ret = spi_device_polling_transmit(spi, &lep_spi_trans);
 	ret = spi_device_transmit(spi, &lep_spi_trans);
 	ESP_ERROR_CHECK(ret);
-  
-	// Repeat as long as the frame is not valid, equals sync
-	if ((*lepPacketP & 0x0F) == 0x0F) {
-		valid = false;
-	} else {
-		*line = *(lepPacketP + 1);
+}
+
+
+/**
+ * Process one non-discard packet
+ *  - crcOk false means the packet failed its CRC check.  Unless only counting
+ *    errors, the row is dropped and the packet just advances the line.  Dropped
+ *    and skipped rows are repaired from the last published frame.
+ *  - Returns SEG_CONTINUE while more packets are required for this segment
+ *  - Returns SEG_DONE when the segment is complete or garbage data was detected
+ *  - Returns SEG_FRAME when the last segment of a frame is complete
+ */
+static int process_packet(uint8_t* pktP, bool crcOk)
+{
+	bool dropRow = !crcOk && (crcMode != VOSPI_CRC_COUNT);
+	uint8_t line = (dropRow) ? prevLine + 1 : *(pktP + 1);
+	uint8_t i;
+#if LEP_SEGMENTS > 1
+	uint8_t segment;
+#endif
+	int status = SEG_CONTINUE;
+
+	if (((prevLine != 255) && (line <= prevLine)) || (line >= curLinesPerSeg)) {
+		// This is garbage data since line numbers should always increment and
+		// stay within the segment
+		badHeaders++;
+		return SEG_DONE;
+	}
 
-		// Get segment when possible
-		if (*line == 20) {
-			*seg = (*lepPacketP >> 4);
+	// The segment is being (re)read from the start
+	if (prevLine == 255) {
+		segBaseP = &acqBufferP[(curSegment-1) * curWordsPerSeg];
+		vospi_stats_reset(&segStats[curSegment-1]);
+		if (curSegment == 1) {
+			frameBadRows = 0;
+			frameVsyncUsec = xferVsyncUsec;
 		}
+	}
 
-		valid = true;
+	if (!crcOk) {
+		frameBadRows++;
 	}
 
-	return(valid);
-}
+	// Rows skipped over (e.g. dropped while hunting for the segment) are missing
+	if (line > (uint8_t) (prevLine + 1)) {
+		frameBadRows += line - (uint8_t) (prevLine + 1);
+		for (i = (uint8_t) (prevLine + 1); i < line; i++) {
+			repair_row(i);
+		}
+	}
 
+#if LEP_SEGMENTS > 1
+	// Check for termination or completion conditions (a bad packet's segment number
+	// is unknown so the current segment is assumed)
+	if (!dropRow && (line == 20)) {
+		// Check segment
+		segment = (*pktP >> 4);
+		if (!validSegmentRegion) {
+			// Look for start of valid segment data
+			if (segment == 1) {
+				beforeValidData = false;
+				validSegmentRegion = true;
+			}
+		} else if ((segment < 2) || (segment > LEP_SEGMENTS) || (segment != curSegment)) {
+			// Out of step with the frame (e.g. a missed VSYNC), so hold/reset in starting
+			// position (always collecting in segment 1 buffer locations)
+			counters.segment_errors++;
+			validSegmentRegion = false;  // In case it was set
+			curSegment = 1;
+			segBaseP = acqBufferP;
+		}
+	}
+#endif
+
+	// Copy the data to the lepton frame buffer or telemetry buffer
+	//  - beforeValidData is used to collect data before we know if the current segment (1) is valid
+	//  - then we use validSegmentRegion for remaining data once we know we're seeing valid data
+	if (!dropRow && includeTelemetry && validSegmentRegion && (curSegment == LEP_SEGMENTS) &&
+	    (line >= LEP_TEL_FIRST_LINE)) {
+		// Only telemetry lines 0-2 are kept
+		if (line < (LEP_TEL_FIRST_LINE + LEP_TEL_PACKETS)) {
+			vospi_unpack_telem(pktP, &acqTelemP[(line - LEP_TEL_FIRST_LINE) * LEP_PKT_PIXELS]);
+		}
+	}
+	else if (!dropRow && (beforeValidData || validSegmentRegion) && (line < curLinesPerSeg)) {
+		vospi_unpack_packet(pktP,
+		                    segBaseP + (line * LEP_PKT_PIXELS),
+		                    &segStats[curSegment-1]);
+	}
+	else if (dropRow) {
+		repair_row(line);
+	}
 
-/**
- * Copy the lepton packet to the raw lepton frame
- *   - line specifies packet line number
- */
-static void copy_packet_to_lepton_buffer(uint8_t line)
-{
-	uint8_t* lepPopPtr = lepPacketP + 4;
-	uint16_t* acqPushPtr = &lepBuffer[((curSegment-1) * curWordsPerSeg) + (line * (LEP_WIDTH/2))];
-	uint16_t t;
-
-	while (lepPopPtr <= (lepPacketP + (LEP_PKT_LENGTH-1))) {
-		t = *lepPopPtr++ << 8;
-		t |= *lepPopPtr++;
-		*acqPushPtr++ = t;
+	if (line == (curLinesPerSeg-1)) {
+		// Saw a complete segment, move to next segment or complete frame aquisition if possible
+		status = SEG_DONE;
+		counters.segments++;
+		if (validSegmentRegion) {
+			// Segments of a frame being discarded are not published
+			if ((crcMode != VOSPI_CRC_DROP_FRAME) || (frameBadRows == 0)) {
+				lastSegment = curSegment;
+			}
+			if (curSegment < LEP_SEGMENTS) {
+				// Setup to get next segment
+				curSegment++;
+			} else if ((crcMode == VOSPI_CRC_DROP_FRAME) && (frameBadRows != 0)) {
+				// Throw away the frame and collect the next one
+				counters.crc_frames_dropped++;
+				curSegment = 1;
+				validSegmentRegion = SEG_REGION_IDLE;
+			} else {
+				// Got frame
+				status = SEG_FRAME;
+
+				// Setup to get the next frame
+				curSegment = 1;
+				validSegmentRegion = SEG_REGION_IDLE;
+			}
+		}
 	}
+	prevLine = line;
+
+	return status;
 }
 
 
 /**
- * Copy the lepton packet to the telemetry buffer
- *   - line specifies packet line number (only 0-2 are valid, do not call with line 3)
+ * Fill a dropped or missing line of the current segment with the same pixels from the
+ * last published frame, or with zeros before there is one.  Telemetry lines and lines
+ * outside the frame are left alone.  The segment statistics only cover the lines
+ * actually received.
  */
-static void copy_packet_to_telem_buffer(uint8_t line)
+static void repair_row(uint8_t line)
 {
-	uint8_t* lepPopPtr = lepPacketP + 4;
-	uint16_t* telPushPtr = &lepTelem[line * (LEP_WIDTH/2)];
-	uint16_t t;
-	
-	if (line > 2) return;
-	
-	while (lepPopPtr <= (lepPacketP + (LEP_PKT_LENGTH-1))) {
-		t = *lepPopPtr++ << 8;
-		t |= *lepPopPtr++;
-		*telPushPtr++ = t;
+	int offset;
+
+	if (!(beforeValidData || validSegmentRegion) ||
+	    (includeTelemetry && (curSegment == LEP_SEGMENTS) && (line >= LEP_TEL_FIRST_LINE))) {
+		return;
+	}
+
+	offset = (segBaseP - acqBufferP) + line * LEP_PKT_PIXELS;
+	if ((offset + LEP_PKT_PIXELS) > LEP_NUM_PIXELS) {
+		return;
+	}
+
+	if (lastFrameP != NULL) {
+		memcpy(&acqBufferP[offset], &lastFrameP[offset], LEP_PKT_PIXELS*2);
+	} else {
+		memset(&acqBufferP[offset], 0, LEP_PKT_PIXELS*2);
 	}
 }
@@ -27,29 +27,98 @@
 // VoSPI Constants
 //
 
-// LEP_FRAME_USEC is the per-frame period from the Lepton (interrupt rate) 
-#define LEP_FRAME_USEC 9450
+// Sensor geometry profiles (LEP_PROFILE is selected in system_config.h).  Everything
+// below is a compile-time constant for the selected sensor so buffer sizes, loop
+// bounds and copy offsets fold away.
+#define LEP_PROFILE_LEPTON3 3    // Lepton 3.x: 160x120, 4 segments of 60 packets per frame
+#define LEP_PROFILE_LEPTON2 2    // Lepton 2.x: 80x60, one 60 packet frame (no segments)
+
+#if LEP_PROFILE == LEP_PROFILE_LEPTON3
+#define LEP_WIDTH               160
+#define LEP_HEIGHT              120
+#define LEP_SEGMENTS            4
+// Extra packets per segment with telemetry enabled (2 telemetry rows spread over 4 segments)
+#define LEP_TEL_EXTRA_PKTS      1
+// LEP_FRAME_USEC is the per-segment period from the Lepton (VSYNC interrupt rate)
+#define LEP_FRAME_USEC          9450
+// Segment periods per unique frame (4 valid segments followed by 8 with segment number 0)
+#define LEP_SEG_SLOTS_PER_FRAME 12
+#elif LEP_PROFILE == LEP_PROFILE_LEPTON2
+#define LEP_WIDTH               80
+#define LEP_HEIGHT              60
+#define LEP_SEGMENTS            1
+// 3 telemetry packets follow the image
+#define LEP_TEL_EXTRA_PKTS      3
+// LEP_FRAME_USEC is the per-frame period from the Lepton (VSYNC interrupt rate)
+#define LEP_FRAME_USEC          37800
+// Frame periods per unique frame (each frame is output 3 times)
+#define LEP_SEG_SLOTS_PER_FRAME 3
+#else
+#error "Unknown LEP_PROFILE"
+#endif
+
 // LEP_MAX_FRAME_XFER_WAIT_USEC specifies the maximum time we should wait in
 // vospi_transfer_segment() to read a valid frame.  It should be LEP_FRAME_USEC -
 // (maximum ISR latency + transfer_packet() code path overhead)
-// than LEP_FRAME_USEC -  maximum ISR latency)
-#define LEP_MAX_FRAME_XFER_WAIT_USEC 9250
+#define LEP_MAX_FRAME_XFER_WAIT_USEC (LEP_FRAME_USEC - 200)
+
+#define LEP_FRAME_PERIOD_USEC   (LEP_SEG_SLOTS_PER_FRAME * LEP_FRAME_USEC)
 
-#define LEP_WIDTH      160
-#define LEP_HEIGHT     120
 #define LEP_NUM_PIXELS (LEP_WIDTH * LEP_HEIGHT)
 #define LEP_PKT_LENGTH 164
 
+// Every packet carries 80 pixels and packets fill the frame in order
+#define LEP_PKT_PIXELS ((LEP_PKT_LENGTH - 4) / 2)
+#define LEP_IMG_PKTS   (LEP_NUM_PIXELS / LEP_PKT_PIXELS)
+
 // Telemetry related
 #define LEP_TEL_PACKETS 3
 #define LEP_TEL_PKT_LEN (LEP_PKT_LENGTH - 4)
 #define LEP_TEL_WORDS   (LEP_TEL_PACKETS * LEP_TEL_PKT_LEN / 2)
 
 // Dynamic values depending if telemetry is included or not
-#define LEP_TEL_PKTS_PER_SEG     61
-#define LEP_NOTEL_PKTS_PER_SEG   60
-#define LEP_TEL_WORDS_PER_SEG    (LEP_TEL_PKTS_PER_SEG * LEP_WIDTH / 2)
-#define LEP_NOTEL_WORDS_PER_SEG  (LEP_NOTEL_PKTS_PER_SEG * LEP_WIDTH / 2)
+#define LEP_NOTEL_PKTS_PER_SEG   (LEP_IMG_PKTS / LEP_SEGMENTS)
+#define LEP_TEL_PKTS_PER_SEG     (LEP_NOTEL_PKTS_PER_SEG + LEP_TEL_EXTRA_PKTS)
+#define LEP_TEL_WORDS_PER_SEG    (LEP_TEL_PKTS_PER_SEG * LEP_PKT_PIXELS)
+#define LEP_NOTEL_WORDS_PER_SEG  (LEP_NOTEL_PKTS_PER_SEG * LEP_PKT_PIXELS)
+
+// Line in the last segment where the telemetry footer starts
+#define LEP_TEL_FIRST_LINE       (LEP_IMG_PKTS - (LEP_SEGMENTS - 1) * LEP_TEL_PKTS_PER_SEG)
+
+// Maximum packets read in one SPI DMA transaction (sizes the DMA buffer and
+// the SPI bus max_transfer_sz).  A full segment with telemetry fits.
+#define LEP_MAX_PKTS_PER_XFER    LEP_TEL_PKTS_PER_SEG
+
+// Packet CRC handling (see vospi_set_crc_mode())
+typedef enum {
+	VOSPI_CRC_OFF,             // Packets are not checked
+	VOSPI_CRC_COUNT,           // Bad packets are counted but used as received
+	VOSPI_CRC_DROP_ROW,        // Bad rows are not unpacked, the last frame's pixels are kept instead
+	VOSPI_CRC_DROP_FRAME       // Frames with a bad row are discarded in favor of the next frame
+} vospi_crc_mode_t;
+
+// What the last vospi_transfer_segment() saw of the packet stream
+typedef enum {
+	VOSPI_SYNC_OK,             // Read a complete segment (valid or not)
+	VOSPI_SYNC_NO_DATA,        // Only discard packets until the timeout
+	VOSPI_SYNC_PARTIAL,        // Packets in sequence but no complete segment before the timeout
+	VOSPI_SYNC_LOST            // Packet headers show the stream is misaligned
+} vospi_sync_t;
+
+// VoSPI acquisition counters
+typedef struct {
+	uint32_t packets;          // Non-discard packets processed
+	uint32_t discards;         // Discard packets read
+	uint32_t segments;         // Complete segments read
+	uint32_t frames;           // Complete frames acquired
+	uint32_t crc_errors;       // Non-discard packets that failed their CRC check
+	uint32_t crc_frames_dropped; // Frames discarded for CRC errors (VOSPI_CRC_DROP_FRAME)
+	uint32_t bad_headers;      // Packets with repeated or impossible line numbers, or a bad CRC while hunting
+	uint32_t segment_errors;   // Out of order segment numbers (valid frame restarted)
+	uint32_t sync_lost;        // Segment reads ending VOSPI_SYNC_LOST
+	uint32_t no_data;          // Segment reads ending VOSPI_SYNC_NO_DATA
+	int64_t first_pkt_usec;    // When the first packet of the last segment read arrived (0 if none)
+} vospi_counters_t;
 
 /* Lepton frame error return */
 enum LeptonReadError {
@@ -64,6 +133,11 @@ enum LeptonReadError {
 int vospi_init();
 bool vospi_transfer_segment(uint64_t vsyncDetectedUsec);
 void vospi_get_frame(lep_buffer_t* sys_bufP);
+bool vospi_get_segment(lep_segment_t* segP);
+vospi_sync_t vospi_get_sync();
 void vospi_include_telem(bool en);
+void vospi_set_packets_per_xfer(int n);
+void vospi_set_crc_mode(vospi_crc_mode_t mode);
+void vospi_get_counters(vospi_counters_t* cntP);
 
 #endif /* VOSPI_H */
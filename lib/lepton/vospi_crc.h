@@ -0,0 +1,31 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef VOSPI_CRC_H
+#define VOSPI_CRC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+//
+// VoSPI CRC API
+//
+uint16_t vospi_crc16(const uint8_t* pktP);
+bool vospi_crc_check(const uint8_t* pktP);
+
+#endif /* VOSPI_CRC_H */
@@ -0,0 +1,149 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * VoSPI loss of sync detection and staged recovery.
+ *
+ * Called with the result of every segment read.  A stream whose packet headers
+ * show it is misaligned, or that has gone silent, is acted on after a few segment
+ * periods; an aligned stream that simply is not producing frames gets a few frame
+ * periods.  Recovery starts with the CS idle that realigns the Lepton's output and
+ * escalates to re-sending the CCI configuration (e.g. after the Lepton rebooted
+ * itself and lost telemetry) and finally to a hardware reset.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include "vospi.h"
+#include "vospi_resync.h"
+
+
+
+//
+// VoSPI Resync Variables
+//
+
+// Consecutive segment reads without a frame and those of them that looked bad
+static int noFrameSlots;
+static int badSlots;
+
+// Recovery attempts since the last frame (0 when no event is in progress)
+static int attempt;
+
+// When the last frame arrived (0 until the first one)
+static int64_t lastFrameUsec;
+
+static vospi_resync_stats_t stats;
+
+
+
+//
+// VoSPI Resync Forward Declarations for internal functions
+//
+static void end_event(int64_t nowUsec);
+
+
+
+//
+// VoSPI Resync API
+//
+
+/**
+ * Account for one segment read and return the recovery step to take, if any.
+ * After a step the caller should start with a fresh VSYNC.
+ */
+vospi_resync_action_t vospi_resync_update(bool gotFrame, vospi_sync_t sync, int64_t nowUsec)
+{
+	vospi_resync_action_t action;
+
+	if (gotFrame) {
+		if (attempt != 0) {
+			end_event(nowUsec);
+		}
+		lastFrameUsec = nowUsec;
+		noFrameSlots = 0;
+		badSlots = 0;
+		return VOSPI_RESYNC_NONE;
+	}
+
+	noFrameSlots++;
+	if ((sync == VOSPI_SYNC_LOST) || (sync == VOSPI_SYNC_NO_DATA)) {
+		badSlots++;
+	} else {
+		badSlots = 0;
+	}
+
+	if ((badSlots < LEP_RESYNC_BAD_SLOTS) && (noFrameSlots < LEP_RESYNC_NO_FRAME_SLOTS)) {
+		return VOSPI_RESYNC_NONE;
+	}
+
+	// Escalate
+	if (attempt++ == 0) {
+		stats.events++;
+	}
+	if (attempt >= LEP_RESYNC_RESET_ATTEMPT) {
+		action = VOSPI_RESYNC_RESET;
+		stats.resets++;
+		attempt = 1;
+	} else if (attempt == LEP_RESYNC_RECONFIG_ATTEMPT) {
+		action = VOSPI_RESYNC_RECONFIG;
+		stats.reconfigs++;
+	} else {
+		action = VOSPI_RESYNC_IDLE;
+		stats.idles++;
+	}
+	noFrameSlots = 0;
+	badSlots = 0;
+
+	return action;
+}
+
+
+/**
+ * Get a snapshot of the resynchronization statistics
+ */
+void vospi_resync_get_stats(vospi_resync_stats_t* statsP)
+{
+	*statsP = stats;
+}
+
+
+
+//
+// VoSPI Resync internal functions
+//
+
+/**
+ * Record the cost of a loss of sync event that just ended with a frame
+ */
+static void end_event(int64_t nowUsec)
+{
+	uint32_t recover;
+
+	attempt = 0;
+	if (lastFrameUsec == 0) return;
+	stats.recoveries++;
+
+	recover = (uint32_t) (nowUsec - lastFrameUsec);
+	stats.recover_usec_last = recover;
+	stats.recover_usec_sum += recover;
+	if (recover > stats.recover_usec_max) stats.recover_usec_max = recover;
+
+	// The frames that should have arrived between the two
+	stats.frames_lost_last = (recover + LEP_FRAME_PERIOD_USEC/2) / LEP_FRAME_PERIOD_USEC;
+	if (stats.frames_lost_last > 0) stats.frames_lost_last--;
+	stats.frames_lost += stats.frames_lost_last;
+}
@@ -0,0 +1,82 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef VOSPI_RESYNC_H
+#define VOSPI_RESYNC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "vospi.h"
+
+
+//
+// VoSPI Resync Constants
+//
+
+// Consecutive segment reads showing a misaligned (VOSPI_SYNC_LOST) or silent
+// (VOSPI_SYNC_NO_DATA) stream before recovering
+#define LEP_RESYNC_BAD_SLOTS      3
+
+// Segment reads without a frame before recovering even though the stream looks
+// aligned (e.g. out of step with VSYNC).  Three frame periods allows for a FFC.
+#define LEP_RESYNC_NO_FRAME_SLOTS (3 * LEP_SEG_SLOTS_PER_FRAME)
+
+// Minimum CS idle time that re-establishes VoSPI packet alignment
+// (Lepton 3.5 data sheet section 4.2.3.3.1 "Establishing/Re-Establishing Sync")
+#define LEP_RESYNC_IDLE_MSEC      185
+
+// Recovery attempt (counted from 1 since the last frame) that re-sends the CCI
+// configuration and the one that resets the Lepton.  Other attempts just idle.
+#define LEP_RESYNC_RECONFIG_ATTEMPT 3
+#define LEP_RESYNC_RESET_ATTEMPT    6
+
+
+
+//
+// VoSPI Resync Data structures
+//
+
+// Recovery steps, cheapest first
+typedef enum {
+	VOSPI_RESYNC_NONE,         // Keep reading segments
+	VOSPI_RESYNC_IDLE,         // Idle CS for LEP_RESYNC_IDLE_MSEC
+	VOSPI_RESYNC_RECONFIG,     // Re-send the CCI configuration, then idle
+	VOSPI_RESYNC_RESET         // Hardware reset and re-initialization
+} vospi_resync_action_t;
+
+typedef struct {
+	uint32_t events;           // Losses of sync that needed a recovery step
+	uint32_t recoveries;       // Events that have ended with a frame
+	uint32_t idles;            // Recovery steps taken
+	uint32_t reconfigs;
+	uint32_t resets;
+	uint32_t recover_usec_last; // Last good frame before an event to the first one after
+	uint32_t recover_usec_max;
+	uint64_t recover_usec_sum;
+	uint32_t frames_lost_last; // Unique frames missed during an event
+	uint32_t frames_lost;
+} vospi_resync_stats_t;
+
+
+
+//
+// VoSPI Resync API
+//
+vospi_resync_action_t vospi_resync_update(bool gotFrame, vospi_sync_t sync, int64_t nowUsec);
+void vospi_resync_get_stats(vospi_resync_stats_t* statsP);
+
+#endif /* VOSPI_RESYNC_H */
@@ -0,0 +1,143 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Packet payload unpack kernels for the VoSPI engine.
+ *
+ * Packet payloads are big-endian 16-bit pixels.  The kernels load two pixels at a
+ * time as one 32-bit word and byte-swap both halves with a couple of mask/shift
+ * operations (SIMD within a register) instead of assembling each pixel from two byte
+ * loads.  Both the packet payload (offset 4 in a 4-byte aligned DMA buffer with
+ * 164-byte packets) and the destination rows (80 pixel multiples) are 32-bit aligned.
+ *
+ * Neighbouring thermal pixels almost always fall in the same coarse histogram bin,
+ * so the histogram is accumulated as runs of equal bins held in registers rather
+ * than with a read-modify-write of the bin for every pixel.
+ */
+#include <stdint.h>
+#include <string.h>
+#include "vospi_unpack.h"
+
+
+
+//
+// VoSPI Unpack API
+//
+
+/**
+ * Prepare a statistics block to accumulate a new set of packets
+ */
+void vospi_stats_reset(vospi_stats_t* stP)
+{
+	stP->min = 0xFFFF;
+	stP->max = 0x0000;
+	stP->sum = 0;
+	memset(stP->hist, 0, sizeof(stP->hist));
+}
+
+
+/**
+ * Accumulate srcP into dstP
+ */
+void vospi_stats_merge(vospi_stats_t* dstP, const vospi_stats_t* srcP)
+{
+	int i;
+
+	if (srcP->min < dstP->min) dstP->min = srcP->min;
+	if (srcP->max > dstP->max) dstP->max = srcP->max;
+	dstP->sum += srcP->sum;
+	for (i = 0; i < LEP_HIST_BINS; i++) {
+		dstP->hist[i] += srcP->hist[i];
+	}
+}
+
+
+/**
+ * Convert one packet's image payload to host order in dstP and accumulate its
+ * min, max, sum and histogram into stP in the same pass.
+ */
+void vospi_unpack_packet(const uint8_t* pktP, uint16_t* dstP, vospi_stats_t* stP)
+{
+	const uint8_t* srcP = __builtin_assume_aligned(pktP + 4, 4);
+	uint8_t* pushP = __builtin_assume_aligned(dstP, 4);
+	uint16_t* histP = stP->hist;
+	uint32_t min = stP->min;
+	uint32_t max = stP->max;
+	uint32_t sum = 0;
+	uint32_t bin, run = 0;
+	uint32_t w, lo, hi;
+	int i;
+
+	bin = (((uint32_t) srcP[0] << 8) | srcP[1]) >> LEP_HIST_SHIFT;
+	for (i = 0; i < LEP_PKT_PAYLOAD_WORDS; i++) {
+		memcpy(&w, srcP, 4);
+		srcP += 4;
+
+		// Swap the bytes of both 16-bit halves
+		w = ((w & 0x00FF00FF) << 8) | ((w >> 8) & 0x00FF00FF);
+		memcpy(pushP, &w, 4);
+		pushP += 4;
+
+		lo = w & 0xFFFF;
+		hi = w >> 16;
+		sum += lo + hi;
+		min = (lo < min) ? lo : min;
+		min = (hi < min) ? hi : min;
+		max = (lo > max) ? lo : max;
+		max = (hi > max) ? hi : max;
+
+		if ((lo >> LEP_HIST_SHIFT) == bin) {
+			run++;
+		} else {
+			histP[bin] += run;
+			bin = lo >> LEP_HIST_SHIFT;
+			run = 1;
+		}
+		if ((hi >> LEP_HIST_SHIFT) == bin) {
+			run++;
+		} else {
+			histP[bin] += run;
+			bin = hi >> LEP_HIST_SHIFT;
+			run = 1;
+		}
+	}
+	histP[bin] += run;
+
+	stP->min = min;
+	stP->max = max;
+	stP->sum += sum;
+}
+
+
+/**
+ * Convert one packet's telemetry payload to host order in dstP
+ */
+void vospi_unpack_telem(const uint8_t* pktP, uint16_t* dstP)
+{
+	const uint8_t* srcP = __builtin_assume_aligned(pktP + 4, 4);
+	uint8_t* pushP = __builtin_assume_aligned(dstP, 4);
+	uint32_t w;
+	int i;
+
+	for (i = 0; i < LEP_PKT_PAYLOAD_WORDS; i++) {
+		memcpy(&w, srcP, 4);
+		srcP += 4;
+		w = ((w & 0x00FF00FF) << 8) | ((w >> 8) & 0x00FF00FF);
+		memcpy(pushP, &w, 4);
+		pushP += 4;
+	}
+}
@@ -0,0 +1,55 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef VOSPI_UNPACK_H
+#define VOSPI_UNPACK_H
+
+#include <stdint.h>
+#include "system_utilities.h"
+#include "vospi.h"
+
+
+//
+// VoSPI Unpack Constants
+//
+
+// Payload of one packet as 32-bit words (two pixels each)
+#define LEP_PKT_PAYLOAD_WORDS ((LEP_PKT_LENGTH - 4) / 4)
+
+
+//
+// VoSPI Unpack Data structures
+//
+
+// Image statistics accumulated while packets are unpacked
+typedef struct {
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+	uint16_t hist[LEP_HIST_BINS];
+} vospi_stats_t;
+
+
+//
+// VoSPI Unpack API
+//
+void vospi_stats_reset(vospi_stats_t* stP);
+void vospi_stats_merge(vospi_stats_t* dstP, const vospi_stats_t* srcP);
+void vospi_unpack_packet(const uint8_t* pktP, uint16_t* dstP, vospi_stats_t* stP);
+void vospi_unpack_telem(const uint8_t* pktP, uint16_t* dstP);
+
+#endif /* VOSPI_UNPACK_H */
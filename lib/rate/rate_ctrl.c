@@ -0,0 +1,173 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Adaptive send rate control.
+ *
+ * Fits the outgoing frame rate to what the link sustains instead of letting a slow
+ * link block send() while frames age behind it.  After each frame the sender
+ * reports whether it went out, how long the socket took to accept it (a send that
+ * blocks means the socket's send buffer is full), its publish to sent latency and
+ * how many frames were dropped for lack of room since the last report.
+ *
+ * Multiplicative in both directions on the send interval, backing off faster than
+ * it recovers:
+ *   congested (failed send, drops, latency over target, or send time eating most of
+ *   the interval): interval * 3/2, at least 5/4 of the smoothed send time, and one
+ *   encoding level up.  Further congestion within two intervals of a cut is the
+ *   same episode and does not cut again.
+ *   RATE_CTRL_PROBE_FRAMES clean frames in a row: interval * 7/8, or once at the
+ *   minimum interval one encoding level down.
+ * The encoding level is a hint for the sender (e.g. a coarser tile delta threshold);
+ * quality is restored only after the rate has recovered.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "rate_ctrl.h"
+
+
+
+//
+// Rate Control Forward Declarations for internal functions
+//
+static void congested(rate_ctrl_t* rcP, int64_t now_usec);
+static void probe(rate_ctrl_t* rcP);
+
+
+
+//
+// Rate Control API
+//
+void rate_ctrl_init(rate_ctrl_t* rcP, const rate_ctrl_config_t* cfgP)
+{
+	memset(rcP, 0, sizeof(rate_ctrl_t));
+	rcP->cfg = *cfgP;
+	rcP->stats.interval_usec = cfgP->min_interval_usec;
+}
+
+
+/**
+ * Returns true if a frame available at now_usec should be sent.  Frames are offered
+ * with some jitter, so one up to half a frame early still counts.
+ */
+bool rate_ctrl_admit(rate_ctrl_t* rcP, int64_t now_usec)
+{
+	if ((now_usec + (rcP->cfg.frame_usec >> 1)) < rcP->next_usec) {
+		rcP->stats.skipped++;
+		return false;
+	}
+	
+	rcP->next_usec = now_usec + rcP->stats.interval_usec;
+	rcP->stats.admitted++;
+	return true;
+}
+
+
+/**
+ * Report the outcome of sending an admitted frame.  Returns true if the encoding
+ * level changed.
+ */
+bool rate_ctrl_update(rate_ctrl_t* rcP, int64_t now_usec, bool sent, uint32_t send_usec, uint32_t latency_usec, uint32_t drops)
+{
+	rate_ctrl_stats_t* sP = &rcP->stats;
+	int level = sP->level;
+	uint32_t budget;
+	
+	if (sent) {
+		sP->send_usec_avg = sP->send_usec_avg - (sP->send_usec_avg >> 2) + (send_usec >> 2);
+		sP->latency_usec_avg = sP->latency_usec_avg - (sP->latency_usec_avg >> 2) + (latency_usec >> 2);
+	}
+	
+	// The socket taking most of the interval to accept a frame means its buffer is full
+	budget = (sP->interval_usec > rcP->cfg.frame_usec) ? sP->interval_usec : rcP->cfg.frame_usec;
+	if (!sent || (drops != 0) || (latency_usec > rcP->cfg.target_latency_usec) ||
+	    (send_usec > (budget - (budget >> 2)))) {
+		rcP->good_run = 0;
+		if (now_usec >= rcP->hold_usec) {
+			congested(rcP, now_usec);
+		}
+	} else if (++rcP->good_run >= RATE_CTRL_PROBE_FRAMES) {
+		rcP->good_run = 0;
+		probe(rcP);
+	}
+	
+	return (sP->level != level);
+}
+
+
+/**
+ * Returns the current encoding level hint (0 is full quality, up to cfg.max_level)
+ */
+int rate_ctrl_level(const rate_ctrl_t* rcP)
+{
+	return rcP->stats.level;
+}
+
+
+/**
+ * Get a snapshot of the rate control statistics (including the current interval)
+ */
+void rate_ctrl_get_stats(const rate_ctrl_t* rcP, rate_ctrl_stats_t* statsP)
+{
+	*statsP = rcP->stats;
+}
+
+
+
+//
+// Rate Control internal functions
+//
+static void congested(rate_ctrl_t* rcP, int64_t now_usec)
+{
+	rate_ctrl_stats_t* sP = &rcP->stats;
+	uint32_t interval;
+	
+	// Frames never go faster than the link accepts them
+	interval = (sP->interval_usec > rcP->cfg.frame_usec) ? sP->interval_usec : rcP->cfg.frame_usec;
+	interval += interval >> 1;
+	if (interval < (sP->send_usec_avg + (sP->send_usec_avg >> 2))) {
+		interval = sP->send_usec_avg + (sP->send_usec_avg >> 2);
+	}
+	if (interval < rcP->cfg.min_interval_usec) interval = rcP->cfg.min_interval_usec;
+	if (interval > rcP->cfg.max_interval_usec) interval = rcP->cfg.max_interval_usec;
+	sP->interval_usec = interval;
+	
+	if (sP->level < rcP->cfg.max_level) sP->level++;
+	
+	sP->congestion_events++;
+	rcP->hold_usec = now_usec + 2 * (int64_t) interval;
+}
+
+
+static void probe(rate_ctrl_t* rcP)
+{
+	rate_ctrl_stats_t* sP = &rcP->stats;
+	
+	if (sP->interval_usec > rcP->cfg.min_interval_usec) {
+		sP->interval_usec -= (sP->interval_usec >> 3);
+		if ((sP->interval_usec <= rcP->cfg.frame_usec) || (sP->interval_usec < (rcP->cfg.min_interval_usec + 8))) {
+			// Already every frame offered, or close enough to the minimum that
+			// interval >> 3 would take forever to get there
+			sP->interval_usec = rcP->cfg.min_interval_usec;
+		}
+		sP->probes++;
+	} else if (sP->level > 0) {
+		sP->level--;
+		sP->probes++;
+	}
+}
@@ -0,0 +1,75 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef RATE_CTRL_H
+#define RATE_CTRL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+//
+// Rate Control Constants
+//
+
+// Consecutive uncongested frames before the rate is raised a step
+#define RATE_CTRL_PROBE_FRAMES 8
+
+
+
+//
+// Rate Control Data structures
+//
+typedef struct {
+	uint32_t frame_usec;           // Nominal spacing of the frames offered
+	uint32_t min_interval_usec;    // Fastest send spacing (0 = every frame)
+	uint32_t max_interval_usec;    // Slowest send spacing
+	uint32_t target_latency_usec;  // Publish to sent latency above which the link is congested
+	int max_level;                 // Highest encoding level (0 = never change the encoding)
+} rate_ctrl_config_t;
+
+typedef struct {
+	uint32_t interval_usec;        // Current send spacing
+	int level;                     // Current encoding level
+	uint32_t admitted;             // Frames let through
+	uint32_t skipped;              // Frames held back to keep to the interval
+	uint32_t congestion_events;    // Rate cuts
+	uint32_t probes;               // Rate raises
+	uint32_t send_usec_avg;        // Smoothed time a frame takes to hand to the socket
+	uint32_t latency_usec_avg;     // Smoothed publish to sent latency
+} rate_ctrl_stats_t;
+
+typedef struct {
+	rate_ctrl_config_t cfg;
+	int64_t next_usec;             // Earliest time the next frame is admitted
+	int64_t hold_usec;             // Congestion before this time belongs to the last cut
+	int good_run;                  // Uncongested frames since the last change
+	rate_ctrl_stats_t stats;
+} rate_ctrl_t;
+
+
+
+//
+// Rate Control API
+//
+void rate_ctrl_init(rate_ctrl_t* rcP, const rate_ctrl_config_t* cfgP);
+bool rate_ctrl_admit(rate_ctrl_t* rcP, int64_t now_usec);
+bool rate_ctrl_update(rate_ctrl_t* rcP, int64_t now_usec, bool sent, uint32_t send_usec, uint32_t latency_usec, uint32_t drops);
+int rate_ctrl_level(const rate_ctrl_t* rcP);
+void rate_ctrl_get_stats(const rate_ctrl_t* rcP, rate_ctrl_stats_t* statsP);
+
+#endif /* RATE_CTRL_H */
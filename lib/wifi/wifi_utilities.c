@@ -16,6 +16,7 @@
  * ***************************************************************************
  */
 #include "wifi_utilities.h"
+#include "system_config.h"
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_event_loop.h"
@@ -57,6 +58,9 @@ static bool got_scan_done_event = false; // Set when an AP Scan is complete
 
 // FreeRTOS event group to signal when we are connected
 static EventGroupHandle_t wifi_event_group;
+#ifdef STATIC_ALLOCATION
+static StaticEventGroup_t wifi_event_group_buf;
+#endif
 
 
 
@@ -84,7 +88,11 @@ bool wifi_init()
 	esp_err_t ret;
 	
 	// Setup the event handler
+#ifdef STATIC_ALLOCATION
+	wifi_event_group = xEventGroupCreateStatic(&wifi_event_group_buf);
+#else
 	wifi_event_group = xEventGroupCreate();
+#endif
 	ret = esp_event_loop_init(sys_event_handler, NULL);
 	if (ret != ESP_OK) {
 		ESP_LOGE(TAG, "Could not initialize event loop handler (%d)", ret);
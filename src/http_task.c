@@ -0,0 +1,962 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * On-device HTTP server for clients that join the soft AP and pull frames.
+ *
+ *   GET /stream    multipart/x-mixed-replace stream, one part per frame
+ *   GET /snapshot  the most recent frame
+ *   GET /ws        WebSocket, one binary message per frame (CONFIG_HTTPD_WS_SUPPORT,
+ *                  ESP-IDF 4.3 or later)
+ *
+ * Each frame is sent as it is on the send_task stream: an rsp_frame_hdr_t, the
+ * telemetry if any and the pixels, so tools/codec/rsp_decode reads the first two.
+ * Raw frames are written straight from the frame pool.  Each stream client is a
+ * frame subscriber (frame_sub.h) with its own queue, which drops the client's oldest
+ * frame when it falls HTTP_CLIENT_QUEUE_DEPTH frames behind; a client that keeps
+ * falling behind is evicted.  A WebSocket client only ever gets the newest frame
+ * waiting for it; dashboards want the current picture, not a backlog.
+ *
+ * A client picks its own rate and encoding with query parameters, e.g.
+ * /stream?fps=1&encoding=rice for an alarm service that only needs a frame a second.
+ * fps holds the client to at most that rate; encoding is raw (default) or rice
+ * (RSP_ENC_RICE, from an encode buffer allocated for the client).
+ *
+ * esp_http_server parses the request (and does the WebSocket handshake) and sends
+ * nothing more after the handler returns, so http_task writes the parts and messages
+ * itself, without blocking, to every client at once.  The server keeps watching the
+ * session and hands the socket back through its close function when the client goes
+ * away.  Pongs are written by http_task too, between messages.
+ */
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "http_task.h"
+#include "send_task.h"
+#include "system_utilities.h"
+#include "system_config.h"
+#include "esp_system.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_http_server.h"
+#include "esp_idf_version.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/sockets.h"
+#include "esp_heap_caps.h"
+#include "frame_codec.h"
+#include "frame_ring.h"
+#include "frame_pool.h"
+#include "frame_sub.h"
+#include "vospi.h"
+
+
+// Uncomment to log HTTP statistics
+//#define LOG_HTTP_STATS
+
+
+// Response to a stream request; the body is the parts until the connection closes
+#define HTTP_STREAM_RESPONSE "HTTP/1.1 200 OK\r\n" \
+                             "Content-Type: multipart/x-mixed-replace;boundary=" HTTP_STREAM_BOUNDARY "\r\n" \
+                             "Cache-Control: no-store\r\n" \
+                             "Access-Control-Allow-Origin: *\r\n" \
+                             "Connection: close\r\n\r\n"
+
+// Headers ahead of each part (leaves room for the Content-Length digits)
+#define HTTP_PART_HDR_FMT    "--" HTTP_STREAM_BOUNDARY "\r\n" \
+                             "Content-Type: application/octet-stream\r\n" \
+                             "Content-Length: %u\r\n\r\n"
+#define HTTP_PART_HDR_LEN    (sizeof(HTTP_PART_HDR_FMT) + 8)
+
+// Longest WebSocket frame header (server frames are not masked) and the largest
+// control frame payload (RFC 6455)
+#define HTTP_WS_HDR_LEN      10
+#define HTTP_WS_MAX_CTRL_LEN 125
+#define HTTP_WS_OP_BINARY    0x2
+#define HTTP_WS_OP_PONG      0xA
+#define HTTP_WS_FIN          0x80
+
+// /ws needs the server's WebSocket support and control frames passed to the handler
+// (ESP-IDF 4.3).  Older servers answer pings and closes from the server task, which
+// would interleave them with a message http_task is part way through writing.
+#if defined(CONFIG_HTTPD_WS_SUPPORT) && (ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(4, 3, 0))
+#define HTTP_WS_STREAMING
+#endif
+
+
+
+//
+// HTTP Task Data structures
+//
+
+// Stream client slot states.  The server moves a slot from FREE to ACTIVE and marks
+// it RELEASED when it is done with the session; http_task marks it DROPPING when it
+// gives up on the client and returns it to FREE.
+typedef enum {
+	HTTP_CLIENT_FREE,
+	HTTP_CLIENT_ACTIVE,
+	HTTP_CLIENT_DROPPING,
+	HTTP_CLIENT_RELEASED
+} http_client_state_t;
+
+typedef struct {
+	atomic_int state;            // http_client_state_t
+	int fd;
+	bool websocket;              // Binary messages instead of multipart parts
+	frame_sub_t sub;             // Frames waiting for this client, loaded by lepton_task
+	uint8_t* encP;               // Encode buffer (RSP_ENC_RICE clients)
+	lep_buffer_t* bufP;          // Frame being written (NULL when idle or writing a pong)
+	rsp_frame_hdr_t hdr;
+	char part_hdr[HTTP_PART_HDR_LEN];
+	uint8_t ws_hdr[HTTP_WS_HDR_LEN];
+	uint8_t pong[2 + HTTP_WS_MAX_CTRL_LEN];
+	atomic_int pong_len;         // Bytes of pong waiting to be written (0 for none)
+	struct iovec iov[5];         // Part or message header, frame header, telemetry, pixels, part end
+	int iov_idx;                 // Writing while iov_idx < iov_cnt
+	int iov_cnt;
+	int64_t deadline_usec;
+} http_client_t;
+
+
+
+//
+// HTTP Task variables
+//
+static const char* TAG = "http_task";
+
+static httpd_handle_t http_server;
+
+static http_client_t http_clients[HTTP_MAX_STREAM_CLIENTS];
+#if defined(STATIC_ALLOCATION) && defined(HTTP_STREAMING)
+// Encode buffers for ?encoding=rice clients, placed with the frames (in PSRAM, which
+// HTTP_STREAMING needs)
+static LEP_FRAME_MEM_ATTR uint8_t http_enc_mem[HTTP_MAX_STREAM_CLIENTS][LEP_NUM_PIXELS*2];
+#endif
+
+// Most recent frame for snapshots, swapped by lepton_task
+static lep_buffer_t* http_latestP;
+static portMUX_TYPE http_latest_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Payload CRC of the frame being streamed, computed once for every client
+static uint32_t http_crc_seq;
+static uint32_t http_crc;
+static bool http_crc_valid;
+
+// Statistics
+static http_task_stats_t http_stats;
+
+
+
+//
+// HTTP Task Forward Declarations for internal functions
+//
+static esp_err_t stream_handler(httpd_req_t* req);
+static esp_err_t snapshot_handler(httpd_req_t* req);
+#ifdef HTTP_WS_STREAMING
+static esp_err_t ws_handler(httpd_req_t* req);
+#endif
+static void session_close(httpd_handle_t hd, int sockfd);
+static void client_prefs(httpd_req_t* req, frame_sub_prefs_t* prefsP);
+static void notify_frame(void* arg);
+static http_client_t* client_claim();
+static void client_activate(http_client_t* clientP, int fd, bool websocket, const frame_sub_prefs_t* prefsP);
+static void service_client(http_client_t* clientP);
+static lep_buffer_t* client_next_frame(http_client_t* clientP);
+static void client_start_frame(http_client_t* clientP, lep_buffer_t* bufP);
+static bool client_encode(http_client_t* clientP, const lep_buffer_t* bufP);
+static void client_start_pong(http_client_t* clientP);
+static bool client_busy(const http_client_t* clientP);
+static bool client_write(http_client_t* clientP);
+static void client_finish_frame(http_client_t* clientP);
+static void client_drop(http_client_t* clientP);
+static bool clients_busy();
+static void clients_wait_writable(uint32_t wait_msec);
+static uint32_t frame_crc(const rsp_frame_hdr_t* hdrP, const lep_buffer_t* bufP);
+static int ws_frame_hdr(uint8_t* hdrP, int opcode, uint32_t len);
+#ifdef LOG_HTTP_STATS
+static void log_stats();
+#endif
+
+
+
+//
+// HTTP Task API
+//
+
+/**
+ * Set up the stream client slots and subscribe them to lepton_task's frames (before
+ * the tasks start)
+ */
+bool http_buffer_init()
+{
+	int i;
+	
+	for (i = 0; i < HTTP_MAX_STREAM_CLIENTS; i++) {
+		atomic_store(&http_clients[i].state, HTTP_CLIENT_FREE);
+		http_clients[i].fd = -1;
+		http_clients[i].bufP = NULL;
+		http_clients[i].iov_cnt = 0;
+#if defined(STATIC_ALLOCATION) && defined(HTTP_STREAMING)
+		http_clients[i].encP = http_enc_mem[i];
+#else
+		http_clients[i].encP = NULL;
+#endif
+		if (!frame_sub_register(&http_clients[i].sub, "http client", HTTP_CLIENT_QUEUE_DEPTH, FRAME_RING_DROP_OLDEST,
+		                        notify_frame, NULL)) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+
+
+/**
+ * Start the HTTP server.  Call once the network is up and before lepton_task starts
+ * publishing frames.
+ */
+bool http_server_init()
+{
+	httpd_config_t config = HTTPD_DEFAULT_CONFIG();
+	httpd_uri_t stream_uri = {
+		.uri = "/stream",
+		.method = HTTP_GET,
+		.handler = stream_handler,
+		.user_ctx = NULL
+	};
+	httpd_uri_t snapshot_uri = {
+		.uri = "/snapshot",
+		.method = HTTP_GET,
+		.handler = snapshot_handler,
+		.user_ctx = NULL
+	};
+#ifdef HTTP_WS_STREAMING
+	httpd_uri_t ws_uri = {
+		.uri = "/ws",
+		.method = HTTP_GET,
+		.handler = ws_handler,
+		.user_ctx = NULL,
+		.is_websocket = true,
+		// Pings reach ws_handler so that http_task writes the pongs between messages
+		.handle_ws_control_frames = true
+	};
+#endif
+	esp_err_t ret;
+	
+	config.server_port = HTTP_SERVER_PORT;
+	config.max_open_sockets = HTTP_MAX_SESSIONS;
+	config.close_fn = session_close;
+	config.core_id = 0;
+	
+	ret = httpd_start(&http_server, &config);
+	if (ret != ESP_OK) {
+		ESP_LOGE(TAG, "Start HTTP server failed - %d", ret);
+		return false;
+	}
+	httpd_register_uri_handler(http_server, &stream_uri);
+	httpd_register_uri_handler(http_server, &snapshot_uri);
+#ifdef HTTP_WS_STREAMING
+	httpd_register_uri_handler(http_server, &ws_uri);
+#endif
+	
+	ESP_LOGI(TAG, "HTTP server listening on port %d", HTTP_SERVER_PORT);
+	return true;
+}
+
+
+/**
+ * This task writes frames to the stream clients
+ */
+void http_task()
+{
+	uint32_t notification_value;
+	int i;
+#ifdef LOG_HTTP_STATS
+	int64_t statsLogUsec = esp_timer_get_time();
+#endif
+	
+	ESP_LOGI(TAG, "Start task");
+	
+	while (1) {
+		if (clients_busy()) {
+			// Pick up notifications without sleeping on them and wait for a socket
+			// with a frame in flight to drain
+			(void) xTaskNotifyWait(0x00, 0xFFFFFFFF, &notification_value, 0);
+			clients_wait_writable(HTTP_IO_POLL_MSEC);
+		} else {
+			// Sleep until there is work for us (or it is time for housekeeping)
+			(void) xTaskNotifyWait(0x00, 0xFFFFFFFF, &notification_value, pdMS_TO_TICKS(HTTP_TASK_HOUSEKEEPING_MSEC));
+		}
+		
+		for (i = 0; i < HTTP_MAX_STREAM_CLIENTS; i++) {
+			service_client(&http_clients[i]);
+		}
+		
+#ifdef LOG_HTTP_STATS
+		if ((esp_timer_get_time() - statsLogUsec) > (HTTP_STATS_LOG_SECS * 1000000LL)) {
+			statsLogUsec = esp_timer_get_time();
+			log_stats();
+		}
+#endif
+	}
+}
+
+
+/**
+ * Keep a newly published frame for snapshots (the stream clients get theirs through
+ * their subscriptions).  Called by lepton_task with a reference it keeps.
+ */
+void http_publish_frame(lep_buffer_t* bufP)
+{
+	lep_buffer_t* oldP;
+	
+	frame_pool_ref(bufP);
+	portENTER_CRITICAL(&http_latest_mux);
+	oldP = http_latestP;
+	http_latestP = bufP;
+	portEXIT_CRITICAL(&http_latest_mux);
+	if (oldP != NULL) {
+		frame_pool_release(oldP);
+	}
+}
+
+
+/**
+ * Get a snapshot of the HTTP statistics
+ */
+void http_get_stats(http_task_stats_t* statsP)
+{
+	frame_ring_stats_t fr;
+	frame_sub_stats_t fs;
+	int i;
+	
+	*statsP = http_stats;
+	for (i = 0; i < HTTP_MAX_STREAM_CLIENTS; i++) {
+		frame_ring_get_stats(&http_clients[i].sub.ring, &fr);
+		frame_sub_get_stats(&http_clients[i].sub, &fs);
+		statsP->overruns += fr.overruns;
+		statsP->decimated += fs.decimated;
+		statsP->evictions += fs.evictions;
+		statsP->over_quota += fs.over_quota;
+	}
+}
+
+
+
+//
+// Internal functions
+//
+
+/**
+ * Start a stream: send the response headers and hand the session's socket to
+ * http_task.  Runs in the server task.
+ */
+static esp_err_t stream_handler(httpd_req_t* req)
+{
+	http_client_t* clientP;
+	frame_sub_prefs_t prefs;
+	
+	if ((clientP = client_claim()) == NULL) {
+		http_stats.clients_refused++;
+		httpd_resp_set_status(req, "503 Service Unavailable");
+		return httpd_resp_send(req, "Too many stream clients", strlen("Too many stream clients"));
+	}
+	
+	if (httpd_send(req, HTTP_STREAM_RESPONSE, strlen(HTTP_STREAM_RESPONSE)) < 0) {
+		return ESP_FAIL;
+	}
+	
+	client_prefs(req, &prefs);
+	client_activate(clientP, httpd_req_to_sockfd(req), false, &prefs);
+	return ESP_OK;
+}
+
+
+/**
+ * Send the most recent frame.  Runs in the server task and blocks it for as long as
+ * the client takes (bounded by the server's send timeout).
+ */
+static esp_err_t snapshot_handler(httpd_req_t* req)
+{
+	lep_buffer_t* bufP;
+	rsp_frame_hdr_t hdr;
+	const uint16_t* telemP;
+	esp_err_t ret;
+	
+	portENTER_CRITICAL(&http_latest_mux);
+	bufP = http_latestP;
+	if (bufP != NULL) {
+		frame_pool_ref(bufP);
+	}
+	portEXIT_CRITICAL(&http_latest_mux);
+	if (bufP == NULL) {
+		httpd_resp_set_status(req, "503 Service Unavailable");
+		return httpd_resp_send(req, "No frame yet", strlen("No frame yet"));
+	}
+	
+	telemP = (bufP->telem_valid) ? bufP->lep_telemP : NULL;
+	rsp_frame_hdr_init(&hdr, bufP, esp_timer_get_time());
+#if RSP_PAYLOAD_CRC
+	rsp_frame_hdr_crc(&hdr, telemP, bufP->lep_bufferP);
+#endif
+	hdr.send_usec = esp_timer_get_time();
+	
+	httpd_resp_set_type(req, "application/octet-stream");
+	httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+	httpd_resp_set_hdr(req, "Access-Control-Allow-Origin", "*");
+	ret = httpd_resp_send_chunk(req, (const char*) &hdr, sizeof(hdr));
+	if ((ret == ESP_OK) && (telemP != NULL)) {
+		ret = httpd_resp_send_chunk(req, (const char*) telemP, hdr.telem_words*2);
+	}
+	if (ret == ESP_OK) {
+		ret = httpd_resp_send_chunk(req, (const char*) bufP->lep_bufferP, hdr.payload_len);
+	}
+	if (ret == ESP_OK) {
+		ret = httpd_resp_send_chunk(req, NULL, 0);
+	}
+	frame_pool_release(bufP);
+	
+	if (ret == ESP_OK) {
+		http_stats.snapshots++;
+	}
+	return ret;
+}
+
+
+#ifdef HTTP_WS_STREAMING
+/**
+ * Start a WebSocket client once the server has done the handshake, and handle what
+ * the client sends afterwards (only control frames are expected).  Runs in the server
+ * task; returning an error closes the session.
+ */
+static esp_err_t ws_handler(httpd_req_t* req)
+{
+	http_client_t* clientP;
+	frame_sub_prefs_t prefs;
+	httpd_ws_frame_t frame;
+	uint8_t payload[HTTP_WS_MAX_CTRL_LEN];
+	int fd = httpd_req_to_sockfd(req);
+	int i;
+	
+	if (req->method == HTTP_GET) {
+		if ((clientP = client_claim()) == NULL) {
+			http_stats.clients_refused++;
+			return ESP_FAIL;
+		}
+		client_prefs(req, &prefs);
+		client_activate(clientP, fd, true, &prefs);
+		return ESP_OK;
+	}
+	
+	memset(&frame, 0, sizeof(frame));
+	if ((httpd_ws_recv_frame(req, &frame, 0) != ESP_OK) || (frame.len > HTTP_WS_MAX_CTRL_LEN)) {
+		return ESP_FAIL;
+	}
+	frame.payload = payload;
+	if ((frame.len > 0) && (httpd_ws_recv_frame(req, &frame, frame.len) != ESP_OK)) {
+		return ESP_FAIL;
+	}
+	
+	switch (frame.type) {
+		case HTTPD_WS_TYPE_PING:
+			// Queue a pong for http_task unless one is already waiting
+			for (i = 0; i < HTTP_MAX_STREAM_CLIENTS; i++) {
+				if ((http_clients[i].fd == fd) && (atomic_load(&http_clients[i].state) == HTTP_CLIENT_ACTIVE) &&
+				    (atomic_load(&http_clients[i].pong_len) == 0)) {
+					http_clients[i].pong[0] = HTTP_WS_FIN | HTTP_WS_OP_PONG;
+					http_clients[i].pong[1] = frame.len;
+					memcpy(&http_clients[i].pong[2], payload, frame.len);
+					atomic_store(&http_clients[i].pong_len, 2 + (int) frame.len);
+					xTaskNotify(task_handle_http, HTTP_NOTIFY_CLIENT_MASK, eSetBits);
+				}
+			}
+			return ESP_OK;
+		
+		case HTTPD_WS_TYPE_CLOSE:
+			return ESP_FAIL;
+		
+		default:
+			// Nothing else means anything to us
+			return ESP_OK;
+	}
+}
+#endif
+
+
+/**
+ * Server close function.  A stream client's socket is left open for http_task to
+ * close once it has stopped writing to it, so that the descriptor cannot be reused
+ * under it.  Runs in the server task.
+ */
+static void session_close(httpd_handle_t hd, int sockfd)
+{
+	int s;
+	int i;
+	
+	for (i = 0; i < HTTP_MAX_STREAM_CLIENTS; i++) {
+		s = atomic_load(&http_clients[i].state);
+		if ((http_clients[i].fd == sockfd) && ((s == HTTP_CLIENT_ACTIVE) || (s == HTTP_CLIENT_DROPPING))) {
+			atomic_store(&http_clients[i].state, HTTP_CLIENT_RELEASED);
+			xTaskNotify(task_handle_http, HTTP_NOTIFY_CLIENT_MASK, eSetBits);
+			return;
+		}
+	}
+	
+	close(sockfd);
+}
+
+
+/**
+ * A client's subscription preferences from its request's query string (fps and
+ * encoding)
+ */
+static void client_prefs(httpd_req_t* req, frame_sub_prefs_t* prefsP)
+{
+	char query[64];
+	char value[16];
+	int fps;
+	
+	prefsP->min_interval_usec = 0;
+	prefsP->encoding = RSP_ENC_RAW16;
+	prefsP->evict_overruns = HTTP_CLIENT_EVICT_OVERRUNS;
+	
+	if (httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK) {
+		return;
+	}
+	if ((httpd_query_key_value(query, "fps", value, sizeof(value)) == ESP_OK) && ((fps = atoi(value)) > 0)) {
+		prefsP->min_interval_usec = 1000000LL / fps;
+	}
+	if ((httpd_query_key_value(query, "encoding", value, sizeof(value)) == ESP_OK) && (strcmp(value, "rice") == 0)) {
+		prefsP->encoding = RSP_ENC_RICE;
+	}
+}
+
+
+/**
+ * Subscriber notification: lepton_task queued a frame for a client (or evicted it)
+ */
+static void notify_frame(void* arg)
+{
+	xTaskNotify(task_handle_http, HTTP_NOTIFY_LEP_FRAME_MASK, eSetBits);
+}
+
+
+/**
+ * Find a free client slot.  Runs in the server task, the only one that fills slots.
+ */
+static http_client_t* client_claim()
+{
+	int i;
+	
+	for (i = 0; i < HTTP_MAX_STREAM_CLIENTS; i++) {
+		if (atomic_load(&http_clients[i].state) == HTTP_CLIENT_FREE) {
+			return &http_clients[i];
+		}
+	}
+	return NULL;
+}
+
+
+/**
+ * Hand a claimed slot to http_task and start queueing frames for it
+ */
+static void client_activate(http_client_t* clientP, int fd, bool websocket, const frame_sub_prefs_t* prefsP)
+{
+	clientP->fd = fd;
+	clientP->websocket = websocket;
+	atomic_store(&clientP->pong_len, 0);
+	atomic_store(&clientP->state, HTTP_CLIENT_ACTIVE);
+	frame_sub_attach(&clientP->sub, prefsP);
+	http_stats.clients++;
+	ESP_LOGI(TAG, "%s client %d connected (%s, %u uSec min interval)", websocket ? "WebSocket" : "Stream", fd,
+	         (prefsP->encoding == RSP_ENC_RICE) ? "rice" : "raw", (uint32_t) prefsP->min_interval_usec);
+}
+
+
+/**
+ * Write as many of a client's frames as its socket takes, or finish with the client
+ */
+static void service_client(http_client_t* clientP)
+{
+	lep_buffer_t* bufP;
+	
+	switch (atomic_load(&clientP->state)) {
+		case HTTP_CLIENT_ACTIVE:
+			if (frame_sub_evicted(&clientP->sub)) {
+				ESP_LOGI(TAG, "Client %d evicted for falling behind", clientP->fd);
+				client_drop(clientP);
+				return;
+			}
+			while (1) {
+				if (!client_busy(clientP)) {
+					if (atomic_load(&clientP->pong_len) != 0) {
+						client_start_pong(clientP);
+					} else if ((bufP = client_next_frame(clientP)) != NULL) {
+						client_start_frame(clientP, bufP);
+					} else {
+						return;
+					}
+				}
+				if (!client_write(clientP)) {
+					return;
+				}
+			}
+			break;
+		
+		case HTTP_CLIENT_RELEASED:
+			// The server is done with the session
+			client_finish_frame(clientP);
+			frame_sub_detach(&clientP->sub);
+#if !defined(STATIC_ALLOCATION) || !defined(HTTP_STREAMING)
+			if (clientP->encP != NULL) {
+				heap_caps_free(clientP->encP);
+				clientP->encP = NULL;
+			}
+#endif
+			close(clientP->fd);
+			ESP_LOGI(TAG, "Client %d closed", clientP->fd);
+			clientP->fd = -1;
+			http_stats.clients_closed++;
+			atomic_store(&clientP->state, HTTP_CLIENT_FREE);
+			break;
+		
+		default:
+			// lepton_task may have queued a frame just as the client stopped.  Only
+			// drain it: the server task may be attaching a new client to a FREE slot.
+			frame_sub_drain(&clientP->sub);
+			break;
+	}
+}
+
+
+/**
+ * Take the next frame for a client from its ring.  A WebSocket client skips to the
+ * newest one.
+ */
+static lep_buffer_t* client_next_frame(http_client_t* clientP)
+{
+	lep_buffer_t* bufP = frame_sub_pop(&clientP->sub);
+	lep_buffer_t* nextP;
+	
+	if ((bufP != NULL) && clientP->websocket) {
+		while ((nextP = frame_sub_pop(&clientP->sub)) != NULL) {
+			frame_sub_release(&clientP->sub, bufP);
+			bufP = nextP;
+			http_stats.skipped++;
+		}
+	}
+	return bufP;
+}
+
+
+/**
+ * Set up the part or message for a frame taken from the client's ring, holding its
+ * reference
+ */
+static void client_start_frame(http_client_t* clientP, lep_buffer_t* bufP)
+{
+	const uint16_t* telemP = (bufP->telem_valid) ? bufP->lep_telemP : NULL;
+	const void* payloadP = bufP->lep_bufferP;
+	int64_t now = esp_timer_get_time();
+	int len;
+	
+	clientP->bufP = bufP;
+	rsp_frame_hdr_init(&clientP->hdr, bufP, now);
+	if ((clientP->sub.prefs.encoding == RSP_ENC_RICE) && client_encode(clientP, bufP)) {
+		payloadP = clientP->encP;
+#if RSP_PAYLOAD_CRC
+		rsp_frame_hdr_crc(&clientP->hdr, telemP, payloadP);
+#endif
+	} else {
+#if RSP_PAYLOAD_CRC
+		clientP->hdr.flags |= RSP_FLAG_CRC;
+		clientP->hdr.payload_crc = frame_crc(&clientP->hdr, bufP);
+#endif
+	}
+	clientP->hdr.send_usec = now;
+	clientP->deadline_usec = now + HTTP_SEND_TIMEOUT_MSEC * 1000LL;
+	
+	len = sizeof(rsp_frame_hdr_t) + clientP->hdr.telem_words*2 + clientP->hdr.payload_len;
+	if (clientP->websocket) {
+		clientP->iov[0].iov_base = clientP->ws_hdr;
+		clientP->iov[0].iov_len = ws_frame_hdr(clientP->ws_hdr, HTTP_WS_OP_BINARY, len);
+	} else {
+		clientP->iov[0].iov_base = clientP->part_hdr;
+		clientP->iov[0].iov_len = sprintf(clientP->part_hdr, HTTP_PART_HDR_FMT, len);
+	}
+	clientP->iov[1].iov_base = &clientP->hdr;
+	clientP->iov[1].iov_len = sizeof(rsp_frame_hdr_t);
+	clientP->iov_cnt = 2;
+	if (telemP != NULL) {
+		clientP->iov[clientP->iov_cnt].iov_base = (void*) telemP;
+		clientP->iov[clientP->iov_cnt++].iov_len = clientP->hdr.telem_words*2;
+	}
+	clientP->iov[clientP->iov_cnt].iov_base = (void*) payloadP;
+	clientP->iov[clientP->iov_cnt++].iov_len = clientP->hdr.payload_len;
+	if (!clientP->websocket) {
+		clientP->iov[clientP->iov_cnt].iov_base = "\r\n";
+		clientP->iov[clientP->iov_cnt++].iov_len = 2;
+	}
+	clientP->iov_idx = 0;
+}
+
+
+/**
+ * Rice code a frame into the client's encode buffer (allocated on first use) and set
+ * the header's encoding and payload length.  Returns false to send the frame raw: no
+ * buffer, or the encoded image would be no smaller.
+ */
+static bool client_encode(http_client_t* clientP, const lep_buffer_t* bufP)
+{
+	int len;
+	
+	if (clientP->encP == NULL) {
+		clientP->encP = heap_caps_malloc(LEP_NUM_PIXELS*2, LEP_FRAME_MEM_CAPS);
+		if (clientP->encP == NULL) {
+			ESP_LOGE(TAG, "malloc client %d encode buffer failed", clientP->fd);
+			return false;
+		}
+	}
+	
+	len = frame_codec_encode(bufP->lep_bufferP, LEP_WIDTH, LEP_HEIGHT, LEP_WIDTH, clientP->encP, LEP_NUM_PIXELS*2);
+	if (len == 0) {
+		return false;
+	}
+	
+	http_stats.encoded++;
+	clientP->hdr.encoding = RSP_ENC_RICE;
+	clientP->hdr.payload_len = len;
+	return true;
+}
+
+
+/**
+ * Set up the pong the server task queued for a WebSocket client
+ */
+static void client_start_pong(http_client_t* clientP)
+{
+	clientP->iov[0].iov_base = clientP->pong;
+	clientP->iov[0].iov_len = atomic_load(&clientP->pong_len);
+	clientP->iov_cnt = 1;
+	clientP->iov_idx = 0;
+	clientP->deadline_usec = esp_timer_get_time() + HTTP_SEND_TIMEOUT_MSEC * 1000LL;
+}
+
+
+/**
+ * True while a part, message or pong is being written to a client
+ */
+static bool client_busy(const http_client_t* clientP)
+{
+	return (clientP->iov_idx < clientP->iov_cnt);
+}
+
+
+/**
+ * Write as much of the client's frame (or pong) as its socket takes without blocking.
+ * Returns true once it is all written; false if it is still in flight or the client
+ * was dropped.
+ */
+static bool client_write(http_client_t* clientP)
+{
+	struct msghdr msg;
+	int n;
+	
+	while (1) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &clientP->iov[clientP->iov_idx];
+		msg.msg_iovlen = clientP->iov_cnt - clientP->iov_idx;
+		
+		n = sendmsg(clientP->fd, &msg, MSG_DONTWAIT);
+		if (n < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				ESP_LOGI(TAG, "Stream client %d send failed: %s", clientP->fd, strerror(errno));
+				client_drop(clientP);
+			} else if (esp_timer_get_time() >= clientP->deadline_usec) {
+				ESP_LOGI(TAG, "Stream client %d send timed out", clientP->fd);
+				http_stats.send_timeouts++;
+				client_drop(clientP);
+			}
+			return false;
+		}
+		http_stats.bytes += n;
+		
+		// Skip what was written
+		while ((n > 0) && (clientP->iov_idx < clientP->iov_cnt)) {
+			if ((size_t) n >= clientP->iov[clientP->iov_idx].iov_len) {
+				n -= clientP->iov[clientP->iov_idx++].iov_len;
+			} else {
+				clientP->iov[clientP->iov_idx].iov_base = (uint8_t*) clientP->iov[clientP->iov_idx].iov_base + n;
+				clientP->iov[clientP->iov_idx].iov_len -= n;
+				n = 0;
+			}
+		}
+		if (clientP->iov_idx == clientP->iov_cnt) {
+			if (clientP->bufP != NULL) {
+				http_stats.frames++;
+				client_finish_frame(clientP);
+			} else {
+				atomic_store(&clientP->pong_len, 0);
+			}
+			return true;
+		}
+		http_stats.partial_writes++;
+	}
+}
+
+
+/**
+ * Stop writing to a client, releasing its frame in flight if any
+ */
+static void client_finish_frame(http_client_t* clientP)
+{
+	lep_buffer_t* bufP = clientP->bufP;
+	
+	clientP->iov_cnt = 0;
+	clientP->iov_idx = 0;
+	if (bufP != NULL) {
+		clientP->bufP = NULL;
+		frame_sub_release(&clientP->sub, bufP);
+	}
+}
+
+
+/**
+ * Give up on a client and have the server close its session (which releases the
+ * slot through session_close)
+ */
+static void client_drop(http_client_t* clientP)
+{
+	int expected = HTTP_CLIENT_ACTIVE;
+	
+	client_finish_frame(clientP);
+	frame_sub_detach(&clientP->sub);
+	if (atomic_compare_exchange_strong(&clientP->state, &expected, HTTP_CLIENT_DROPPING)) {
+		http_stats.clients_dropped++;
+		httpd_sess_trigger_close(http_server, clientP->fd);
+	}
+}
+
+
+/**
+ * True while any stream client has a frame in flight
+ */
+static bool clients_busy()
+{
+	int i;
+	
+	for (i = 0; i < HTTP_MAX_STREAM_CLIENTS; i++) {
+		if (client_busy(&http_clients[i])) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+/**
+ * Wait up to wait_msec for any client socket with a frame in flight to take more
+ */
+static void clients_wait_writable(uint32_t wait_msec)
+{
+	struct timeval tv;
+	fd_set wfds;
+	int maxfd = -1;
+	int i;
+	
+	FD_ZERO(&wfds);
+	for (i = 0; i < HTTP_MAX_STREAM_CLIENTS; i++) {
+		if (client_busy(&http_clients[i]) && (atomic_load(&http_clients[i].state) == HTTP_CLIENT_ACTIVE)) {
+			FD_SET(http_clients[i].fd, &wfds);
+			if (http_clients[i].fd > maxfd) maxfd = http_clients[i].fd;
+		}
+	}
+	if (maxfd < 0) {
+		return;
+	}
+	
+	tv.tv_sec = wait_msec / 1000;
+	tv.tv_usec = (wait_msec % 1000) * 1000;
+	(void) select(maxfd + 1, NULL, &wfds, NULL, &tv);
+}
+
+
+/**
+ * Payload CRC of a raw frame, computed only for the first client that sends it
+ */
+static uint32_t frame_crc(const rsp_frame_hdr_t* hdrP, const lep_buffer_t* bufP)
+{
+	rsp_frame_hdr_t hdr;
+	
+	if (!http_crc_valid || (http_crc_seq != bufP->frame_seq)) {
+		hdr = *hdrP;
+		rsp_frame_hdr_crc(&hdr, (bufP->telem_valid) ? bufP->lep_telemP : NULL, bufP->lep_bufferP);
+		http_crc = hdr.payload_crc;
+		http_crc_seq = bufP->frame_seq;
+		http_crc_valid = true;
+	}
+	return http_crc;
+}
+
+
+/**
+ * Build an unmasked, unfragmented WebSocket frame header.  Returns its length.
+ */
+static int ws_frame_hdr(uint8_t* hdrP, int opcode, uint32_t len)
+{
+	int n, i;
+	
+	hdrP[0] = HTTP_WS_FIN | opcode;
+	if (len < 126) {
+		hdrP[1] = len;
+		return 2;
+	}
+	
+	// 16 or 64 bit big-endian extended length
+	n = (len < 65536) ? 2 : 8;
+	hdrP[1] = (n == 2) ? 126 : 127;
+	for (i = 0; i < n; i++) {
+		hdrP[1 + n - i] = (i < 4) ? (uint8_t) (len >> (8*i)) : 0;
+	}
+	return 2 + n;
+}
+
+
+#ifdef LOG_HTTP_STATS
+/**
+ * Log the HTTP statistics
+ */
+static void log_stats()
+{
+	http_task_stats_t stats;
+	int active = 0;
+	int i;
+	
+	http_get_stats(&stats);
+	for (i = 0; i < HTTP_MAX_STREAM_CLIENTS; i++) {
+		if (atomic_load(&http_clients[i].state) == HTTP_CLIENT_ACTIVE) active++;
+	}
+	
+	ESP_LOGI(TAG, "stream clients %d (accepted %u, refused %u, dropped %u, closed %u), snapshots %u",
+	         active, stats.clients, stats.clients_refused, stats.clients_dropped, stats.clients_closed, stats.snapshots);
+	ESP_LOGI(TAG, "frames %u, overruns %u, skipped %u, bytes %llu, partial writes %u, send timeouts %u",
+	         stats.frames, stats.overruns, stats.skipped, stats.bytes, stats.partial_writes, stats.send_timeouts);
+	ESP_LOGI(TAG, "decimated %u, over quota %u, evictions %u, rice coded %u", stats.decimated, stats.over_quota,
+	         stats.evictions, stats.encoded);
+}
+#endif
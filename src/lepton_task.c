@@ -19,6 +19,8 @@
 #include "esp_system.h"
 #include "esp_log.h"
 #include "esp_heap_caps.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
 #include "driver/gpio.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
@@ -26,12 +28,17 @@
 #include "freertos/task.h"
 #include "lepton_task.h"
 #include "send_task.h"
+#include "http_task.h"
 #include "lepton_utilities.h"
 #include "system_utilities.h"
 #include "wifi_utilities.h"
 #include "i2c.h"
 #include "cci.h"
 #include "vospi.h"
+#include "vospi_resync.h"
+#include "frame_ring.h"
+#include "frame_pool.h"
+#include "frame_sub.h"
 #include "system_config.h"
 
 
@@ -46,15 +53,58 @@
 #define STATE_ERROR     3
 
 
+// Uncomment to periodically log acquisition statistics
+//#define LOG_ACQ_STATS
+
+
 //
 // LEP Task variables
 //
 static const char* TAG = "lepton_task";
 
+// VSYNC edge time recorded by the ISR.  A 64-bit value takes two loads on this core,
+// so it is only read and written under vsync_mux.
+static int64_t vsync_edge_usec;
+static portMUX_TYPE vsync_mux = portMUX_INITIALIZER_UNLOCKED;
+
+// Statistics
+static lep_task_stats_t lep_stats;
+
+
+// Shared memory data structures.  The pool covers the frame lepton_task loads and
+// every consumer's quota, so one that stalls cannot take frames from the others.
+#ifdef HTTP_STREAMING
+#define LEP_FRAME_POOL_NEEDED (1 + FRAME_SUB_POOL_QUOTA(LEP_FRAME_RING_DEPTH) + HTTP_POOL_FRAMES)
+#else
+#define LEP_FRAME_POOL_NEEDED (1 + FRAME_SUB_POOL_QUOTA(LEP_FRAME_RING_DEPTH))
+#endif
+#if LEP_FRAME_POOL_SIZE < LEP_FRAME_POOL_NEEDED
+#error "LEP_FRAME_POOL_SIZE does not cover the frame subscribers' quotas"
+#endif
+
+static lep_buffer_t lep_buffer[LEP_FRAME_POOL_SIZE];  // Frames shared through the frame pool
+QueueHandle_t lep_segment_queue;  // Completed segments for send_task (SEGMENT_STREAMING)
 
-//// Global buffer pointers for memory allocated in the external SPIRAM
-// Shared memory data structures
-lep_buffer_t lep_buffer[2];   // Ping-pong buffer loaded by lepton_task for send_task
+#ifdef STATIC_ALLOCATION
+// Backing memory for the shared data structures
+static LEP_FRAME_MEM_ATTR uint16_t lep_frame_mem[LEP_FRAME_POOL_SIZE][LEP_NUM_PIXELS];
+static LEP_FRAME_MEM_ATTR uint16_t lep_telem_mem[LEP_FRAME_POOL_SIZE][LEP_TEL_WORDS];
+#ifdef SEGMENT_STREAMING
+static StaticQueue_t lep_segment_queue_buf;
+static uint8_t lep_segment_queue_mem[LEP_SEGMENT_QUEUE_LEN * sizeof(lep_segment_t)];
+#endif
+#endif
+
+
+//
+// LEP Task Forward Declarations for internal functions
+//
+static void IRAM_ATTR vsync_isr_handler(void* arg);
+static bool wait_vsync(int64_t* vsyncUsecP);
+static void update_first_pkt_stats(int64_t vsyncUsec);
+#ifdef LOG_ACQ_STATS
+static void log_stats();
+#endif
 
 
 //
@@ -67,11 +117,17 @@ lep_buffer_t lep_buffer[2];   // Ping-pong buffer loaded by lepton_task for send
 void lepton_task()
 {
 	int task_state = STATE_INIT;
-	int rsp_buf_index = 0;
-	int vsync_count = 0;
-	int sync_fail_count = 0;
 	int reset_fail_count = 0;
+	bool got_frame;
+	vospi_sync_t sync;
 	int64_t vsyncDetectedUsec;
+	lep_buffer_t* bufP;
+#ifdef SEGMENT_STREAMING
+	lep_segment_t segment;
+#endif
+#ifdef LOG_ACQ_STATS
+	int64_t statsLogUsec = 0;
+#endif
 	
 	ESP_LOGI(TAG, "Start task");
 
@@ -80,6 +136,15 @@ void lepton_task()
 	gpio_set_direction(LEP_RESET_IO, GPIO_MODE_OUTPUT);
 	gpio_set_level(LEP_RESET_IO, 1);
 	
+	// Take VSYNC rising edges as interrupts.  The ISR service is installed here so
+	// that the interrupt is allocated on this task's core.
+	gpio_set_intr_type(LEP_VSYNC_IO, GPIO_INTR_POSEDGE);
+	if ((gpio_install_isr_service(ESP_INTR_FLAG_IRAM) != ESP_OK) ||
+	    (gpio_isr_handler_add(LEP_VSYNC_IO, vsync_isr_handler, NULL) != ESP_OK)) {
+		ESP_LOGE(TAG, "Lepton VSYNC interrupt initialization failed");
+		vTaskDelete(NULL);
+	}
+	
 	// Attempt to initialize the VoSPI interface
 	if (vospi_init() != ESP_OK) {
 		ESP_LOGE(TAG, "Lepton VoSPI initialization failed");
@@ -101,67 +166,96 @@ void lepton_task()
 				break;
 			
 			case STATE_RUN:   // Initialized and running
-				// Spin waiting for vsync to be asserted
-				while (gpio_get_level(LEP_VSYNC_IO) == 0) {
-					vTaskDelay(pdMS_TO_TICKS(9));
+				// Block until the VSYNC ISR signals the start of a segment
+				got_frame = false;
+				sync = VOSPI_SYNC_NO_DATA;
+				if (wait_vsync(&vsyncDetectedUsec)) {
+					// Attempt to process a segment
+					got_frame = vospi_transfer_segment(vsyncDetectedUsec);
+					sync = vospi_get_sync();
+					update_first_pkt_stats(vsyncDetectedUsec);
+#ifdef SEGMENT_STREAMING
+					// Hand each completed segment to send_task right away (never blocking on it)
+					if (vospi_get_segment(&segment)) {
+						if (xQueueSend(lep_segment_queue, &segment, 0) == pdTRUE) {
+							xTaskNotify(task_handle_send, RSP_NOTIFY_LEP_SEGMENT_MASK, eSetBits);
+						} else {
+							lep_stats.segments_dropped++;
+						}
+					}
+#endif
 				}
-				vsyncDetectedUsec = esp_timer_get_time();
 				
-				// Attempt to process a segment
-				if (vospi_transfer_segment(vsyncDetectedUsec)) {
+				if (got_frame) {
 					// Got image
-					vsync_count = 0;
-					
-					// Copy the frame to the current half of the shared buffer and let send_task know
-					xSemaphoreTake(lep_buffer[rsp_buf_index].lep_mutex, portMAX_DELAY);
-					vospi_get_frame(&lep_buffer[rsp_buf_index]);
-					xSemaphoreGive(lep_buffer[rsp_buf_index].lep_mutex);
+					// Swap the frame into a free pool frame and hand references to the
+					// consumers.  If they are holding every frame this one is lost;
+					// lepton_task never waits for them.
+					if ((bufP = frame_pool_acquire()) != NULL) {
+						vospi_get_frame(bufP);
+						bufP->lep_frame_count = (bufP->telem_valid) ? lepton_get_tel_frame_count(bufP->lep_telemP) : 0;
 #ifdef LOG_ACQ_TIMESTAMP
-					ESP_LOGI(TAG, "Push into buf %d", rsp_buf_index);
+						ESP_LOGI(TAG, "Push frame %d", (int) (bufP - lep_buffer));
+#endif
+						bufP->publish_usec = esp_timer_get_time();
+						(void) frame_sub_publish(bufP);
+#ifdef HTTP_STREAMING
+						http_publish_frame(bufP);
 #endif
-					if (rsp_buf_index == 0) {
-						xTaskNotify(task_handle_send, RSP_NOTIFY_LEP_FRAME_MASK_0, eSetBits);
-						rsp_buf_index = 1;
-					} else {
-						xTaskNotify(task_handle_send, RSP_NOTIFY_LEP_FRAME_MASK_1, eSetBits);
-						rsp_buf_index = 0;
+						frame_pool_release(bufP);
 					}
 					
-					// Hold fault counters reset while operating
-					sync_fail_count = 0;
+					// Hold the reset fault counter reset while operating
 					reset_fail_count = 0;
-				} else {
-					// We should see a valid frame every 12 vsync interrupts (one frame period).
-					// However, since we may be resynchronizing with the VoSPI stream and our task
-					// may be interrupted by other tasks, we give the lepton extra frame periods
-					// to start correctly streaming data.  We may still fail when the lepton runs
-					// a FFC since that takes a long time.
-					if (++vsync_count == 36) {
-						vsync_count = 0;
-						ESP_LOGI(TAG, "Could not get lepton image");
+				}
+				
+				// Recover from a loss of sync starting with the cheapest step
+				switch (vospi_resync_update(got_frame, sync, esp_timer_get_time())) {
+					case VOSPI_RESYNC_NONE:
+						break;
+					
+					case VOSPI_RESYNC_RECONFIG:
+						// The Lepton may have rebooted itself and lost its configuration
+						ESP_LOGI(TAG, "Reconfigure Lepton for resync");
+						if (!lepton_init()) {
+							ESP_LOGE(TAG, "Lepton CCI initialization failed");
+						}
+						// Fall through to idle
+					
+					case VOSPI_RESYNC_IDLE:
+						ESP_LOGI(TAG, "Resync VoSPI (%s)", (sync == VOSPI_SYNC_OK) ? "no frame" :
+						         (sync == VOSPI_SYNC_NO_DATA) ? "no data" :
+						         (sync == VOSPI_SYNC_LOST) ? "misaligned" : "partial");
 						
-						// Pause to allow resynchronization
-						// (Lepton 3.5 data sheet section 4.2.3.3.1 "Establishing/Re-Establishing Sync")
-						vTaskDelay(pdMS_TO_TICKS(185));
+						// Idle CS to let the Lepton realign its packet output
+						vTaskDelay(pdMS_TO_TICKS(LEP_RESYNC_IDLE_MSEC));
 						
-						// Check for too many consecutive resynchronization failures.
-						// This should only occur if something has gone wrong.
-						if (sync_fail_count++ == LEP_SYNC_FAIL_FAULT_LIMIT) {
-							if (reset_fail_count == 0) {
-								// Reset the first time
-								task_state = STATE_RE_INIT;
-							} else {
-								ESP_LOGE(TAG, "Could not sync to VoSPI after task reset");
-								
-								// Possibly permanent error condition
-								task_state = STATE_ERROR;
-								
-								// Use reset_fail_count as a timer
-								reset_fail_count = LEP_RESET_FAIL_RETRY_SECS;
-							}
+						// Forget the VSYNC edges that occurred while paused
+						(void) ulTaskNotifyTake(pdTRUE, 0);
+						break;
+					
+					case VOSPI_RESYNC_RESET:
+						// Resynchronization failed.  This should only occur if something has gone wrong.
+						if (reset_fail_count == 0) {
+							// Reset the first time
+							task_state = STATE_RE_INIT;
+						} else {
+							ESP_LOGE(TAG, "Could not sync to VoSPI after task reset");
+							
+							// Possibly permanent error condition
+							task_state = STATE_ERROR;
+							
+							// Use reset_fail_count as a timer
+							reset_fail_count = LEP_RESET_FAIL_RETRY_SECS;
 						}
-					}
+						break;
+				}
+#ifdef LOG_ACQ_STATS
+				if ((esp_timer_get_time() - statsLogUsec) > (LEP_STATS_LOG_SECS * 1000000LL)) {
+					statsLogUsec = esp_timer_get_time();
+					log_stats();
 				}
+#endif
 				break;
 			
 			case STATE_RE_INIT:  // Reset and re-init
@@ -179,6 +273,9 @@ void lepton_task()
     			if (lepton_init()) {
 					task_state = STATE_RUN;
 					
+					// Start with a fresh VSYNC
+					(void) ulTaskNotifyTake(pdTRUE, 0);
+					
 					// Note the reset
     				reset_fail_count = 1;
 				} else {
@@ -224,7 +321,7 @@ bool lepton_io_init()
 		.miso_io_num=LEP_MISO_IO,
 		.mosi_io_num=-1,
 		.sclk_io_num=LEP_SCK_IO,
-		.max_transfer_sz=LEP_PKT_LENGTH,
+		.max_transfer_sz=LEP_MAX_PKTS_PER_XFER*LEP_PKT_LENGTH,
 		.quadwp_io_num=-1,
 		.quadhd_io_num=-1
 	};
@@ -238,45 +335,161 @@ bool lepton_io_init()
 
 
 /**
- * Allocate shared buffers for use by tasks for image data in the external RAM
+ * Allocate shared buffers for use by tasks for image data (in PSRAM when available)
  */
 bool lepton_buffer_init()
 {
+	int i;
+	
 	ESP_LOGI(TAG, "Buffer Allocation");
 	
-	// Allocate the LEP/RSP task lepton frame and telemetry ping-pong buffers
-	lep_buffer[0].lep_bufferP = heap_caps_malloc(LEP_NUM_PIXELS*2, MALLOC_CAP_DMA);
-	if (lep_buffer[0].lep_bufferP == NULL) {
-		ESP_LOGE(TAG, "malloc RSP lepton shared image buffer 0 failed");
-		return false;
-	}
-	lep_buffer[0].lep_telemP = heap_caps_malloc(LEP_TEL_WORDS*2, MALLOC_CAP_DMA);
-	if (lep_buffer[0].lep_telemP == NULL) {
-		ESP_LOGE(TAG, "malloc RSP lepton shared telemetry buffer 0 failed");
-		return false;
+	// Allocate the LEP/RSP task lepton frame and telemetry buffers
+	for (i = 0; i < LEP_FRAME_POOL_SIZE; i++) {
+#ifdef STATIC_ALLOCATION
+		lep_buffer[i].lep_bufferP = lep_frame_mem[i];
+		lep_buffer[i].lep_telemP = lep_telem_mem[i];
+#else
+		lep_buffer[i].lep_bufferP = heap_caps_malloc(LEP_NUM_PIXELS*2, LEP_FRAME_MEM_CAPS);
+		if (lep_buffer[i].lep_bufferP == NULL) {
+			ESP_LOGE(TAG, "malloc RSP lepton shared image buffer %d failed", i);
+			return false;
+		}
+		lep_buffer[i].lep_telemP = heap_caps_malloc(LEP_TEL_WORDS*2, LEP_FRAME_MEM_CAPS);
+		if (lep_buffer[i].lep_telemP == NULL) {
+			ESP_LOGE(TAG, "malloc RSP lepton shared telemetry buffer %d failed", i);
+			return false;
+		}
+#endif
 	}
-	lep_buffer[1].lep_bufferP = heap_caps_malloc(LEP_NUM_PIXELS*2, MALLOC_CAP_DMA);
-	if (lep_buffer[1].lep_bufferP == NULL) {
-		ESP_LOGE(TAG, "malloc RSP lepton shared image buffer 1 failed");
+	
+	// Share them through the frame pool
+	if (!frame_pool_init(lep_buffer, LEP_FRAME_POOL_SIZE)) {
 		return false;
 	}
-	lep_buffer[1].lep_telemP = heap_caps_malloc(LEP_TEL_WORDS*2, MALLOC_CAP_DMA);
-	if (lep_buffer[1].lep_telemP == NULL) {
-		ESP_LOGE(TAG, "malloc RSP lepton shared telemetry buffer 1 failed");
+	
+#ifdef SEGMENT_STREAMING
+	// Create the completed segment queue
+#ifdef STATIC_ALLOCATION
+	lep_segment_queue = xQueueCreateStatic(LEP_SEGMENT_QUEUE_LEN, sizeof(lep_segment_t),
+	                                       lep_segment_queue_mem, &lep_segment_queue_buf);
+#else
+	lep_segment_queue = xQueueCreate(LEP_SEGMENT_QUEUE_LEN, sizeof(lep_segment_t));
+#endif
+	if (lep_segment_queue == NULL) {
+		ESP_LOGE(TAG, "create RSP lepton segment queue failed");
 		return false;
 	}
+#endif
 	
-	// Create the ping-pong buffer access mutexes
-	lep_buffer[0].lep_mutex = xSemaphoreCreateMutex();
-	if (lep_buffer[0].lep_mutex == NULL) {
-		ESP_LOGE(TAG, "create RSP lepton mutex 0 failed");
-		return false;
+	return true;
+}
+
+
+/**
+ * Get a snapshot of the acquisition statistics
+ */
+void lepton_get_stats(lep_task_stats_t* statsP)
+{
+	*statsP = lep_stats;
+}
+
+
+
+//
+// LEP Task internal functions
+//
+
+/**
+ * VSYNC rising edge ISR: timestamp the edge and wake lepton_task
+ */
+static void IRAM_ATTR vsync_isr_handler(void* arg)
+{
+	BaseType_t xHigherPriorityTaskWoken = pdFALSE;
+	
+	portENTER_CRITICAL_ISR(&vsync_mux);
+	vsync_edge_usec = esp_timer_get_time();
+	portEXIT_CRITICAL_ISR(&vsync_mux);
+	lep_stats.vsync_edges++;
+	
+	vTaskNotifyGiveFromISR(task_handle_lepton, &xHigherPriorityTaskWoken);
+	if (xHigherPriorityTaskWoken == pdTRUE) {
+		portYIELD_FROM_ISR();
 	}
-	lep_buffer[1].lep_mutex = xSemaphoreCreateMutex();
-	if (lep_buffer[1].lep_mutex == NULL) {
-		ESP_LOGE(TAG, "create RSP lepton mutex 1 failed");
+}
+
+
+/**
+ * Wait for the VSYNC ISR.  Returns true with the edge time in vsyncUsecP, false
+ * if no VSYNC occurred within LEP_VSYNC_TIMEOUT_MSEC.
+ */
+static bool wait_vsync(int64_t* vsyncUsecP)
+{
+	uint32_t edges;
+	
+	edges = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(LEP_VSYNC_TIMEOUT_MSEC));
+	if (edges == 0) {
+		lep_stats.vsync_timeouts++;
 		return false;
 	}
 	
+	// More than one pending edge means we were still busy when a segment started
+	lep_stats.vsync_missed += edges - 1;
+	portENTER_CRITICAL(&vsync_mux);
+	*vsyncUsecP = vsync_edge_usec;
+	portEXIT_CRITICAL(&vsync_mux);
+	
 	return true;
 }
+
+
+/**
+ * Record the VSYNC to first packet latency of the last segment read
+ */
+static void update_first_pkt_stats(int64_t vsyncUsec)
+{
+	vospi_counters_t cnt;
+	uint32_t lat;
+	
+	vospi_get_counters(&cnt);
+	if (cnt.first_pkt_usec >= vsyncUsec) {
+		lat = (uint32_t) (cnt.first_pkt_usec - vsyncUsec);
+		lep_stats.first_pkt_count++;
+		lep_stats.first_pkt_usec_last = lat;
+		lep_stats.first_pkt_usec_sum += lat;
+		if (lat > lep_stats.first_pkt_usec_max) {
+			lep_stats.first_pkt_usec_max = lat;
+		}
+	}
+}
+
+
+#ifdef LOG_ACQ_STATS
+static void log_stats()
+{
+	vospi_counters_t cnt;
+	vospi_resync_stats_t rs;
+	frame_ring_stats_t fr;
+	frame_pool_stats_t fp;
+	
+	vospi_get_counters(&cnt);
+	ESP_LOGI(TAG, "vsync %u (missed %u, timeouts %u), frames %u, first packet avg %u max %u uSec",
+	         lep_stats.vsync_edges, lep_stats.vsync_missed, lep_stats.vsync_timeouts, cnt.frames,
+	         (lep_stats.first_pkt_count == 0) ? 0 : (uint32_t) (lep_stats.first_pkt_usec_sum / lep_stats.first_pkt_count),
+	         lep_stats.first_pkt_usec_max);
+	ESP_LOGI(TAG, "packets %u, crc errors %u, crc dropped frames %u",
+	         cnt.packets, cnt.crc_errors, cnt.crc_frames_dropped);
+	vospi_resync_get_stats(&rs);
+	ESP_LOGI(TAG, "resync events %u (idle %u, reconfig %u, reset %u), recover avg %u max %u uSec, frames lost %u",
+	         rs.events, rs.idles, rs.reconfigs, rs.resets,
+	         (rs.recoveries == 0) ? 0 : (uint32_t) (rs.recover_usec_sum / rs.recoveries), rs.recover_usec_max,
+	         rs.frames_lost);
+	frame_pool_get_stats(&fp);
+	ESP_LOGI(TAG, "pool acquired %u, exhausted %u, max in use %u", fp.acquired, fp.exhausted, fp.max_in_use);
+	frame_ring_get_stats(&send_frame_sub.ring, &fr);
+	ESP_LOGI(TAG, "send ring published %u, consumed %u, overruns %u (dropped oldest %u, newest %u), max queued %u",
+	         fr.published, fr.consumed, fr.overruns, fr.dropped_oldest, fr.dropped_newest, fr.max_queued);
+#ifdef SEGMENT_STREAMING
+	ESP_LOGI(TAG, "segments %u, dropped %u", cnt.segments, lep_stats.segments_dropped);
+#endif
+}
+#endif
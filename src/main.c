@@ -18,12 +18,15 @@
 #include <stdio.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_heap_caps.h"
 #include "esp_log.h"
+#include "http_task.h"
 #include "lepton_task.h"
 #include "send_task.h"
 #include "wifi_utilities.h"
 #include "system_config.h"
 #include "system_utilities.h"
+#include "vospi.h"
 
 
 static const char* TAG = "main";
@@ -34,6 +37,27 @@ static const char* TAG = "main";
 //
 TaskHandle_t task_handle_lepton;
 TaskHandle_t task_handle_send;
+TaskHandle_t task_handle_announce;
+TaskHandle_t task_handle_http;
+
+#ifdef STATIC_ALLOCATION
+// Task stacks and control blocks
+static StackType_t send_task_stack[RSP_TASK_STACK_SIZE];
+static StaticTask_t send_task_tcb;
+#ifndef UDP_STREAMING
+static StackType_t announce_task_stack[RSP_ANNOUNCE_TASK_STACK_SIZE];
+static StaticTask_t announce_task_tcb;
+#endif
+static StackType_t lepton_task_stack[LEP_TASK_STACK_SIZE];
+static StaticTask_t lepton_task_tcb;
+#ifdef HTTP_STREAMING
+static StackType_t http_task_stack[HTTP_TASK_STACK_SIZE];
+static StaticTask_t http_task_tcb;
+#endif
+#endif
+
+
+static void log_memory_budget();
 
 
 void app_main()
@@ -53,17 +77,114 @@ void app_main()
     }
     
     // Pre-allocate big buffers
-    if (!lepton_buffer_init()) {
+    if (!lepton_buffer_init() || !send_buffer_init()) {
     	ESP_LOGE(TAG, "ESP32 memory allocate failed");
     	while (1) {vTaskDelay(pdMS_TO_TICKS(100));}
     }
+#ifdef HTTP_STREAMING
+    if (!http_buffer_init()) {
+    	ESP_LOGE(TAG, "ESP32 memory allocate failed");
+    	while (1) {vTaskDelay(pdMS_TO_TICKS(100));}
+    }
+#endif
     
     // Delay for Lepton internal initialization on power-on (max 950 mSec)
     vTaskDelay(pdMS_TO_TICKS(1000));
     
     // Start tasks
-    //  Core 0 : send task
+    //  Core 0 : send task, announce task, http task (and the HTTP server)
     //  Core 1 : lepton task
-    xTaskCreatePinnedToCore(&send_task, "send_task",  3072, NULL, 2, &task_handle_send,  0);
-    xTaskCreatePinnedToCore(&lepton_task, "lepton_task",  2048, NULL, 19, &task_handle_lepton,  1);
+#ifdef STATIC_ALLOCATION
+#ifndef UDP_STREAMING
+    task_handle_announce = xTaskCreateStaticPinnedToCore(&announce_task, "announce_task", RSP_ANNOUNCE_TASK_STACK_SIZE,
+                                                         NULL, 1, announce_task_stack, &announce_task_tcb, 0);
+#endif
+    task_handle_send = xTaskCreateStaticPinnedToCore(&send_task, "send_task", RSP_TASK_STACK_SIZE, NULL, 2,
+                                                     send_task_stack, &send_task_tcb, 0);
+#ifdef HTTP_STREAMING
+    task_handle_http = xTaskCreateStaticPinnedToCore(&http_task, "http_task", HTTP_TASK_STACK_SIZE, NULL, 2,
+                                                     http_task_stack, &http_task_tcb, 0);
+#endif
+    task_handle_lepton = xTaskCreateStaticPinnedToCore(&lepton_task, "lepton_task", LEP_TASK_STACK_SIZE, NULL, 19,
+                                                       lepton_task_stack, &lepton_task_tcb, 1);
+#else
+#ifndef UDP_STREAMING
+    xTaskCreatePinnedToCore(&announce_task, "announce_task",  RSP_ANNOUNCE_TASK_STACK_SIZE, NULL, 1, &task_handle_announce,  0);
+#endif
+    xTaskCreatePinnedToCore(&send_task, "send_task",  RSP_TASK_STACK_SIZE, NULL, 2, &task_handle_send,  0);
+#ifdef HTTP_STREAMING
+    xTaskCreatePinnedToCore(&http_task, "http_task",  HTTP_TASK_STACK_SIZE, NULL, 2, &task_handle_http,  0);
+#endif
+    xTaskCreatePinnedToCore(&lepton_task, "lepton_task",  LEP_TASK_STACK_SIZE, NULL, 19, &task_handle_lepton,  1);
+#endif
+    
+#ifdef HTTP_STREAMING
+    // Serve pull clients on the soft AP (http_task is running to take them)
+    if (!http_server_init()) {
+    	ESP_LOGE(TAG, "HTTP server start failed");
+    }
+#endif
+    
+    log_memory_budget();
+}
+
+
+/**
+ * Log what the firmware's own buffers cost and what is left for everything else
+ */
+static void log_memory_budget()
+{
+    bool frames_ext = (LEP_FRAME_MEM_CAPS & MALLOC_CAP_SPIRAM) != 0;
+    int stacks = LEP_TASK_STACK_SIZE + RSP_TASK_STACK_SIZE;
+    int frames = (LEP_FRAME_POOL_SIZE + 1) * (LEP_NUM_PIXELS + LEP_TEL_WORDS) * 2;  // Pool + acquisition frame
+    int packets = LEP_MAX_PKTS_PER_XFER * LEP_PKT_LENGTH;
+    int queues = 0;
+    int internal;
+    
+#ifndef UDP_STREAMING
+    stacks += RSP_ANNOUNCE_TASK_STACK_SIZE;
+#endif
+#ifdef HTTP_STREAMING
+    stacks += HTTP_TASK_STACK_SIZE;
+#endif
+#ifdef STATIC_ALLOCATION
+    stacks += 2 * sizeof(StaticTask_t);
+#ifndef UDP_STREAMING
+    stacks += sizeof(StaticTask_t);
+#endif
+#ifdef HTTP_STREAMING
+    stacks += sizeof(StaticTask_t);
+#endif
+#endif
+#ifdef SEGMENT_STREAMING
+    queues += LEP_SEGMENT_QUEUE_LEN * sizeof(lep_segment_t);
+    frames += LEP_TEL_WORDS_PER_SEG * 2;  // send_task segment copy is placed with the frames
+#endif
+#if RSP_STREAM_ENCODING != RSP_ENC_RAW16
+    frames += RSP_ENC_BUF_BYTES;  // send_task encode buffer is placed with the frames
+#endif
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+    frames += LEP_NUM_PIXELS * 2; // and so is the delta reference
+#endif
+#if defined(HTTP_STREAMING) && defined(STATIC_ALLOCATION)
+    frames += HTTP_MAX_STREAM_CLIENTS * LEP_NUM_PIXELS * 2;  // http_task client encode buffers
+#endif
+    internal = stacks + packets + queues + (frames_ext ? 0 : frames);
+    
+#ifdef STATIC_ALLOCATION
+    ESP_LOGI(TAG, "Memory budget (static):");
+#else
+    ESP_LOGI(TAG, "Memory budget (heap):");
+#endif
+    ESP_LOGI(TAG, "  task stacks    %6d", stacks);
+    ESP_LOGI(TAG, "  frames         %6d (%d in %s RAM)", frames, LEP_FRAME_POOL_SIZE + 1, frames_ext ? "external" : "internal");
+    ESP_LOGI(TAG, "  vospi packets  %6d (DMA)", packets);
+    ESP_LOGI(TAG, "  queues         %6d", queues);
+    ESP_LOGI(TAG, "  internal total %6d", internal);
+    ESP_LOGI(TAG, "  internal free  %6d (min %d, largest block %d)",
+             heap_caps_get_free_size(MALLOC_CAP_INTERNAL), heap_caps_get_minimum_free_size(MALLOC_CAP_INTERNAL),
+             heap_caps_get_largest_free_block(MALLOC_CAP_INTERNAL));
+    if (frames_ext) {
+        ESP_LOGI(TAG, "  external free  %6d", heap_caps_get_free_size(MALLOC_CAP_SPIRAM));
+    }
 }
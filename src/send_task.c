@@ -29,11 +29,50 @@
 #include "lwip/sockets.h"
 #include "lwip/sys.h"
 #include <lwip/netdb.h>
+#include "esp32/rom/crc.h"
+#include "esp_heap_caps.h"
+#include "frame_codec.h"
+#include "frame_delta.h"
+#include "rate_ctrl.h"
 #include "vospi.h"
+#include "frame_ring.h"
+#include "frame_pool.h"
+#include "frame_sub.h"
 
 
-// Uncomment to log processing timestamps
-//#define LOG_PROC_TIMESTAMP
+// Uncomment to log send statistics
+//#define LOG_SEND_STATS
+
+
+// Transport for the stream connection
+#ifdef UDP_STREAMING
+#define STREAM_PROTOCOL UDP_FLAG
+#else
+#define STREAM_PROTOCOL TCP_FLAG
+#endif
+
+
+//
+// RSP Task Data structures
+//
+
+// Stream connection state
+typedef enum {
+	STREAM_DOWN,
+	STREAM_CONNECTING,
+	STREAM_UP
+} stream_state_t;
+
+// Frame being written to the stream connection, held until the socket has taken all
+// of it or RSP_SEND_TIMEOUT_MSEC passes
+typedef struct {
+	lep_buffer_t* bufP;          // Referenced while in flight (NULL when idle)
+	rsp_frame_hdr_t hdr;
+	struct iovec iov[3];         // Header, telemetry and payload still to write
+	int iov_idx;
+	int iov_cnt;
+	int64_t deadline_usec;
+} stream_tx_t;
 
 
 //
@@ -42,112 +81,670 @@
 static const char* TAG = "send_task";
 
 // State
-static bool got_image_0, got_image_1;
+static bool got_frame;
+static bool got_segment;
+
+// Statistics
+static rsp_task_stats_t rsp_stats;
+
+// Stream connection socket (-1 when not connected), its state and reconnect backoff
+static int sockfd = -1;
+static stream_state_t stream_state = STREAM_DOWN;
+static int64_t connect_deadline_usec;
+static uint32_t reconnect_msec = RSP_RECONNECT_MIN_MSEC;
+static int64_t next_connect_usec;
 
-// Connection socket
-static int sockfd;
+// Frame in flight on the stream connection
+static stream_tx_t stream_tx;
 
-// Image buffer
-static uint16_t send_img_buffer[LEP_NUM_PIXELS];
+// Frames waiting to be sent
+frame_sub_t send_frame_sub;
+
+// Send rate control and the drop counts it has seen
+static rate_ctrl_t rsp_rate;
+#if RSP_RATE_CONTROL
+static uint32_t rsp_rate_drops;
+#endif
+
+#if RSP_STREAM_ENCODING != RSP_ENC_RAW16
+// Encoded payload of the frame being sent
+#ifdef STATIC_ALLOCATION
+static LEP_FRAME_MEM_ATTR uint8_t rsp_enc_mem[RSP_ENC_BUF_BYTES];
+static uint8_t* rsp_encP = rsp_enc_mem;
+#else
+static uint8_t* rsp_encP;
+#endif
+#endif
+
+#ifdef SEGMENT_STREAMING
+// Copy of the segment being sent (the acquisition frame is reused while it is written)
+#ifdef STATIC_ALLOCATION
+static LEP_FRAME_MEM_ATTR uint16_t rsp_seg_mem[LEP_TEL_WORDS_PER_SEG];
+static uint16_t* rsp_segP = rsp_seg_mem;
+#else
+static uint16_t* rsp_segP;
+#endif
+#endif
+
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+// Tile delta state and the image the receiver holds
+static frame_delta_t rsp_delta;
+#ifdef STATIC_ALLOCATION
+static LEP_FRAME_MEM_ATTR uint16_t rsp_delta_ref_mem[LEP_NUM_PIXELS];
+static uint16_t* rsp_delta_refP = rsp_delta_ref_mem;
+#else
+static uint16_t* rsp_delta_refP;
+#endif
+#endif
 
 //
 // RSP Task Forward Declarations for internal functions
 //
-static void handle_notifications();
-static int process_image(int n);
-static void send_response(uint16_t* rsp, int len);
-static int socket_connect(t_protocol prot);
+static void handle_notifications(TickType_t wait);
+static void notify_frame(void* arg);
+#ifdef SEGMENT_STREAMING
+static void send_segment(lep_segment_t* segP);
+#endif
+static void send_frame(lep_buffer_t* bufP, int64_t dequeue_usec);
+static bool admit_frame(lep_buffer_t* bufP, int64_t dequeue_usec);
+static void frame_sent(lep_buffer_t* bufP, const rsp_frame_hdr_t* hdrP, bool sent);
+static void update_rate(lep_buffer_t* bufP, bool sent, int64_t send_usec);
+#if RSP_STREAM_ENCODING != RSP_ENC_RAW16
+static const void* encode_frame(lep_buffer_t* bufP, rsp_frame_hdr_t* hdrP);
+#endif
+static bool send_response(const void* hdr, int hdr_len, uint16_t* rsp, int len);
+static void update_dequeue_latency(int64_t publish_usec, int64_t dequeue_usec);
+static void update_wire_latency(int64_t acq_usec);
+static bool stream_connect();
+static bool stream_connect_poll(uint32_t wait_msec);
+static bool stream_connected();
+static void stream_connect_failed();
+static void stream_lost();
+static void stream_close();
+static bool stream_write(const void* data, int len);
+#ifdef UDP_STREAMING
+static bool send_frame_udp(rsp_frame_hdr_t* hdrP, const uint16_t* telemP, const void* payloadP);
+static bool stream_datagram(const rsp_udp_hdr_t* hdrP, const void* data1, int len1, const void* data2, int len2);
+#else
+static void stream_tx_start(lep_buffer_t* bufP, const rsp_frame_hdr_t* hdrP, const uint16_t* telemP, const void* payloadP);
+#endif
+static bool stream_tx_busy();
+static void stream_tx_service(uint32_t wait_msec);
+static void stream_tx_finish(bool sent);
+static bool socket_wait_writable(int64_t until_usec);
+static int socket_connect(t_protocol prot, bool* pendingP);
 esp_err_t _http_event_handle(esp_http_client_event_t *evt);
 static int http_get();
+#ifdef LOG_SEND_STATS
+static void log_stats();
+#endif
 
 //
 // RSP Task API
 //
 void send_task()
 {
-	int len;
+	rate_ctrl_config_t rate_cfg = {
+		.frame_usec = LEP_FRAME_PERIOD_USEC,
+		.min_interval_usec = 0,
+		.max_interval_usec = RSP_RATE_MAX_INTERVAL_MSEC * 1000,
+		.target_latency_usec = RSP_RATE_TARGET_LATENCY_MSEC * 1000,
+		.max_level = (RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA) ? RSP_RATE_MAX_LEVEL : 0
+	};
+	lep_buffer_t* bufP;
+	int64_t dequeue_usec;
+#ifdef SEGMENT_STREAMING
+	lep_segment_t segment;
+#endif
+#ifdef LOG_SEND_STATS
+	int64_t statsLogUsec = esp_timer_get_time();
+#endif
 	
 	ESP_LOGI(TAG, "Start task");
 	
+	rate_ctrl_init(&rsp_rate, &rate_cfg);
+	
 	while (1) {
-		// Process notifications from other tasks
-		handle_notifications();
+		if (stream_tx_busy()) {
+			// Keep pushing the frame in flight as the socket drains, picking up
+			// notifications without sleeping on them
+			handle_notifications(0);
+			stream_tx_service(RSP_IO_POLL_MSEC);
+		} else {
+			// Sleep until another task has work for us (or it is time for housekeeping)
+			handle_notifications(pdMS_TO_TICKS(RSP_TASK_HOUSEKEEPING_MSEC));
+		}
 		
-		// Look for things to send
-		if (got_image_0 || got_image_1) {
-			if (got_image_0) {
-				len = process_image(0);
-				got_image_0 = false;
-			} else {
-				len = process_image(1);
-				got_image_1 = false;
-			}	
+#ifdef SEGMENT_STREAMING
+		// Send completed segments cut-through while the rest of the frame is acquired
+		if (got_segment) {
+			got_segment = false;
+			while (xQueueReceive(lep_segment_queue, &segment, 0) == pdTRUE) {
+				send_segment(&segment);
+			}
+		}
+#endif
+		
+		// Look for things to send (frames wait in the ring while one is in flight)
+		if (got_frame && !stream_tx_busy()) {
+			got_frame = false;
+			while ((bufP = frame_sub_pop(&send_frame_sub)) != NULL) {
+				dequeue_usec = esp_timer_get_time();
+				update_dequeue_latency(bufP->publish_usec, dequeue_usec);
 				
-			// Send the image
-			if (len != 0) {
-				send_response(send_img_buffer, LEP_NUM_PIXELS*2);
+#ifndef SEGMENT_STREAMING
+				// Send the image straight from the shared frame (the segments have
+				// already been sent in SEGMENT_STREAMING mode) if it is fresh and
+				// the link has room for it
+				if (admit_frame(bufP, dequeue_usec)) {
+					send_frame(bufP, dequeue_usec);
+				}
+#endif
+				frame_sub_release(&send_frame_sub, bufP);
+				
+				if (stream_tx_busy()) {
+					// Come back for the rest once the socket has taken this one
+					got_frame = true;
+					break;
+				}
 			}
 		}
 		
-		// Sleep task
-		vTaskDelay(pdMS_TO_TICKS(RSP_TASK_SLEEP_MSEC));
+#ifdef LOG_SEND_STATS
+		if ((esp_timer_get_time() - statsLogUsec) > (RSP_STATS_LOG_SECS * 1000000LL)) {
+			statsLogUsec = esp_timer_get_time();
+			log_stats();
+		}
+#endif
 	} 
 }
 
+
+/**
+ * Announce each new stream connection to the server with an HTTP GET.  The request
+ * blocks for up to RSP_HTTP_TIMEOUT_MSEC, so it runs here rather than in send_task,
+ * which notifies this task once a connection is up and carries on sending.
+ */
+void announce_task()
+{
+	ESP_LOGI(TAG, "Start announce task");
+	
+	while (1) {
+		(void) ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		if (http_get() != ESP_OK) {
+			rsp_stats.announce_failures++;
+		}
+	}
+}
+
+
+/**
+ * Subscribe send_task to the published frames and allocate the stream encode buffers
+ * (in PSRAM when available)
+ */
+bool send_buffer_init()
+{
+	// The stream takes every frame (rate control decides which are sent)
+	frame_sub_prefs_t prefs = {
+		.min_interval_usec = 0,
+		.encoding = RSP_STREAM_ENCODING,
+		.evict_overruns = 0
+	};
+	
+	if (!frame_sub_register(&send_frame_sub, "send_task", LEP_FRAME_RING_DEPTH, LEP_FRAME_RING_POLICY,
+	                        notify_frame, NULL)) {
+		return false;
+	}
+	frame_sub_attach(&send_frame_sub, &prefs);
+	
+#if (RSP_STREAM_ENCODING != RSP_ENC_RAW16) && !defined(STATIC_ALLOCATION)
+	rsp_encP = heap_caps_malloc(RSP_ENC_BUF_BYTES, LEP_FRAME_MEM_CAPS);
+	if (rsp_encP == NULL) {
+		ESP_LOGE(TAG, "malloc RSP encode buffer failed");
+		return false;
+	}
+#endif
+	
+#if defined(SEGMENT_STREAMING) && !defined(STATIC_ALLOCATION)
+	rsp_segP = heap_caps_malloc(LEP_TEL_WORDS_PER_SEG*2, LEP_FRAME_MEM_CAPS);
+	if (rsp_segP == NULL) {
+		ESP_LOGE(TAG, "malloc RSP segment buffer failed");
+		return false;
+	}
+#endif
+	
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+#ifndef STATIC_ALLOCATION
+	rsp_delta_refP = heap_caps_malloc(LEP_NUM_PIXELS*2, LEP_FRAME_MEM_CAPS);
+	if (rsp_delta_refP == NULL) {
+		ESP_LOGE(TAG, "malloc RSP delta reference buffer failed");
+		return false;
+	}
+#endif
+	if (!frame_delta_init(&rsp_delta, LEP_WIDTH, LEP_HEIGHT, rsp_delta_refP, RSP_DELTA_THRESHOLD, RSP_DELTA_KEYFRAME_FRAMES)) {
+		return false;
+	}
+#endif
+	
+	return true;
+}
+
+
+/**
+ * Get a snapshot of the send statistics
+ */
+void send_get_stats(rsp_task_stats_t* statsP)
+{
+	*statsP = rsp_stats;
+}
+
+
+/**
+ * Get a snapshot of the rate control state and statistics
+ */
+void send_get_rate_stats(rate_ctrl_stats_t* statsP)
+{
+	rate_ctrl_get_stats(&rsp_rate, statsP);
+}
+
+
+/**
+ * Fill in the header for a frame sent raw (RSP_ENC_RAW16), with its telemetry if it
+ * has any.  Shared by every transport; callers that encode the payload update the
+ * encoding and payload_len.
+ */
+void rsp_frame_hdr_init(rsp_frame_hdr_t* hdrP, const lep_buffer_t* bufP, int64_t dequeue_usec)
+{
+	memset(hdrP, 0, sizeof(rsp_frame_hdr_t));
+	hdrP->magic = RSP_PROTO_MAGIC;
+	hdrP->version = RSP_PROTO_VERSION;
+	hdrP->hdr_len = sizeof(rsp_frame_hdr_t);
+	hdrP->encoding = RSP_ENC_RAW16;
+	hdrP->width = LEP_WIDTH;
+	hdrP->height = LEP_HEIGHT;
+	hdrP->frame_seq = bufP->frame_seq;
+	hdrP->lep_frame_count = bufP->lep_frame_count;
+	hdrP->min_val = bufP->lep_min_val;
+	hdrP->max_val = bufP->lep_max_val;
+	hdrP->vsync_usec = bufP->vsync_usec;
+	hdrP->acq_usec = bufP->acq_usec;
+	hdrP->publish_usec = bufP->publish_usec;
+	hdrP->dequeue_usec = dequeue_usec;
+	hdrP->bad_rows = bufP->bad_rows;
+	hdrP->payload_len = LEP_NUM_PIXELS*2;
+	if (bufP->telem_valid) {
+		hdrP->flags |= RSP_FLAG_TELEMETRY;
+		hdrP->telem_words = LEP_TEL_WORDS;
+	}
+}
+
+
+/**
+ * Set the payload CRC over the telemetry (NULL if none) and payload a header describes
+ */
+void rsp_frame_hdr_crc(rsp_frame_hdr_t* hdrP, const uint16_t* telemP, const void* payloadP)
+{
+	hdrP->flags |= RSP_FLAG_CRC;
+	hdrP->payload_crc = 0;
+	if (telemP != NULL) {
+		hdrP->payload_crc = crc32_le(hdrP->payload_crc, (const uint8_t*) telemP, hdrP->telem_words*2);
+	}
+	hdrP->payload_crc = crc32_le(hdrP->payload_crc, (const uint8_t*) payloadP, hdrP->payload_len);
+}
+
+
 //
 // Internal functions
 //
 
 /**
- * Handle incoming notifications
+ * Handle incoming notifications, waiting up to wait ticks for one
  */
-static void handle_notifications()
+static void handle_notifications(TickType_t wait)
 {
 	uint32_t notification_value;
 	
 	notification_value = 0;
-	if (xTaskNotifyWait(0x00, 0xFFFFFFFF, &notification_value, 0)) {
+	if (xTaskNotifyWait(0x00, 0xFFFFFFFF, &notification_value, wait)) {
 		// Handle lepton_task notifications
-		if (Notification(notification_value, RSP_NOTIFY_LEP_FRAME_MASK_0)) {
-			got_image_0 = true;
+		if (Notification(notification_value, RSP_NOTIFY_LEP_FRAME_MASK)) {
+			got_frame = true;
 		}
-		if (Notification(notification_value, RSP_NOTIFY_LEP_FRAME_MASK_1)) {
-			got_image_1 = true;
+		if (Notification(notification_value, RSP_NOTIFY_LEP_SEGMENT_MASK)) {
+			got_segment = true;
 		}
 	}
 }
 
 
 /**
- * Convert lepton data in the specified half of the ping-pong buffer into a json record
- * with delimitors for transmission over the network
+ * Subscriber notification: lepton_task queued a frame for us
  */
-static int process_image(int n)
+static void notify_frame(void* arg)
 {
-#ifdef LOG_PROC_TIMESTAMP
-	int64_t tb, te;
+	xTaskNotify(task_handle_send, RSP_NOTIFY_LEP_FRAME_MASK, eSetBits);
+}
+
+
+/**
+ * Send one frame with its header directly from the shared frame
+ */
+static void send_frame(lep_buffer_t* bufP, int64_t dequeue_usec)
+{
+	rsp_frame_hdr_t hdr;
+	const uint16_t* telemP = (bufP->telem_valid) ? bufP->lep_telemP : NULL;
+	const void* payloadP;
 	
-	tb = esp_timer_get_time();
+	// Don't bother encoding a frame there is no connection for
+	if (!stream_connect()) {
+		rsp_stats.unsent++;
+		return;
+	}
+	
+	rsp_frame_hdr_init(&hdr, bufP, dequeue_usec);
+#if RSP_STREAM_ENCODING != RSP_ENC_RAW16
+	payloadP = encode_frame(bufP, &hdr);
+#else
+	payloadP = bufP->lep_bufferP;
+#endif
+#if RSP_PAYLOAD_CRC
+	rsp_frame_hdr_crc(&hdr, telemP, payloadP);
 #endif
 	
-	// Convert the image into a json record
-	xSemaphoreTake(lep_buffer[n].lep_mutex, portMAX_DELAY);
-	void* send_img_buffer_ptr = &send_img_buffer;
-	memcpy(send_img_buffer_ptr, lep_buffer[n].lep_bufferP, LEP_NUM_PIXELS*2);
-	xSemaphoreGive(lep_buffer[n].lep_mutex);
+#ifdef UDP_STREAMING
+	frame_sent(bufP, &hdr, send_frame_udp(&hdr, telemP, payloadP));
+#else
+	// Written as the socket drains; frame_sent() runs when that finishes
+	stream_tx_start(bufP, &hdr, telemP, payloadP);
+#endif
+}
+
+
+/**
+ * Account for a frame that has been handed to the network stack, or failed to be
+ */
+static void frame_sent(lep_buffer_t* bufP, const rsp_frame_hdr_t* hdrP, bool sent)
+{
+	update_rate(bufP, sent, hdrP->send_usec);
+	if (sent) {
+		update_wire_latency(bufP->acq_usec);
+		rsp_stats.payload_bytes += hdrP->payload_len;
+	}
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+	else {
+		// The receiver may not have this frame's tiles, so start over from a keyframe
+		frame_delta_reset(&rsp_delta);
+	}
+#endif
+}
+
+
+/**
+ * Decide whether a dequeued frame is sent: never once it is stale, and with rate
+ * control only as often as the link sustains
+ */
+static bool admit_frame(lep_buffer_t* bufP, int64_t dequeue_usec)
+{
+	if ((dequeue_usec - bufP->publish_usec) > (RSP_MAX_FRAME_AGE_MSEC * 1000LL)) {
+		rsp_stats.stale++;
+		return false;
+	}
 	
-#ifdef LOG_PROC_TIMESTAMP
-	te = esp_timer_get_time();
-	ESP_LOGI(TAG, "process_image took %d uSec", (int) (te - tb));
+#if RSP_RATE_CONTROL
+	return rate_ctrl_admit(&rsp_rate, dequeue_usec);
+#else
+	return true;
 #endif
+}
+
 
-	return LEP_NUM_PIXELS*2;
+/**
+ * Feed the outcome of a send to rate control.  A send that blocks stands in for
+ * send buffer occupancy, which lwIP does not report, and frames the ring or the age
+ * limit dropped since the last send count as congestion.
+ */
+static void update_rate(lep_buffer_t* bufP, bool sent, int64_t send_usec)
+{
+#if RSP_RATE_CONTROL
+	frame_ring_stats_t ring_stats;
+	int64_t now = esp_timer_get_time();
+	uint32_t drops;
+	
+	frame_ring_get_stats(&send_frame_sub.ring, &ring_stats);
+	drops = ring_stats.overruns + rsp_stats.stale - rsp_rate_drops;
+	rsp_rate_drops += drops;
+	
+	if (rate_ctrl_update(&rsp_rate, now, sent, (send_usec == 0) ? 0 : (uint32_t) (now - send_usec),
+	                     (uint32_t) (now - bufP->publish_usec), drops)) {
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+		frame_delta_set_threshold(&rsp_delta, RSP_DELTA_THRESHOLD + rate_ctrl_level(&rsp_rate) * RSP_RATE_LEVEL_THRESHOLD);
+#endif
+	}
+#endif
+}
+
+
+#if RSP_STREAM_ENCODING != RSP_ENC_RAW16
+/**
+ * Encode a frame's pixels into the encode buffer and set the header's encoding and
+ * payload length.  Returns the payload, which is the raw frame if the encoded image
+ * would be no smaller.
+ */
+static const void* encode_frame(lep_buffer_t* bufP, rsp_frame_hdr_t* hdrP)
+{
+	int64_t t0 = esp_timer_get_time();
+	uint32_t t;
+	int len;
+	
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+	len = frame_delta_encode(&rsp_delta, bufP->lep_bufferP, bufP->frame_seq, rsp_encP, RSP_ENC_BUF_BYTES);
+#else
+	len = frame_codec_encode(bufP->lep_bufferP, LEP_WIDTH, LEP_HEIGHT, LEP_WIDTH, rsp_encP, RSP_ENC_BUF_BYTES);
+#endif
+	
+	t = (uint32_t) (esp_timer_get_time() - t0);
+	rsp_stats.encode_usec_sum += t;
+	if (t > rsp_stats.encode_usec_max) rsp_stats.encode_usec_max = t;
+	
+	if (len == 0) {
+		rsp_stats.encode_fallbacks++;
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+		frame_delta_reset(&rsp_delta);
+#endif
+		hdrP->encoding = RSP_ENC_RAW16;
+		hdrP->payload_len = LEP_NUM_PIXELS*2;
+		return bufP->lep_bufferP;
+	}
+	
+	rsp_stats.encoded++;
+	hdrP->encoding = RSP_STREAM_ENCODING;
+	hdrP->payload_len = len;
+	return rsp_encP;
 }
+#endif
+
+
+#ifdef UDP_STREAMING
+/**
+ * Send a frame as a fragment holding the header and telemetry followed by fragments of
+ * RSP_UDP_ROWS_PER_FRAG rows worth of payload.  A fragment lwIP cannot take is not
+ * retried; the rest of the frame is dropped so that the next frame is not delayed.
+ * Returns true if every fragment was sent.
+ */
+static bool send_frame_udp(rsp_frame_hdr_t* hdrP, const uint16_t* telemP, const void* payloadP)
+{
+	const uint8_t* p = (const uint8_t*) payloadP;
+	const int frag_bytes = RSP_UDP_ROWS_PER_FRAG * LEP_WIDTH * 2;
+	rsp_udp_hdr_t udp_hdr;
+	uint32_t offset;
+	int len;
+	
+	udp_hdr.frame_seq = hdrP->frame_seq;
+	udp_hdr.frag_index = 0;
+	udp_hdr.frag_count = 1 + (hdrP->payload_len + frag_bytes - 1) / frag_bytes;
+	udp_hdr.payload_offset = 0;
+	
+	hdrP->send_usec = esp_timer_get_time();
+	if (!stream_datagram(&udp_hdr, hdrP, sizeof(rsp_frame_hdr_t), telemP, hdrP->telem_words*2)) {
+		return false;
+	}
+	
+	for (offset = 0; offset < hdrP->payload_len; offset += frag_bytes) {
+		udp_hdr.frag_index++;
+		udp_hdr.payload_offset = offset;
+		len = ((offset + frag_bytes) > hdrP->payload_len) ? hdrP->payload_len - offset : frag_bytes;
+		if (!stream_datagram(&udp_hdr, &p[offset], len, NULL, 0)) {
+			return false;
+		}
+	}
+	
+	return true;
+}
+#else
+/**
+ * Start writing a frame's header, telemetry and payload back to back on the stream
+ * connection.  The frame is referenced until stream_tx_service() has written all of
+ * it or given up on it.
+ */
+static void stream_tx_start(lep_buffer_t* bufP, const rsp_frame_hdr_t* hdrP, const uint16_t* telemP, const void* payloadP)
+{
+	frame_sub_ref(&send_frame_sub, bufP);
+	stream_tx.bufP = bufP;
+	stream_tx.hdr = *hdrP;
+	stream_tx.hdr.send_usec = esp_timer_get_time();
+	stream_tx.deadline_usec = stream_tx.hdr.send_usec + RSP_SEND_TIMEOUT_MSEC * 1000LL;
+	
+	stream_tx.iov[0].iov_base = &stream_tx.hdr;
+	stream_tx.iov[0].iov_len = sizeof(rsp_frame_hdr_t);
+	stream_tx.iov_cnt = 1;
+	if (telemP != NULL) {
+		stream_tx.iov[stream_tx.iov_cnt].iov_base = (void*) telemP;
+		stream_tx.iov[stream_tx.iov_cnt++].iov_len = hdrP->telem_words*2;
+	}
+	stream_tx.iov[stream_tx.iov_cnt].iov_base = (void*) payloadP;
+	stream_tx.iov[stream_tx.iov_cnt++].iov_len = hdrP->payload_len;
+	stream_tx.iov_idx = 0;
+	
+	// Usually the socket takes it all right away
+	stream_tx_service(0);
+}
+#endif
+
 
 /**
- * Send a response
+ * True while a frame is in flight on the stream connection
  */
-static void send_response(uint16_t* rsp, int rsp_length)
+static bool stream_tx_busy()
+{
+	return (stream_tx.bufP != NULL);
+}
+
+
+/**
+ * Write as much of the frame in flight as the socket takes, waiting up to wait_msec
+ * for it to drain.  The connection is dropped if the frame is not all written by its
+ * deadline.
+ */
+static void stream_tx_service(uint32_t wait_msec)
+{
+	struct msghdr msg;
+	int64_t until;
+	bool waited = false;
+	int n;
+	
+	while (stream_tx.bufP != NULL) {
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &stream_tx.iov[stream_tx.iov_idx];
+		msg.msg_iovlen = stream_tx.iov_cnt - stream_tx.iov_idx;
+		
+		n = sendmsg(sockfd, &msg, 0);
+		if (n < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				ESP_LOGE(TAG, "Stream send failed: %s", strerror(errno));
+				stream_lost();
+				return;
+			}
+			if (esp_timer_get_time() >= stream_tx.deadline_usec) {
+				ESP_LOGE(TAG, "Stream send timed out");
+				rsp_stats.send_timeouts++;
+				stream_lost();
+				return;
+			}
+			if (waited || (wait_msec == 0)) {
+				// Still in flight
+				return;
+			}
+			until = esp_timer_get_time() + wait_msec * 1000LL;
+			(void) socket_wait_writable((until < stream_tx.deadline_usec) ? until : stream_tx.deadline_usec);
+			waited = true;
+			continue;
+		}
+		
+		// Skip what was written
+		while ((n > 0) && (stream_tx.iov_idx < stream_tx.iov_cnt)) {
+			if ((size_t) n >= stream_tx.iov[stream_tx.iov_idx].iov_len) {
+				n -= stream_tx.iov[stream_tx.iov_idx++].iov_len;
+			} else {
+				stream_tx.iov[stream_tx.iov_idx].iov_base = (uint8_t*) stream_tx.iov[stream_tx.iov_idx].iov_base + n;
+				stream_tx.iov[stream_tx.iov_idx].iov_len -= n;
+				n = 0;
+			}
+		}
+		if (stream_tx.iov_idx < stream_tx.iov_cnt) {
+			rsp_stats.partial_writes++;
+		} else {
+			stream_tx_finish(true);
+		}
+	}
+}
+
+
+/**
+ * Retire the frame in flight
+ */
+static void stream_tx_finish(bool sent)
+{
+	lep_buffer_t* bufP = stream_tx.bufP;
+	
+	stream_tx.bufP = NULL;
+	frame_sent(bufP, &stream_tx.hdr, sent);
+	frame_sub_release(&send_frame_sub, bufP);
+}
+
+
+#ifdef SEGMENT_STREAMING
+/**
+ * Send one segment with its header.  The segment is copied out of the acquisition
+ * frame first, since a slow write could outlast the pixels; one that waited in the
+ * queue for a frame period may already have been overwritten and is dropped.
+ */
+static void send_segment(lep_segment_t* segP)
+{
+	rsp_segment_hdr_t hdr;
+	
+	if ((esp_timer_get_time() - segP->acq_usec) >= LEP_FRAME_PERIOD_USEC) {
+		rsp_stats.stale++;
+		return;
+	}
+	memcpy(rsp_segP, segP->pixelsP, segP->num_pixels*2);
+	
+	hdr.frame_seq = segP->frame_seq;
+	hdr.first_pixel = segP->first_pixel;
+	hdr.num_pixels = segP->num_pixels;
+	hdr.segment = segP->segment;
+	
+	if (send_response(&hdr, sizeof(hdr), rsp_segP, segP->num_pixels*2)) {
+		update_wire_latency(segP->acq_usec);
+	}
+}
+#endif
+
+
+/**
+ * Send a response, optionally preceded by a header, on the stream connection.
+ * Returns true if it was sent.
+ */
+static bool send_response(const void* hdr, int hdr_len, uint16_t* rsp, int rsp_length)
 {
 #ifdef LOG_SEND_TIMESTAMP
 	int64_t tb, te;
@@ -155,41 +752,335 @@ static void send_response(uint16_t* rsp, int rsp_length)
 	tb = esp_timer_get_time();
 #endif
 	
-  socket_connect(TCP_FLAG);
+	if (!stream_connect()) {
+		rsp_stats.unsent++;
+		return false;
+	}
+	
+	if ((hdr != NULL) && !stream_write(hdr, hdr_len)) {
+		return false;
+	}
+	if (!stream_write(rsp, rsp_length)) {
+		return false;
+	}
+	
+#ifdef LOG_SEND_TIMESTAMP
+	te = esp_timer_get_time();
+	ESP_LOGI(TAG, "send_response took %d uSec", (int) (te - tb));
+#endif
+	
+	return true;
+}
 
-  int err_code;
-  int err_code_size = sizeof(err_code);
-  getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err_code, (socklen_t *)&err_code_size);
 
-  if (err_code) {
-    close(sockfd);
-    return;
-  }
+/**
+ * Make sure the stream connection is up, starting a connection if the backoff interval
+ * has passed.  Connecting does not block; until the connection completes (or times
+ * out) this returns false.
+ */
+static bool stream_connect()
+{
+	bool pending;
+	
+	if (stream_state == STREAM_UP) {
+		return true;
+	}
+	if (stream_state == STREAM_CONNECTING) {
+		return stream_connect_poll(0);
+	}
+	
+	if (esp_timer_get_time() < next_connect_usec) {
+		// Still backing off
+		return false;
+	}
+	
+	if (socket_connect(STREAM_PROTOCOL, &pending) != 0) {
+		stream_connect_failed();
+		return false;
+	}
+	stream_state = STREAM_CONNECTING;
+	connect_deadline_usec = esp_timer_get_time() + RSP_CONNECT_TIMEOUT_MSEC * 1000LL;
+	
+	return pending ? stream_connect_poll(RSP_IO_POLL_MSEC) : stream_connected();
+}
 
-  if (http_get(rsp_length)) {
-    return;
-  }
 
-  if (send(sockfd, rsp, (size_t)rsp_length, 0) < 0) {
-    ESP_LOGE(TAG, "Error connect: %s", strerror(errno));
-    return;
-  }
+/**
+ * Check on a connection in progress, waiting up to wait_msec for it.  Returns true
+ * once it is up.
+ */
+static bool stream_connect_poll(uint32_t wait_msec)
+{
+	int64_t until = esp_timer_get_time() + wait_msec * 1000LL;
+	int err = 0;
+	socklen_t len = sizeof(err);
+	
+	if (!socket_wait_writable((until < connect_deadline_usec) ? until : connect_deadline_usec)) {
+		if (esp_timer_get_time() >= connect_deadline_usec) {
+			ESP_LOGE(TAG, "Stream connection timed out");
+			rsp_stats.connect_timeouts++;
+			stream_connect_failed();
+		}
+		return false;
+	}
+	
+	if ((getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &err, &len) != 0) || (err != 0)) {
+		ESP_LOGE(TAG, "Cannot establish the connection: %s", strerror(err));
+		stream_connect_failed();
+		return false;
+	}
+	
+	return stream_connected();
+}
+
 
-  close(sockfd);
+/**
+ * Finish bringing up a new connection
+ */
+static bool stream_connected()
+{
+	stream_state = STREAM_UP;
+	if (rsp_stats.connects++ != 0) {
+		rsp_stats.reconnects++;
+	}
+	reconnect_msec = RSP_RECONNECT_MIN_MSEC;
+#ifndef UDP_STREAMING
+	// Tell the server about the new TCP session without waiting for it
+	xTaskNotifyGive(task_handle_announce);
+#endif
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+	// A new receiver has no reference yet
+	frame_delta_reset(&rsp_delta);
+#endif
+	return true;
+}
 
-  ESP_LOGE(TAG, "Image sent to server");
 
+/**
+ * Give up on a connection attempt and back off before the next one
+ */
+static void stream_connect_failed()
+{
+	stream_close();
+	rsp_stats.connect_failures++;
+	next_connect_usec = esp_timer_get_time() + reconnect_msec * 1000LL;
+	reconnect_msec = (reconnect_msec >= (RSP_RECONNECT_MAX_MSEC / 2)) ? RSP_RECONNECT_MAX_MSEC : reconnect_msec * 2;
+}
+
+
+/**
+ * Drop an established connection after a send error or timeout (the next send
+ * reconnects)
+ */
+static void stream_lost()
+{
+	stream_close();
+	rsp_stats.disconnects++;
+	next_connect_usec = esp_timer_get_time() + reconnect_msec * 1000LL;
+}
+
+
+/**
+ * Drop the stream connection and any frame in flight on it
+ */
+static void stream_close()
+{
+	if (sockfd >= 0) {
+		close(sockfd);
+		sockfd = -1;
+	}
+	stream_state = STREAM_DOWN;
+	
+	if (stream_tx_busy()) {
+		stream_tx_finish(false);
+	}
+}
+
+
+/**
+ * Write all of a buffer to the stream connection, waiting for the socket to drain for
+ * up to RSP_SEND_TIMEOUT_MSEC and dropping the connection on error or timeout.  For
+ * data that cannot be held (segments); frames go through stream_tx.  Returns true if
+ * it was all written.
+ */
+static bool stream_write(const void* data, int len)
+{
+	const uint8_t* p = (const uint8_t*) data;
+	int64_t deadline = esp_timer_get_time() + RSP_SEND_TIMEOUT_MSEC * 1000LL;
+	int n;
+	
+	while (len > 0) {
+		n = send(sockfd, p, (size_t) len, 0);
+		if (n < 0) {
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+				ESP_LOGE(TAG, "Stream send failed: %s", strerror(errno));
+				stream_lost();
+				return false;
+			}
+			if (!socket_wait_writable(deadline)) {
+				ESP_LOGE(TAG, "Stream send timed out");
+				rsp_stats.send_timeouts++;
+				stream_lost();
+				return false;
+			}
+			continue;
+		}
+		if (n < len) {
+			rsp_stats.partial_writes++;
+		}
+		p += n;
+		len -= n;
+	}
+	
+	return true;
+}
+
+
+/**
+ * Wait until the stream socket can take more data (or a connection in progress
+ * completes) or until_usec passes.  Returns true if it is writable.
+ */
+static bool socket_wait_writable(int64_t until_usec)
+{
+	int64_t wait_usec = until_usec - esp_timer_get_time();
+	struct timeval tv;
+	fd_set wfds;
+	
+	if (wait_usec < 0) wait_usec = 0;
+	tv.tv_sec = wait_usec / 1000000;
+	tv.tv_usec = wait_usec % 1000000;
+	FD_ZERO(&wfds);
+	FD_SET(sockfd, &wfds);
+	
+	return (select(sockfd + 1, NULL, &wfds, NULL, &tv) > 0);
+}
+
+
+#ifdef UDP_STREAMING
+/**
+ * Send one datagram made of a fragment header and up to two pieces of payload.  Errors
+ * are counted but do not drop the connection since UDP has none to lose.
+ */
+static bool stream_datagram(const rsp_udp_hdr_t* hdrP, const void* data1, int len1, const void* data2, int len2)
+{
+	struct iovec iov[3];
+	struct msghdr msg;
+	
+	iov[0].iov_base = (void*) hdrP;
+	iov[0].iov_len = sizeof(rsp_udp_hdr_t);
+	iov[1].iov_base = (void*) data1;
+	iov[1].iov_len = len1;
+	iov[2].iov_base = (void*) data2;
+	iov[2].iov_len = len2;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = (len2 > 0) ? 3 : 2;
+	
+	if (sendmsg(sockfd, &msg, 0) < 0) {
+		rsp_stats.datagram_errors++;
+		return false;
+	}
+	rsp_stats.datagrams++;
+	return true;
+}
+#endif
+
+
+/**
+ * Track the time from lepton_task publishing a frame to send_task picking it up
+ */
+static void update_dequeue_latency(int64_t publish_usec, int64_t dequeue_usec)
+{
+	uint32_t lat = (uint32_t) (dequeue_usec - publish_usec);
+	
+	rsp_stats.dequeue_count++;
+	rsp_stats.dequeue_usec_last = lat;
+	rsp_stats.dequeue_usec_sum += lat;
+	if (lat > rsp_stats.dequeue_usec_max) rsp_stats.dequeue_usec_max = lat;
+}
+
+
+/**
+ * Track the time from acquisition (frame or segment complete) to the data being
+ * handed to the network stack
+ */
+static void update_wire_latency(int64_t acq_usec)
+{
+	uint32_t lat = (uint32_t) (esp_timer_get_time() - acq_usec);
+	
+	rsp_stats.wire_count++;
+	rsp_stats.wire_usec_last = lat;
+	rsp_stats.wire_usec_sum += lat;
+	if (lat > rsp_stats.wire_usec_max) rsp_stats.wire_usec_max = lat;
+	
 #ifdef LOG_SEND_TIMESTAMP
-	te = esp_timer_get_time();
-	ESP_LOGI(TAG, "send_response took %d uSec", (int) (te - tb));
+	ESP_LOGI(TAG, "capture to wire %u uSec (avg %u, max %u)", lat,
+	         (uint32_t) (rsp_stats.wire_usec_sum / rsp_stats.wire_count), rsp_stats.wire_usec_max);
 #endif
 }
 
+
+#ifdef LOG_SEND_STATS
+static void log_stats()
+{
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+	frame_delta_stats_t delta_stats;
+#endif
+#if RSP_RATE_CONTROL
+	rate_ctrl_stats_t rate_stats;
+#endif
+	
+	ESP_LOGI(TAG, "dequeued %u, publish to dequeue avg %u max %u uSec",
+	         rsp_stats.dequeue_count,
+	         (rsp_stats.dequeue_count == 0) ? 0 : (uint32_t) (rsp_stats.dequeue_usec_sum / rsp_stats.dequeue_count),
+	         rsp_stats.dequeue_usec_max);
+	ESP_LOGI(TAG, "sent %u, capture to wire avg %u max %u uSec",
+	         rsp_stats.wire_count,
+	         (rsp_stats.wire_count == 0) ? 0 : (uint32_t) (rsp_stats.wire_usec_sum / rsp_stats.wire_count),
+	         rsp_stats.wire_usec_max);
+	ESP_LOGI(TAG, "connects %u (failed %u, announce failed %u), disconnects %u, unsent %u, stale %u",
+	         rsp_stats.connects, rsp_stats.connect_failures, rsp_stats.announce_failures, rsp_stats.disconnects,
+	         rsp_stats.unsent, rsp_stats.stale);
+	ESP_LOGI(TAG, "partial writes %u, send timeouts %u, connect timeouts %u, reconnects %u",
+	         rsp_stats.partial_writes, rsp_stats.send_timeouts, rsp_stats.connect_timeouts, rsp_stats.reconnects);
+#if RSP_RATE_CONTROL
+	rate_ctrl_get_stats(&rsp_rate, &rate_stats);
+	ESP_LOGI(TAG, "rate interval %u mSec, level %d, admitted %u, skipped %u, cuts %u, probes %u, send avg %u uSec, latency avg %u uSec",
+	         rate_stats.interval_usec / 1000, rate_stats.level, rate_stats.admitted, rate_stats.skipped,
+	         rate_stats.congestion_events, rate_stats.probes, rate_stats.send_usec_avg, rate_stats.latency_usec_avg);
+#endif
+#ifdef UDP_STREAMING
+	ESP_LOGI(TAG, "datagrams %u, errors %u", rsp_stats.datagrams, rsp_stats.datagram_errors);
+#endif
+#if RSP_STREAM_ENCODING != RSP_ENC_RAW16
+	ESP_LOGI(TAG, "encoded %u (raw fallbacks %u), encode avg %u max %u uSec, avg payload %u bytes",
+	         rsp_stats.encoded, rsp_stats.encode_fallbacks,
+	         ((rsp_stats.encoded + rsp_stats.encode_fallbacks) == 0) ? 0 :
+	         (uint32_t) (rsp_stats.encode_usec_sum / (rsp_stats.encoded + rsp_stats.encode_fallbacks)),
+	         rsp_stats.encode_usec_max,
+	         (rsp_stats.wire_count == 0) ? 0 : (uint32_t) (rsp_stats.payload_bytes / rsp_stats.wire_count));
+#endif
+#if RSP_STREAM_ENCODING == RSP_ENC_TILE_DELTA
+	frame_delta_get_stats(&rsp_delta, &delta_stats);
+	ESP_LOGI(TAG, "delta frames %u (keyframes %u), tile hit rate %u%%, bytes last %u avg %u max %u",
+	         delta_stats.frames, delta_stats.keyframes,
+	         (delta_stats.tiles == 0) ? 0 : (uint32_t) (100 * (delta_stats.tiles - delta_stats.tiles_sent) / delta_stats.tiles),
+	         delta_stats.bytes_last,
+	         (delta_stats.frames == 0) ? 0 : (uint32_t) (delta_stats.bytes_sum / delta_stats.frames),
+	         delta_stats.bytes_max);
+#endif
+}
+#endif
+
+
 /**
- * Connect to webserver through socket
+ * Start connecting to webserver through a non-blocking socket.  *pendingP is set if
+ * the connection is still in progress.
  */
-int socket_connect(t_protocol prot)
+int socket_connect(t_protocol prot, bool* pendingP)
 {
+  int one = 1;
+
   // initializes address
   struct sockaddr_in addr;
   memset(&addr, 0, sizeof(addr));
@@ -206,6 +1097,9 @@ int socket_connect(t_protocol prot)
       ESP_LOGE(TAG, "Creating of socket failed: %s", strerror(errno));
       return 1;
     }
+
+    // Frames go out back to back so don't hold the tail of one for Nagle
+    setsockopt(sockfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
   } else if (prot == UDP_FLAG) {
     // open UDP socket
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
@@ -214,14 +1108,20 @@ int socket_connect(t_protocol prot)
     }
   }
 
+  // Never let a dead peer block send_task; writes and the connect itself are
+  // bounded by select() timeouts instead
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
   // connect to server
+  *pendingP = false;
   if ((connect(sockfd, (struct sockaddr *)&addr, sizeof(struct sockaddr_in))) != 0) {
-    ESP_LOGE(TAG, "Cannot establish the connection");
-    return 1;
+    if (errno != EINPROGRESS) {
+      ESP_LOGE(TAG, "Cannot establish the connection: %s", strerror(errno));
+      return 1;
+    }
+    *pendingP = true;
   }
 
-  ESP_LOGE(TAG, "Successfully connected to server");
-
   return 0;
 }
 
@@ -259,7 +1159,7 @@ esp_err_t _http_event_handle(esp_http_client_event_t *evt)
 }
 
 /**
- * Send HTTP GET query
+ * Send HTTP GET query (announces a new stream connection to the server)
  */
 int http_get()
 {
@@ -270,6 +1170,7 @@ int http_get()
         .port = HTTP_PORT,
         .path = "/",
         .query = "camera=flir",
+        .timeout_ms = RSP_HTTP_TIMEOUT_MSEC,
         .event_handler = _http_event_handle,
         // .user_data = local_response_buffer,
     };
@@ -0,0 +1,432 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Host benchmark for the frame codec and the temporal tile delta encoding.
+ *
+ * Encodes and decodes a set of synthetic thermal scenes (or frames recorded with
+ * rsp_decode -o), first each frame on its own with the lossless codec and then the
+ * sequence as tile deltas, and reports the compression ratio, bytes per frame, tile
+ * hit rate (tiles not sent) and the encode/decode time per frame.  Every frame is
+ * checked to decode back to the original pixels (to within the delta threshold).
+ *
+ * The synthetic scenes model a radiometric Lepton in TLinear mode (0.01 K per count)
+ * with about 50 mK of temporal noise:
+ *   indoor   room background with a gentle gradient and two people
+ *   outdoor  cold sky, buildings with hard edges and a warm vehicle
+ *   flat     a uniform target, i.e. sensor noise only
+ *   sim      the pattern served by the VoSPI simulator in tools/vospi_sim
+ *   static   switchgear with a hot breaker, nothing moving
+ *
+ * Usage: codec_bench [-n frames] [-w width -h height] [-t threshold] [-k keyframe_frames] [-v] [-f recorded.raw]
+ *   recorded.raw is a sequence of width x height little-endian 16-bit frames
+ *   -v lists the size and tiles sent of every delta frame
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "frame_codec.h"
+#include "frame_delta.h"
+
+
+//
+// Benchmark constants
+//
+#define NUM_SCENE_FRAMES 64
+
+// Kelvin * 100 of a few things in the scenes
+#define K_ROOM   29515
+#define K_PERSON 30580
+#define K_SKY    26000
+#define K_WALL   28900
+#define K_ENGINE 32000
+#define K_CABINET 29800
+#define K_BREAKER 33500
+#define NOISE_CNT 5
+
+
+//
+// Benchmark Data structures
+//
+typedef void (*scene_fn_t)(uint16_t* frameP, int w, int h, int f);
+
+typedef struct {
+	const char* name;
+	scene_fn_t fn;
+} scene_t;
+
+
+//
+// Benchmark variables
+//
+static uint32_t rng_state = 0x12345678;
+
+
+//
+// Benchmark Forward Declarations for internal functions
+//
+static bool run_scene(const char* name, uint16_t* frames, int nframes, int w, int h, int iters);
+static bool run_delta(const char* name, uint16_t* frames, int nframes, int w, int h);
+static void scene_indoor(uint16_t* frameP, int w, int h, int f);
+static void scene_outdoor(uint16_t* frameP, int w, int h, int f);
+static void scene_flat(uint16_t* frameP, int w, int h, int f);
+static void scene_sim(uint16_t* frameP, int w, int h, int f);
+static void scene_static(uint16_t* frameP, int w, int h, int f);
+static int noise();
+static int blob(int x, int y, int cx, int cy, int rx, int ry, int dk);
+static uint16_t clamp16(int v);
+static int64_t wall_nsec();
+
+
+static const scene_t scenes[] = {
+	{"indoor", scene_indoor},
+	{"outdoor", scene_outdoor},
+	{"flat", scene_flat},
+	{"sim", scene_sim},
+	{"static", scene_static}
+};
+#define NUM_SCENES ((int) (sizeof(scenes) / sizeof(scenes[0])))
+
+// Delta settings
+static uint16_t threshold = 0;
+static int keyframe_frames = 30;
+static bool verbose = false;
+
+
+int main(int argc, char** argv)
+{
+	const char* path = NULL;
+	const char* names[NUM_SCENES];
+	uint16_t* frames[NUM_SCENES];
+	int nframes[NUM_SCENES];
+	int nscenes;
+	int w = 160;
+	int h = 120;
+	int iters = 50;
+	int s, f, opt;
+	bool ok = true;
+	FILE* fp;
+	long flen;
+
+	while ((opt = getopt(argc, argv, "n:w:h:t:k:vf:")) != -1) {
+		switch (opt) {
+			case 'n': iters = atoi(optarg); break;
+			case 'w': w = atoi(optarg); break;
+			case 'h': h = atoi(optarg); break;
+			case 't': threshold = atoi(optarg); break;
+			case 'k': keyframe_frames = atoi(optarg); break;
+			case 'v': verbose = true; break;
+			case 'f': path = optarg; break;
+			default:
+				fprintf(stderr, "Usage: %s [-n frames] [-w width -h height] [-t threshold] [-k keyframe_frames] [-v] [-f recorded.raw]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	if (path != NULL) {
+		if ((fp = fopen(path, "rb")) == NULL) {
+			perror(path);
+			return 1;
+		}
+		fseek(fp, 0, SEEK_END);
+		flen = ftell(fp);
+		rewind(fp);
+		nframes[0] = flen / (w * h * 2);
+		if (nframes[0] == 0) {
+			fprintf(stderr, "%s holds no %dx%d frames\n", path, w, h);
+			return 1;
+		}
+		frames[0] = malloc((size_t) nframes[0] * w * h * 2);
+		if (fread(frames[0], w * h * 2, nframes[0], fp) != (size_t) nframes[0]) {
+			perror(path);
+			return 1;
+		}
+		fclose(fp);
+		names[0] = path;
+		nscenes = 1;
+	} else {
+		for (s = 0; s < NUM_SCENES; s++) {
+			frames[s] = malloc((size_t) NUM_SCENE_FRAMES * w * h * 2);
+			for (f = 0; f < NUM_SCENE_FRAMES; f++) {
+				scenes[s].fn(&frames[s][f * w * h], w, h, f);
+			}
+			nframes[s] = NUM_SCENE_FRAMES;
+			names[s] = scenes[s].name;
+		}
+		nscenes = NUM_SCENES;
+	}
+
+	printf("Lossless codec, every frame on its own\n");
+	printf("%-10s %7s %7s %8s %12s %12s\n", "scene", "frames", "ratio", "bits/px", "enc usec/fr", "dec usec/fr");
+	for (s = 0; s < nscenes; s++) {
+		ok &= run_scene(names[s], frames[s], nframes[s], w, h, (iters + nframes[s] - 1) / nframes[s]);
+	}
+
+	printf("\nTile delta, threshold %u, keyframe every %d frames\n", threshold, keyframe_frames);
+	printf("%-10s %7s %7s %10s %10s %6s %5s %12s\n", "scene", "frames", "ratio", "bytes/fr", "max bytes",
+	       "hit %", "keys", "enc usec/fr");
+	for (s = 0; s < nscenes; s++) {
+		ok &= run_delta(names[s], frames[s], nframes[s], w, h);
+		free(frames[s]);
+	}
+
+	return ok ? 0 : 2;
+}
+
+
+//
+// Benchmark internal functions
+//
+
+/**
+ * Encode and decode each frame iters times and print one result line
+ */
+static bool run_scene(const char* name, uint16_t* frames, int nframes, int w, int h, int iters)
+{
+	int cap = FRAME_CODEC_MAX_BYTES(w, h);
+	uint8_t* enc = malloc(cap);
+	uint16_t* dec = malloc(w * h * 2);
+	int64_t enc_nsec = 0;
+	int64_t dec_nsec = 0;
+	int64_t t0;
+	uint64_t bytes = 0;
+	int f, i, len = 0;
+	bool ok = true;
+
+	for (f = 0; f < nframes; f++) {
+		uint16_t* frameP = &frames[f * w * h];
+
+		t0 = wall_nsec();
+		for (i = 0; i < iters; i++) {
+			len = frame_codec_encode(frameP, w, h, w, enc, cap);
+		}
+		enc_nsec += wall_nsec() - t0;
+		bytes += len;
+
+		t0 = wall_nsec();
+		for (i = 0; i < iters; i++) {
+			ok &= frame_codec_decode(enc, len, w, h, w, dec);
+		}
+		dec_nsec += wall_nsec() - t0;
+
+		if ((len == 0) || (memcmp(dec, frameP, w * h * 2) != 0)) {
+			fprintf(stderr, "%s frame %d does not round trip\n", name, f);
+			ok = false;
+		}
+	}
+
+	printf("%-10s %7d %7.2f %8.2f %12.0f %12.0f\n", name, nframes,
+	       (double) nframes * w * h * 2 / bytes, (double) bytes * 8 / ((double) nframes * w * h),
+	       (double) enc_nsec / 1000 / (nframes * iters), (double) dec_nsec / 1000 / (nframes * iters));
+
+	free(enc);
+	free(dec);
+	return ok;
+}
+
+
+/**
+ * Encode the sequence as tile deltas, decode it on a second delta stream and print
+ * one result line
+ */
+static bool run_delta(const char* name, uint16_t* frames, int nframes, int w, int h)
+{
+	frame_delta_t enc_delta, dec_delta;
+	frame_delta_stats_t st;
+	rsp_delta_hdr_t hdr;
+	int cap = FRAME_DELTA_MAX_BYTES(w, h);
+	uint8_t* enc = malloc(cap);
+	uint16_t* enc_ref = malloc(w * h * 2);
+	uint16_t* dec_ref = malloc(w * h * 2);
+	int64_t enc_nsec = 0;
+	int64_t t0;
+	int f, i, d, len, err;
+	bool ok = true;
+
+	frame_delta_init(&enc_delta, w, h, enc_ref, threshold, keyframe_frames);
+	frame_delta_init(&dec_delta, w, h, dec_ref, threshold, keyframe_frames);
+
+	for (f = 0; f < nframes; f++) {
+		uint16_t* frameP = &frames[f * w * h];
+
+		t0 = wall_nsec();
+		len = frame_delta_encode(&enc_delta, frameP, f, enc, cap);
+		enc_nsec += wall_nsec() - t0;
+
+		if ((len == 0) || !frame_delta_decode(&dec_delta, enc, len, f)) {
+			fprintf(stderr, "%s frame %d does not decode\n", name, f);
+			ok = false;
+			continue;
+		}
+		for (i = 0, err = 0; i < w * h; i++) {
+			d = abs(dec_ref[i] - frameP[i]);
+			if (d > err) err = d;
+		}
+		if (err > threshold) {
+			fprintf(stderr, "%s frame %d is off by %d\n", name, f, err);
+			ok = false;
+		}
+		if (verbose) {
+			memcpy(&hdr, enc, sizeof(hdr));
+			printf("  frame %3d: %6d bytes, %3u of %u tiles%s\n", f, len, hdr.tiles_sent, hdr.tiles,
+			       (hdr.flags & RSP_DELTA_KEYFRAME) ? " (keyframe)" : "");
+		}
+	}
+
+	frame_delta_get_stats(&enc_delta, &st);
+	printf("%-10s %7d %7.2f %10.0f %10u %6.1f %5u %12.0f\n", name, nframes,
+	       (double) nframes * w * h * 2 / st.bytes_sum, (double) st.bytes_sum / st.frames, st.bytes_max,
+	       100.0 * (st.tiles - st.tiles_sent) / st.tiles, st.keyframes, (double) enc_nsec / 1000 / nframes);
+
+	free(enc);
+	free(enc_ref);
+	free(dec_ref);
+	return ok;
+}
+
+
+static void scene_indoor(uint16_t* frameP, int w, int h, int f)
+{
+	int x, y, v;
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			// Wall warmer near the ceiling, floor a little colder
+			v = K_ROOM + (h/2 - y) * 60 / h + x * 20 / w;
+			v += blob(x, y, w/4 + f, h*2/3, w/12, h/3, K_PERSON - K_ROOM);
+			v += blob(x, y, w*3/4 - f/2, h/2, w/10, h/4, K_PERSON - 120 - K_ROOM);
+			frameP[y*w + x] = clamp16(v + noise());
+		}
+	}
+}
+
+
+static void scene_outdoor(uint16_t* frameP, int w, int h, int f)
+{
+	int x, y, v, roof;
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			roof = h/3 + ((x / (w/5)) % 2) * h/8;
+			if (y < roof) {
+				// Sky gets colder towards the zenith
+				v = K_SKY - (roof - y) * 40;
+			} else {
+				// Sunlit and shaded walls with windows
+				v = K_WALL + (((x / (w/5)) % 2) ? 350 : 0);
+				if (((x % (w/10)) > w/40) && ((y % (h/8)) > h/32)) v -= 180;
+			}
+			v += blob(x, y, (f * 3) % w, h*5/6, w/8, h/12, K_ENGINE - K_WALL);
+			frameP[y*w + x] = clamp16(v + noise());
+		}
+	}
+}
+
+
+static void scene_flat(uint16_t* frameP, int w, int h, int f)
+{
+	int i;
+
+	for (i = 0; i < w*h; i++) frameP[i] = clamp16(K_ROOM + noise());
+}
+
+
+/**
+ * Same pattern as sim_pixel() in tools/vospi_sim (sized for any geometry)
+ */
+static void scene_sim(uint16_t* frameP, int w, int h, int f)
+{
+	int x, y, v, cx, d2;
+	uint32_t hh;
+
+	cx = (f * 3) % w;
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			d2 = (x - cx) * (x - cx) + (y - h/2) * (y - h/2);
+			hh = (f * 2654435761u) ^ (y * 40503u) ^ (x * 2246822519u);
+			v = 29315 + y * 4 + x * 2;
+			if (d2 < 100) v += 1500 - d2 * 10;
+			v += (hh >> 13) & 0x0F;
+			frameP[y*w + x] = (uint16_t) v;
+		}
+	}
+}
+
+
+static void scene_static(uint16_t* frameP, int w, int h, int f)
+{
+	int x, y, v;
+
+	for (y = 0; y < h; y++) {
+		for (x = 0; x < w; x++) {
+			// Cabinet face with three breaker columns, one of them running hot
+			v = K_CABINET + y * 30 / h;
+			if (((x % (w/3)) > w/12) && ((x % (w/3)) < w/4) && (y > h/6) && (y < h*5/6)) v += 150;
+			v += blob(x, y, w/2, h/2, w/16, h/8, K_BREAKER - K_CABINET);
+			frameP[y*w + x] = clamp16(v + noise());
+		}
+	}
+}
+
+
+/**
+ * Roughly gaussian noise with a standard deviation of NOISE_CNT counts
+ */
+static int noise()
+{
+	int i, s = 0;
+
+	for (i = 0; i < 4; i++) {
+		rng_state ^= rng_state << 13;
+		rng_state ^= rng_state >> 17;
+		rng_state ^= rng_state << 5;
+		s += (int) (rng_state % 1000) - 500;
+	}
+	return s * NOISE_CNT / 577;
+}
+
+
+/**
+ * Temperature offset dk inside an elliptical object fading out over its last quarter
+ */
+static int blob(int x, int y, int cx, int cy, int rx, int ry, int dk)
+{
+	int d = ((x - cx) * (x - cx) * 256) / (rx * rx) + ((y - cy) * (y - cy) * 256) / (ry * ry);
+
+	if (d >= 256) return 0;
+	if (d < 144) return dk;
+	return dk * (256 - d) / 112;
+}
+
+
+static uint16_t clamp16(int v)
+{
+	return (v < 0) ? 0 : ((v > 0xFFFF) ? 0xFFFF : v);
+}
+
+
+static int64_t wall_nsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
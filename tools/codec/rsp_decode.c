@@ -0,0 +1,265 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Host decoder for a captured frame stream.
+ *
+ * Reads the TCP frame stream (rsp_protocol.h) from a file or stdin, checks each
+ * frame's CRC, decodes its payload and optionally writes the pixels out as raw
+ * little-endian 16-bit frames (input for codec_bench -f).  Prints a summary of
+ * frames, lost frames, payload sizes and the per-stage latencies from the headers.
+ * The multipart stream and snapshots from the camera's HTTP server are read too.
+ *
+ *   nc -l 8043 | rsp_decode -o frames.raw
+ *   curl -sN http://192.168.4.1/stream | rsp_decode
+ *
+ * Usage: rsp_decode [-v] [-o frames.raw] [capture]
+ *   -v lists the encoding and payload size of every frame
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "rsp_protocol.h"
+#include "frame_codec.h"
+#include "frame_delta.h"
+
+
+//
+// Decoder variables
+//
+static uint32_t crc_table[256];
+
+
+//
+// Decoder Forward Declarations for internal functions
+//
+static bool read_bytes(FILE* fp, void* dst, size_t len);
+static bool skip_part_headers(FILE* fp, void* dst);
+static void crc32_init();
+static uint32_t crc32_update(uint32_t crc, const uint8_t* p, size_t len);
+
+
+int main(int argc, char** argv)
+{
+	rsp_frame_hdr_t hdr;
+	FILE* in = stdin;
+	FILE* out = NULL;
+	uint8_t* payload = NULL;
+	uint16_t* telem = NULL;
+	uint16_t* pixels = NULL;
+	uint32_t payload_cap = 0;
+	uint32_t last_seq = 0;
+	uint32_t crc;
+	uint64_t frames = 0, lost = 0, crc_errors = 0, decode_errors = 0, bad_rows = 0, unkeyed = 0;
+	uint64_t raw_bytes = 0, payload_bytes = 0;
+	double acq = 0, publish = 0, queue = 0, send = 0;
+	frame_delta_t delta;
+	rsp_delta_hdr_t delta_hdr;
+	uint16_t* delta_ref = NULL;
+	bool verbose = false;
+	size_t extra;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "vo:")) != -1) {
+		switch (opt) {
+			case 'v': verbose = true; break;
+			case 'o':
+				if ((out = fopen(optarg, "wb")) == NULL) {
+					perror(optarg);
+					return 1;
+				}
+				break;
+			default:
+				fprintf(stderr, "Usage: %s [-v] [-o frames.raw] [capture]\n", argv[0]);
+				return 1;
+		}
+	}
+	if ((optind < argc) && ((in = fopen(argv[optind], "rb")) == NULL)) {
+		perror(argv[optind]);
+		return 1;
+	}
+	crc32_init();
+
+	while (read_bytes(in, &hdr, 8)) {
+		if ((memcmp(&hdr, "--", 2) == 0) || (memcmp(&hdr, "\r\n", 2) == 0)) {
+			// Multipart boundary and part headers ahead of the frame
+			if (!skip_part_headers(in, &hdr)) break;
+		}
+		if ((hdr.magic != RSP_PROTO_MAGIC) || (hdr.version != RSP_PROTO_VERSION) || (hdr.hdr_len < 8)) {
+			fprintf(stderr, "Lost frame sync after %llu frames\n", (unsigned long long) frames);
+			return 2;
+		}
+
+		// Read the header we know and skip anything a newer minor version added
+		extra = (hdr.hdr_len > sizeof(hdr)) ? hdr.hdr_len - sizeof(hdr) : 0;
+		if (hdr.hdr_len < sizeof(hdr)) memset((uint8_t*) &hdr + hdr.hdr_len, 0, sizeof(hdr) - hdr.hdr_len);
+		if (!read_bytes(in, (uint8_t*) &hdr + 8, hdr.hdr_len - extra - 8)) break;
+		while (extra--) fgetc(in);
+
+		telem = realloc(telem, (hdr.telem_words + 1) * 2);
+		pixels = realloc(pixels, hdr.width * hdr.height * 2);
+		if (hdr.payload_len > payload_cap) {
+			payload_cap = hdr.payload_len;
+			payload = realloc(payload, payload_cap);
+		}
+		if (!read_bytes(in, telem, hdr.telem_words * 2) || !read_bytes(in, payload, hdr.payload_len)) break;
+
+		if (hdr.flags & RSP_FLAG_CRC) {
+			crc = crc32_update(0, (uint8_t*) telem, hdr.telem_words * 2);
+			crc = crc32_update(crc, payload, hdr.payload_len);
+			if (crc != hdr.payload_crc) {
+				crc_errors++;
+				continue;
+			}
+		}
+
+		switch (hdr.encoding) {
+			case RSP_ENC_RAW16:
+				if (hdr.payload_len == (uint32_t) hdr.width * hdr.height * 2) {
+					memcpy(pixels, payload, hdr.payload_len);
+				} else {
+					decode_errors++;
+					continue;
+				}
+				break;
+			case RSP_ENC_RICE:
+				if (!frame_codec_decode(payload, hdr.payload_len, hdr.width, hdr.height, hdr.width, pixels)) {
+					decode_errors++;
+					continue;
+				}
+				break;
+			case RSP_ENC_TILE_DELTA:
+				if ((delta_ref == NULL) || (delta.width != hdr.width) || (delta.height != hdr.height)) {
+					delta_ref = realloc(delta_ref, hdr.width * hdr.height * 2);
+					frame_delta_init(&delta, hdr.width, hdr.height, delta_ref, 0, 0);
+				}
+				memcpy(&delta_hdr, payload, (hdr.payload_len < sizeof(delta_hdr)) ? hdr.payload_len : sizeof(delta_hdr));
+				if (!(delta_hdr.flags & RSP_DELTA_KEYFRAME) && (!delta.ref_valid || (delta_hdr.base_seq != delta.ref_seq))) {
+					// Joined the stream (or lost a frame) since the last keyframe
+					frame_delta_reset(&delta);
+					unkeyed++;
+					continue;
+				}
+				if (!frame_delta_decode(&delta, payload, hdr.payload_len, hdr.frame_seq)) {
+					decode_errors++;
+					continue;
+				}
+				memcpy(pixels, delta_ref, hdr.width * hdr.height * 2);
+				if (verbose) {
+					printf("frame %u: tile delta, %u bytes, %u of %u tiles%s\n", hdr.frame_seq, hdr.payload_len,
+					       delta_hdr.tiles_sent, delta_hdr.tiles, (delta_hdr.flags & RSP_DELTA_KEYFRAME) ? " (keyframe)" : "");
+				}
+				break;
+			default:
+				decode_errors++;
+				continue;
+		}
+		if (verbose && (hdr.encoding != RSP_ENC_TILE_DELTA)) {
+			printf("frame %u: %s, %u bytes\n", hdr.frame_seq, (hdr.encoding == RSP_ENC_RICE) ? "rice" : "raw", hdr.payload_len);
+		}
+
+		if ((frames != 0) && (hdr.frame_seq != last_seq + 1)) lost += hdr.frame_seq - last_seq - 1;
+		last_seq = hdr.frame_seq;
+		frames++;
+		bad_rows += hdr.bad_rows;
+		raw_bytes += (uint64_t) hdr.width * hdr.height * 2;
+		payload_bytes += hdr.payload_len;
+		acq += hdr.acq_usec - hdr.vsync_usec;
+		publish += hdr.publish_usec - hdr.acq_usec;
+		queue += hdr.dequeue_usec - hdr.publish_usec;
+		send += hdr.send_usec - hdr.dequeue_usec;
+
+		if (out != NULL) fwrite(pixels, 2, hdr.width * hdr.height, out);
+	}
+
+	printf("frames        : %llu (%llu lost, %llu bad rows)\n", (unsigned long long) frames,
+	       (unsigned long long) lost, (unsigned long long) bad_rows);
+	printf("errors        : %llu crc, %llu decode, %llu deltas before a keyframe\n", (unsigned long long) crc_errors,
+	       (unsigned long long) decode_errors, (unsigned long long) unkeyed);
+	if (frames != 0) {
+		printf("payload bytes : %.0f per frame (ratio %.2f)\n", (double) payload_bytes / frames,
+		       (double) raw_bytes / payload_bytes);
+		printf("latency usec  : acquire %.0f, publish %.0f, queue %.0f, encode+send %.0f\n",
+		       acq / frames, publish / frames, queue / frames, send / frames);
+	}
+
+	if (out != NULL) fclose(out);
+	return ((crc_errors + decode_errors) == 0) ? 0 : 2;
+}
+
+
+//
+// Decoder internal functions
+//
+static bool read_bytes(FILE* fp, void* dst, size_t len)
+{
+	return (len == 0) || (fread(dst, len, 1, fp) == 1);
+}
+
+
+/**
+ * Skip from the 8 bytes at dst to the blank line ending a part's headers and read
+ * the first 8 bytes of the part into dst
+ */
+static bool skip_part_headers(FILE* fp, void* dst)
+{
+	uint32_t last4 = 0;
+	const uint8_t* p = (const uint8_t*) dst;
+	int i, c;
+
+	for (i = 0; i < 8; i++) {
+		last4 = (last4 << 8) | p[i];
+		if (last4 == 0x0D0A0D0A) {
+			memmove(dst, p + i + 1, 7 - i);
+			return read_bytes(fp, (uint8_t*) dst + 7 - i, i + 1);
+		}
+	}
+	while ((c = fgetc(fp)) != EOF) {
+		last4 = (last4 << 8) | (uint8_t) c;
+		if (last4 == 0x0D0A0D0A) {
+			return read_bytes(fp, dst, 8);
+		}
+	}
+	return false;
+}
+
+
+/**
+ * zlib CRC-32 (the ESP32 ROM crc32_le)
+ */
+static void crc32_init()
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++) c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+		crc_table[i] = c;
+	}
+}
+
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* p, size_t len)
+{
+	crc = ~crc;
+	while (len--) crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
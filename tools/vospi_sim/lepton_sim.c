@@ -0,0 +1,532 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Simulated Lepton VoSPI source for host builds of the VoSPI engine.
+ *
+ * Provides the spi_device_transmit(), esp_timer_get_time() and heap_caps_malloc()
+ * entry points vospi.c links against.  Time is virtual: every SPI transaction
+ * advances the clock by its modeled duration and vsyncs occur every LEP_FRAME_USEC,
+ * so the segment timeouts in vospi.c behave as they do on the target while the
+ * host runs the parsing code at full speed.
+ *
+ * The sensor model follows the LEP_PROFILE geometry.  A Lepton 3.x streams 12 segment
+ * slots per unique frame: segments 1-4 followed by 8 slots carrying segment number 0.
+ * A Lepton 2.x streams each unique frame 3 times with no segment numbers.  Each slot
+ * contains lead_discards discard packets, the segment's packets (telemetry included)
+ * and then discard packets until the next vsync.  Alternatively, a capture file of raw bytes as read from
+ * the SPI bus is replayed verbatim.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "driver/spi_master.h"
+#include "lepton_utilities.h"
+#include "vospi.h"
+#include "lepton_sim.h"
+
+
+
+//
+// Lepton Simulator Variables
+//
+int sim_log_verbose = 0;
+
+static sim_config_t config;
+static sim_stats_t stats;
+
+// Virtual time
+static int64_t now_nsec;
+static int64_t last_xfer_end_nsec;
+static int64_t last_fault_nsec = -1;
+
+// SPI device
+static struct spi_device_t {
+	int clock_speed_hz;
+} sim_dev;
+
+// Stream position
+static int64_t cur_slot = -1;
+static uint32_t slot_pos;
+static uint32_t slip;
+static bool miss_pending;
+
+// Packet cache
+static int64_t cached_slot = -1;
+static uint32_t cached_pkt = 0xFFFFFFFF;
+static uint8_t pkt_buf[LEP_PKT_LENGTH];
+
+// Packets of the current unique frame, rendered once per frame
+static uint32_t rendered_frame = 0xFFFFFFFF;
+static uint8_t frame_pkts[LEP_SEGMENTS*LEP_TEL_PKTS_PER_SEG][LEP_PKT_LENGTH];
+
+// Capture files
+static FILE* replay_fp;
+static FILE* record_fp;
+
+static uint32_t rng_state;
+
+
+
+//
+// Lepton Simulator Forward Declarations for internal functions
+//
+static uint32_t rng_next();
+static uint16_t crc16_ccitt(const uint8_t* buf, int len);
+static void render_frame(uint32_t frame);
+static void gen_packet(int64_t slot, uint32_t pkt);
+static void stream_read(uint8_t* dst, size_t len);
+static void enter_slot(int64_t slot);
+static int slot_segment(int cycle);
+
+
+
+//
+// Lepton Simulator API
+//
+
+/**
+ * Reset the simulator with a new configuration
+ */
+void sim_init(const sim_config_t* cfg)
+{
+	config = *cfg;
+	memset(&stats, 0, sizeof(stats));
+	now_nsec = 0;
+	last_xfer_end_nsec = 0;
+	last_fault_nsec = -1;
+	cur_slot = -1;
+	slot_pos = 0;
+	slip = 0;
+	miss_pending = false;
+	cached_slot = -1;
+	rendered_frame = 0xFFFFFFFF;
+	rng_state = (cfg->seed != 0) ? cfg->seed : 0x1234567;
+}
+
+
+/**
+ * Replay raw SPI bytes from a capture file instead of the synthetic sensor
+ */
+bool sim_open_replay(const char* path)
+{
+	replay_fp = fopen(path, "rb");
+	return (replay_fp != NULL);
+}
+
+
+/**
+ * Record every byte returned to the VoSPI engine into a capture file
+ */
+bool sim_open_record(const char* path)
+{
+	record_fp = fopen(path, "wb");
+	return (record_fp != NULL);
+}
+
+
+void sim_close()
+{
+	if (replay_fp != NULL) {
+		fclose(replay_fp);
+		replay_fp = NULL;
+	}
+	if (record_fp != NULL) {
+		fclose(record_fp);
+		record_fp = NULL;
+	}
+}
+
+
+/**
+ * Wait for the next vsync edge, skipping any the host overran.  Returns the
+ * vsync time in uSec.
+ */
+int64_t sim_vsync()
+{
+	int64_t period = (int64_t) LEP_FRAME_USEC * 1000;
+	int64_t next = (now_nsec + period - 1) / period;
+	int64_t k;
+
+	if (next <= cur_slot) next = cur_slot + 1;
+	for (k = cur_slot + 1; k <= next; k++) {
+		enter_slot(k);
+	}
+	stats.missed_slots += next - cur_slot - 1;
+	cur_slot = next;
+	slot_pos = 0;
+	now_nsec = next * period;
+
+	return now_nsec / 1000;
+}
+
+
+/**
+ * Idle the bus (e.g. a task delay).  Long enough idle periods realign the stream.
+ */
+void sim_delay_usec(int64_t usec)
+{
+	now_nsec += usec * 1000;
+}
+
+
+/**
+ * Returns true once when the host should pretend it was too busy to service the
+ * current vsync.
+ */
+bool sim_skip_vsync()
+{
+	bool ret = miss_pending;
+
+	miss_pending = false;
+	return ret;
+}
+
+
+/**
+ * Virtual time of the most recent injected fault (uSec) or -1 if none yet
+ */
+int64_t sim_last_fault_usec()
+{
+	return (last_fault_nsec < 0) ? -1 : last_fault_nsec / 1000;
+}
+
+
+/**
+ * Synthetic TLinear scene: a gradient with a moving hot spot and a little noise
+ */
+uint16_t sim_pixel(uint32_t frame, int row, int col)
+{
+	int cx = (frame * 3) % LEP_WIDTH;
+	int d2 = (col - cx) * (col - cx) + (row - 60) * (row - 60);
+	uint32_t h = (frame * 2654435761u) ^ (row * 40503u) ^ (col * 2246822519u);
+	int v = 29315 + row * 4 + col * 2;
+
+	if (d2 < 100) v += 1500 - d2 * 10;
+	v += (h >> 13) & 0x0F;
+
+	return (uint16_t) v;
+}
+
+
+/**
+ * Frame number of the most recent unique frame whose last segment has been offered
+ */
+uint32_t sim_last_frame_num()
+{
+	return (cur_slot < (LEP_SEGMENTS-1)) ? 0 : (uint32_t) ((cur_slot - (LEP_SEGMENTS-1)) / LEP_SEG_SLOTS_PER_FRAME);
+}
+
+
+void sim_get_stats(sim_stats_t* s)
+{
+	*s = stats;
+}
+
+
+
+//
+// ESP-IDF entry points used by vospi.c
+//
+int64_t esp_timer_get_time()
+{
+	return now_nsec / 1000;
+}
+
+
+void* heap_caps_malloc(size_t size, uint32_t caps)
+{
+	(void) caps;
+	return aligned_alloc(4, (size + 3) & ~((size_t) 3));
+}
+
+
+void heap_caps_free(void* ptr)
+{
+	free(ptr);
+}
+
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t* dev_config, spi_device_handle_t* handle)
+{
+	(void) host;
+	sim_dev.clock_speed_hz = dev_config->clock_speed_hz;
+	*handle = &sim_dev;
+	return ESP_OK;
+}
+
+
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t* trans_desc)
+{
+	uint8_t* rxP = (uint8_t*) trans_desc->rx_buffer;
+	size_t len = trans_desc->rxlength / 8;
+	size_t i;
+
+	if ((handle != &sim_dev) || (rxP == NULL) || (trans_desc->tx_buffer != NULL)) {
+		return ESP_FAIL;
+	}
+
+	// A long enough idle CS period lets the sensor realign its packet output
+	if ((slip != 0) && ((now_nsec - last_xfer_end_nsec) >= (int64_t) SIM_RESYNC_IDLE_USEC * 1000)) {
+		slip = 0;
+		stats.resyncs++;
+	}
+
+	stream_read(rxP, len);
+	if (record_fp != NULL) {
+		fwrite(rxP, 1, len, record_fp);
+	}
+
+	// Classify what the host actually received on its packet boundaries
+	for (i = 0; i + LEP_PKT_LENGTH <= len; i += LEP_PKT_LENGTH) {
+		if ((rxP[i] & 0x0F) == 0x0F) {
+			stats.discards++;
+		} else {
+			stats.packets++;
+		}
+	}
+
+	stats.transactions++;
+	stats.bytes += len;
+	int64_t dur = SIM_XFER_OVERHEAD_NSEC + (int64_t) len * 8 * 1000000000LL / sim_dev.clock_speed_hz;
+	stats.xfer_nsec += dur;
+	now_nsec += dur;
+	last_xfer_end_nsec = now_nsec;
+
+	return ESP_OK;
+}
+
+
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t* trans_desc)
+{
+	return spi_device_transmit(handle, trans_desc);
+}
+
+
+
+//
+// Lepton Simulator internal functions
+//
+static uint32_t rng_next()
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 17;
+	rng_state ^= rng_state << 5;
+	return rng_state;
+}
+
+
+/**
+ * VoSPI packet CRC: CRC-16-CCITT (x^16 + x^12 + x^5 + 1), zero initial value
+ */
+static uint16_t crc16_ccitt(const uint8_t* buf, int len)
+{
+	static uint16_t table[256];
+	static bool table_valid = false;
+	uint16_t crc;
+	int i, b;
+
+	if (!table_valid) {
+		for (i = 0; i < 256; i++) {
+			crc = i << 8;
+			for (b = 0; b < 8; b++) {
+				crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+			}
+			table[i] = crc;
+		}
+		table_valid = true;
+	}
+
+	crc = 0;
+	for (i = 0; i < len; i++) {
+		crc = (crc << 8) ^ table[(crc >> 8) ^ buf[i]];
+	}
+	return crc;
+}
+
+
+/**
+ * Render all packets of a unique frame, CRCs included
+ */
+static void render_frame(uint32_t frame)
+{
+	int pkts_per_seg = (config.telemetry) ? LEP_TEL_PKTS_PER_SEG : LEP_NOTEL_PKTS_PER_SEG;
+	int gp, i;
+	uint8_t* pP;
+	uint16_t w, crc;
+
+	for (gp = 0; gp < LEP_SEGMENTS*pkts_per_seg; gp++) {
+		pP = frame_pkts[gp];
+		for (i = 0; i < LEP_PKT_PIXELS; i++) {
+			if (gp < LEP_IMG_PKTS) {
+				w = sim_pixel(frame, (gp * LEP_PKT_PIXELS + i) / LEP_WIDTH, (gp * LEP_PKT_PIXELS + i) % LEP_WIDTH);
+			} else {
+				// Telemetry footer
+				switch (((gp - LEP_IMG_PKTS) * LEP_PKT_PIXELS) + i) {
+					case LEP_TEL_FC_LOW:  w = (frame * 3) & 0xFFFF; break;
+					case LEP_TEL_FC_HIGH: w = (frame * 3) >> 16; break;
+					case LEP_TEL_TLIN_ENABLE: w = 1; break;
+					default: w = 0;
+				}
+			}
+			pP[4 + i*2] = w >> 8;
+			pP[5 + i*2] = w & 0xFF;
+		}
+
+		// Line number within the segment, CRC computed with the segment bits and CRC zeroed
+		pP[0] = 0;
+		pP[1] = gp % pkts_per_seg;
+		pP[2] = 0;
+		pP[3] = 0;
+		crc = crc16_ccitt(pP, LEP_PKT_LENGTH);
+		pP[2] = crc >> 8;
+		pP[3] = crc & 0xFF;
+	}
+	rendered_frame = frame;
+}
+
+
+/**
+ * Generate packet pkt (counted from vsync) of the given slot into pkt_buf
+ */
+static void gen_packet(int64_t slot, uint32_t pkt)
+{
+	int pkts_per_seg = (config.telemetry) ? LEP_TEL_PKTS_PER_SEG : LEP_NOTEL_PKTS_PER_SEG;
+	uint32_t frame = (uint32_t) (slot / LEP_SEG_SLOTS_PER_FRAME);
+	int cycle = (int) (slot % LEP_SEG_SLOTS_PER_FRAME);
+	int segment = slot_segment(cycle);
+	int layout_seg = (cycle % LEP_SEGMENTS) + 1;
+	int line, i;
+
+	cached_slot = slot;
+	cached_pkt = pkt;
+
+	if ((pkt < (uint32_t) config.lead_discards) || (pkt >= (uint32_t) (config.lead_discards + pkts_per_seg))) {
+		memset(pkt_buf, 0, sizeof(pkt_buf));
+		pkt_buf[0] = 0xFF;
+		pkt_buf[1] = 0xFF;
+		return;
+	}
+
+	if (rendered_frame != frame) {
+		render_frame(frame);
+	}
+	line = pkt - config.lead_discards;
+	memcpy(pkt_buf, frame_pkts[(layout_seg - 1) * pkts_per_seg + line], LEP_PKT_LENGTH);
+
+	// Corrupt a payload bit after the CRC is computed, as SPI noise would
+	if ((config.corrupt_ppm > 0) && ((int) (rng_next() % 1000000) < config.corrupt_ppm)) {
+		i = 4 + (rng_next() % (LEP_PKT_LENGTH - 4));
+		pkt_buf[i] ^= 1 << (rng_next() % 8);
+		stats.faults++;
+		last_fault_nsec = now_nsec;
+	}
+
+#if LEP_SEGMENTS > 1
+	// The segment number is not covered by the CRC
+	if (line == 20) {
+		pkt_buf[0] |= segment << 4;
+	}
+#else
+	(void) segment;
+#endif
+}
+
+
+/**
+ * Copy the next len bytes the sensor clocks out
+ */
+static void stream_read(uint8_t* dst, size_t len)
+{
+	uint32_t pos, pkt, off, n;
+	size_t got;
+
+	if (replay_fp != NULL) {
+		while (len > 0) {
+			got = fread(dst, 1, len, replay_fp);
+			if (got == 0) {
+				rewind(replay_fp);
+				if ((got = fread(dst, 1, len, replay_fp)) == 0) {
+					memset(dst, 0xFF, len);
+					return;
+				}
+			}
+			dst += got;
+			len -= got;
+		}
+		return;
+	}
+
+	while (len > 0) {
+		pos = slot_pos + slip;
+		pkt = pos / LEP_PKT_LENGTH;
+		off = pos % LEP_PKT_LENGTH;
+		if ((cached_slot != cur_slot) || (cached_pkt != pkt)) {
+			gen_packet(cur_slot, pkt);
+		}
+		n = LEP_PKT_LENGTH - off;
+		if (n > len) n = len;
+		memcpy(dst, &pkt_buf[off], n);
+		dst += n;
+		len -= n;
+		slot_pos += n;
+	}
+}
+
+
+/**
+ * Account for the sensor starting a new segment slot and inject any configured faults
+ */
+static void enter_slot(int64_t slot)
+{
+	uint32_t frame = (uint32_t) (slot / LEP_SEG_SLOTS_PER_FRAME);
+	int cycle = (int) (slot % LEP_SEG_SLOTS_PER_FRAME);
+
+	if (slot_segment(cycle) == LEP_SEGMENTS) {
+		stats.frames_generated++;
+	}
+	stats.slots++;
+
+	if ((frame == 0) || (replay_fp != NULL)) return;
+
+	if ((config.slip_every > 0) && (cycle == 0) && ((frame % config.slip_every) == 0)) {
+		slip = 1 + (rng_next() % (LEP_PKT_LENGTH - 1));
+		stats.faults++;
+		last_fault_nsec = slot * (int64_t) LEP_FRAME_USEC * 1000;
+	}
+	if ((config.miss_every > 0) && (cycle == 1) && ((frame % config.miss_every) == 0)) {
+		miss_pending = true;
+		stats.faults++;
+		last_fault_nsec = slot * (int64_t) LEP_FRAME_USEC * 1000;
+	}
+}
+
+
+/**
+ * Segment number the sensor outputs in a slot of the unique frame cycle (0 = invalid)
+ */
+static int slot_segment(int cycle)
+{
+	if (LEP_SEGMENTS == 1) {
+		// Every repeat of the frame is valid
+		return 1;
+	}
+	return (cycle < LEP_SEGMENTS) ? cycle + 1 : 0;
+}
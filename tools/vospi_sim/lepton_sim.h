@@ -0,0 +1,79 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+#ifndef LEPTON_SIM_H
+#define LEPTON_SIM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+//
+// Lepton Simulator Constants
+//
+
+// Minimum CS idle time that re-establishes VoSPI packet alignment (Lepton 3.5 4.2.3.3.1)
+#define SIM_RESYNC_IDLE_USEC 185000
+
+// Modeled fixed cost of setting up and completing one interrupt driven SPI transaction
+#define SIM_XFER_OVERHEAD_NSEC 12000
+
+
+//
+// Lepton Simulator Data structures
+//
+typedef struct {
+	bool telemetry;            // Emit 61 packets per segment with the telemetry footer
+	int lead_discards;         // Discard packets between vsync and the first segment packet
+	int slip_every;            // Slip the packet stream by a few bytes every N frames (0 = never)
+	int miss_every;            // Make the host miss one vsync every N frames (0 = never)
+	int corrupt_ppm;           // Per-packet probability (parts per million) of a flipped payload bit
+	uint32_t seed;
+} sim_config_t;
+
+typedef struct {
+	uint64_t slots;            // Vsync periods elapsed
+	uint64_t missed_slots;     // Vsync periods the host did not service
+	uint64_t transactions;     // spi_device_transmit calls
+	uint64_t bytes;            // Bytes returned to the host
+	uint64_t packets;          // Non-discard packets (on a packet boundary) returned to the host
+	uint64_t discards;         // Discard packets returned to the host
+	uint64_t frames_generated; // Complete valid frames the sensor offered
+	uint64_t faults;           // Injected slip/miss/corrupt events
+	uint64_t resyncs;          // CS idle periods long enough to realign the stream
+	int64_t xfer_nsec;         // Virtual time spent inside SPI transactions
+} sim_stats_t;
+
+
+//
+// Lepton Simulator API
+//
+void sim_init(const sim_config_t* cfg);
+bool sim_open_replay(const char* path);
+bool sim_open_record(const char* path);
+void sim_close();
+
+int64_t sim_vsync();
+void sim_delay_usec(int64_t usec);
+bool sim_skip_vsync();
+int64_t sim_last_fault_usec();
+
+uint16_t sim_pixel(uint32_t frame, int row, int col);
+uint32_t sim_last_frame_num();
+void sim_get_stats(sim_stats_t* stats);
+
+#endif /* LEPTON_SIM_H */
@@ -0,0 +1,71 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Host build stand-in for the ESP-IDF SPI master driver.  Transactions are
+ * served by the simulated Lepton in sim_spi.c.
+ */
+#ifndef DRIVER_SPI_MASTER_H
+#define DRIVER_SPI_MASTER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "esp_system.h"
+
+typedef enum {
+	SPI_HOST  = 0,
+	HSPI_HOST = 1,
+	VSPI_HOST = 2
+} spi_host_device_t;
+
+#define SPI_DEVICE_HALFDUPLEX (1<<4)
+
+typedef struct spi_device_t* spi_device_handle_t;
+
+typedef struct {
+	uint8_t command_bits;
+	uint8_t address_bits;
+	uint8_t dummy_bits;
+	uint8_t mode;
+	uint16_t duty_cycle_pos;
+	uint16_t cs_ena_pretrans;
+	uint8_t cs_ena_posttrans;
+	int clock_speed_hz;
+	int input_delay_ns;
+	int spics_io_num;
+	uint32_t flags;
+	int queue_size;
+	void* pre_cb;
+	void* post_cb;
+} spi_device_interface_config_t;
+
+typedef struct {
+	uint32_t flags;
+	uint16_t cmd;
+	uint64_t addr;
+	size_t length;
+	size_t rxlength;
+	void* user;
+	const void* tx_buffer;
+	void* rx_buffer;
+} spi_transaction_t;
+
+esp_err_t spi_bus_add_device(spi_host_device_t host, const spi_device_interface_config_t* dev_config, spi_device_handle_t* handle);
+esp_err_t spi_device_transmit(spi_device_handle_t handle, spi_transaction_t* trans_desc);
+esp_err_t spi_device_polling_transmit(spi_device_handle_t handle, spi_transaction_t* trans_desc);
+
+#endif /* DRIVER_SPI_MASTER_H */
@@ -0,0 +1,44 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Host build stand-in for the ESP-IDF system header.  Only what the
+ * VoSPI engine touches is provided.
+ */
+#ifndef ESP_SYSTEM_H
+#define ESP_SYSTEM_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+typedef int esp_err_t;
+
+#define ESP_OK    0
+#define ESP_FAIL -1
+
+#define ESP_ERROR_CHECK(x) do {                                        \
+		esp_err_t __err_rc = (x);                                      \
+		if (__err_rc != ESP_OK) {                                      \
+			fprintf(stderr, "ESP_ERROR_CHECK failed: %d at %s:%d\n",   \
+			        __err_rc, __FILE__, __LINE__);                     \
+			abort();                                                   \
+		}                                                              \
+	} while (0)
+
+#endif /* ESP_SYSTEM_H */
@@ -0,0 +1,32 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * The simulator is single threaded so the mutexes are no-ops.
+ */
+#ifndef SEMAPHORE_H
+#define SEMAPHORE_H
+
+#include "FreeRTOS.h"
+
+typedef void* SemaphoreHandle_t;
+
+#define xSemaphoreCreateMutex()  ((SemaphoreHandle_t) 1)
+#define xSemaphoreTake(s, t)     ((void) (s), (void) (t), pdTRUE)
+#define xSemaphoreGive(s)        ((void) (s), pdTRUE)
+
+#endif /* SEMAPHORE_H */
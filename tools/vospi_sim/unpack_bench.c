@@ -0,0 +1,197 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Host microbenchmark for the VoSPI packet unpack kernels.
+ *
+ * Runs the original byte-at-a-time copy loops followed by the separate min/max
+ * frame pass, and the fused word-at-a-time kernel from vospi_unpack.c, over the
+ * same 240 packets of simulated frame data and checks they agree.  Also times
+ * the table-driven packet CRC check over the same packets.
+ *
+ * Usage: unpack_bench [-n frames]
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "vospi.h"
+#include "vospi_crc.h"
+#include "vospi_unpack.h"
+#include "lepton_sim.h"
+
+
+//
+// Benchmark constants
+//
+#define NUM_PKTS LEP_IMG_PKTS
+
+
+//
+// Benchmark variables
+//
+static uint8_t* pkts;
+static uint16_t* ref_buf;
+static uint16_t* fused_buf;
+
+
+//
+// Benchmark Forward Declarations for internal functions
+//
+static int64_t wall_nsec();
+static void reference_copy_packet(uint8_t* pktP, uint16_t* acqPushPtr);
+static void reference_min_max(uint16_t* bufP, uint16_t* minP, uint16_t* maxP);
+
+
+int main(int argc, char** argv)
+{
+	vospi_stats_t st, seg;
+	uint16_t min = 0, max = 0;
+	uint32_t sum;
+	int64_t t0, ref_nsec, fused_nsec, crc_nsec;
+	volatile uint16_t crc_acc = 0;
+	int frames = 5000;
+	int f, p, i, opt;
+
+	while ((opt = getopt(argc, argv, "n:")) != -1) {
+		switch (opt) {
+			case 'n': frames = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-n frames]\n", argv[0]);
+				return 1;
+		}
+	}
+
+	// Big-endian packets as they arrive in the DMA buffer
+	pkts = aligned_alloc(4, NUM_PKTS * LEP_PKT_LENGTH);
+	ref_buf = aligned_alloc(4, LEP_NUM_PIXELS * 2);
+	fused_buf = aligned_alloc(4, LEP_NUM_PIXELS * 2);
+	for (p = 0; p < NUM_PKTS; p++) {
+		pkts[p*LEP_PKT_LENGTH] = 0;
+		pkts[p*LEP_PKT_LENGTH + 1] = p % LEP_TEL_PKTS_PER_SEG;
+		for (i = 0; i < LEP_PKT_PIXELS; i++) {
+			uint16_t v = sim_pixel(7, (p * LEP_PKT_PIXELS + i) / LEP_WIDTH, (p * LEP_PKT_PIXELS + i) % LEP_WIDTH);
+			pkts[p*LEP_PKT_LENGTH + 4 + i*2] = v >> 8;
+			pkts[p*LEP_PKT_LENGTH + 5 + i*2] = v & 0xFF;
+		}
+	}
+
+	// Original: byte-at-a-time copy per packet, then a min/max pass over the frame
+	t0 = wall_nsec();
+	for (f = 0; f < frames; f++) {
+		for (p = 0; p < NUM_PKTS; p++) {
+			reference_copy_packet(&pkts[p*LEP_PKT_LENGTH], &ref_buf[p * LEP_PKT_PIXELS]);
+		}
+		reference_min_max(ref_buf, &min, &max);
+	}
+	ref_nsec = wall_nsec() - t0;
+
+	// Fused: word-at-a-time swap with min/max/sum/histogram per packet, merged per segment
+	t0 = wall_nsec();
+	for (f = 0; f < frames; f++) {
+		vospi_stats_reset(&st);
+		for (p = 0; p < NUM_PKTS; p++) {
+			if ((p % LEP_NOTEL_PKTS_PER_SEG) == 0) vospi_stats_reset(&seg);
+			vospi_unpack_packet(&pkts[p*LEP_PKT_LENGTH], &fused_buf[p * LEP_PKT_PIXELS], &seg);
+			if ((p % LEP_NOTEL_PKTS_PER_SEG) == (LEP_NOTEL_PKTS_PER_SEG - 1)) vospi_stats_merge(&st, &seg);
+		}
+	}
+	fused_nsec = wall_nsec() - t0;
+
+	// Packet CRC over every image packet of the frame
+	t0 = wall_nsec();
+	for (f = 0; f < frames; f++) {
+		for (p = 0; p < NUM_PKTS; p++) {
+			crc_acc ^= vospi_crc16(&pkts[p*LEP_PKT_LENGTH]);
+		}
+	}
+	crc_nsec = wall_nsec() - t0;
+
+	// Check results agree
+	sum = 0;
+	for (i = 0; i < LEP_NUM_PIXELS; i++) sum += ref_buf[i];
+	if ((memcmp(ref_buf, fused_buf, LEP_NUM_PIXELS * 2) != 0) ||
+	    (st.min != min) || (st.max != max) || (st.sum != sum)) {
+		fprintf(stderr, "Fused kernel results differ from the reference loops\n");
+		return 2;
+	}
+	for (i = 0, sum = 0; i < LEP_HIST_BINS; i++) sum += st.hist[i];
+	if (sum != LEP_NUM_PIXELS) {
+		fprintf(stderr, "Histogram holds %u pixels\n", sum);
+		return 2;
+	}
+
+	printf("frames               : %d (min %u, max %u)\n", frames, min, max);
+	printf("reference nsec/frame : %.0f (copy + min/max pass)\n", (double) ref_nsec / frames);
+	printf("fused nsec/frame     : %.0f (copy + min/max/sum/histogram)\n", (double) fused_nsec / frames);
+	printf("speedup              : %.2fx\n", (double) ref_nsec / fused_nsec);
+	printf("crc nsec/frame       : %.0f (%.0f per packet)\n", (double) crc_nsec / frames,
+	       (double) crc_nsec / frames / NUM_PKTS);
+
+	return 0;
+}
+
+
+//
+// Benchmark internal functions
+//
+static int64_t wall_nsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/**
+ * copy_packet_to_lepton_buffer() as it was before the fused kernel
+ */
+static void reference_copy_packet(uint8_t* pktP, uint16_t* acqPushPtr)
+{
+	uint8_t* lepPopPtr = pktP + 4;
+	uint16_t t;
+
+	while (lepPopPtr <= (pktP + (LEP_PKT_LENGTH-1))) {
+		t = *lepPopPtr++ << 8;
+		t |= *lepPopPtr++;
+		*acqPushPtr++ = t;
+	}
+}
+
+
+/**
+ * The min/max pass vospi_get_frame() made before the fused kernel
+ */
+static void reference_min_max(uint16_t* bufP, uint16_t* minP, uint16_t* maxP)
+{
+	uint16_t* lptr = bufP;
+	uint16_t min = 0xFFFF;
+	uint16_t max = 0x0000;
+	uint16_t t16;
+
+	while (lptr < &bufP[LEP_NUM_PIXELS]) {
+		t16 = *lptr++;
+		if (t16 < min) min = t16;
+		if (t16 > max) max = t16;
+	}
+	*minP = min;
+	*maxP = max;
+}
@@ -0,0 +1,280 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * Host benchmark for the VoSPI segment/frame state machine.
+ *
+ * Drives vospi_transfer_segment()/vospi_get_frame() exactly as lepton_task does in
+ * STATE_RUN (including the 36 vsync / 185 mSec resynchronization fallback) against
+ * the simulated sensor in lepton_sim.c, and reports acquisition throughput on the
+ * host, modeled SPI time on the target and resynchronization behaviour.
+ *
+ * Usage: vospi_bench [-n frames] [-p pkts_per_xfer] [-T] [-l lead_discards] [-s slip_every]
+ *                    [-m miss_every] [-c corrupt_ppm] [-x seed]
+ *                    [-r replay_file] [-w record_file] [-v]
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "lepton_utilities.h"
+#include "system_utilities.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "vospi.h"
+#include "vospi_resync.h"
+#include "lepton_sim.h"
+
+
+//
+// Benchmark variables
+//
+static lep_buffer_t bench_buf;
+
+
+//
+// Benchmark Forward Declarations for internal functions
+//
+static int64_t wall_nsec();
+static bool check_frame(uint32_t frame);
+static void usage(const char* name);
+
+
+int main(int argc, char** argv)
+{
+	sim_config_t cfg = {
+		.telemetry = true,
+		.lead_discards = 2,
+		.slip_every = 0,
+		.miss_every = 0,
+		.corrupt_ppm = 0,
+		.seed = 1
+	};
+	sim_stats_t st;
+	const char* replay_path = NULL;
+	const char* record_path = NULL;
+	uint64_t target_frames = 1000;
+	uint64_t frames = 0;
+	uint64_t bad_frames = 0;
+	uint64_t flagged_frames = 0;
+	uint64_t serviced = 0;
+	uint64_t resync_waits = 0;
+	uint64_t resets = 0;
+	uint64_t recoveries = 0;
+	int64_t recover_sum = 0;
+	int64_t recover_max = 0;
+	int64_t handled_fault = -1;
+	int64_t fault, vsync, t0, t1, acq_nsec = 0;
+	vospi_counters_t cnt;
+	vospi_resync_stats_t rs;
+	bool got_frame;
+	int crc_mode = -1;
+	int pkts_per_xfer = LEP_MAX_PKTS_PER_XFER;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:p:Tl:s:m:c:C:x:r:w:v")) != -1) {
+		switch (opt) {
+			case 'n': target_frames = strtoull(optarg, NULL, 0); break;
+			case 'p': pkts_per_xfer = atoi(optarg); break;
+			case 'T': cfg.telemetry = false; break;
+			case 'l': cfg.lead_discards = atoi(optarg); break;
+			case 's': cfg.slip_every = atoi(optarg); break;
+			case 'm': cfg.miss_every = atoi(optarg); break;
+			case 'c': cfg.corrupt_ppm = atoi(optarg); break;
+			case 'C': crc_mode = atoi(optarg); break;
+			case 'x': cfg.seed = strtoul(optarg, NULL, 0); break;
+			case 'r': replay_path = optarg; break;
+			case 'w': record_path = optarg; break;
+			case 'v': sim_log_verbose = 1; break;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	sim_init(&cfg);
+	if ((replay_path != NULL) && !sim_open_replay(replay_path)) {
+		fprintf(stderr, "Could not open %s\n", replay_path);
+		return 1;
+	}
+	if ((record_path != NULL) && !sim_open_record(record_path)) {
+		fprintf(stderr, "Could not create %s\n", record_path);
+		return 1;
+	}
+
+	bench_buf.lep_bufferP = malloc(LEP_NUM_PIXELS*2);
+	bench_buf.lep_telemP = malloc(LEP_TEL_WORDS*2);
+	if (vospi_init() != ESP_OK) {
+		fprintf(stderr, "vospi_init failed\n");
+		return 1;
+	}
+	vospi_include_telem(cfg.telemetry);
+	vospi_set_packets_per_xfer(pkts_per_xfer);
+	if (crc_mode >= 0) {
+		vospi_set_crc_mode((vospi_crc_mode_t) crc_mode);
+	}
+
+	// Same loop as lepton_task STATE_RUN, minus the real-time waits
+	while (frames < target_frames) {
+		vsync = sim_vsync();
+		if (sim_skip_vsync()) continue;
+		serviced++;
+
+		t0 = wall_nsec();
+		got_frame = vospi_transfer_segment(vsync);
+		if (got_frame) {
+			vospi_get_frame(&bench_buf);
+			t1 = wall_nsec();
+			acq_nsec += t1 - t0;
+
+			frames++;
+			if ((bench_buf.frame_seq != (frames - 1)) || (bench_buf.vsync_usec > vsync) ||
+			    ((vsync - bench_buf.vsync_usec) >= (LEP_SEG_SLOTS_PER_FRAME * LEP_FRAME_USEC))) {
+				// The frame's metadata does not describe this frame
+				bad_frames++;
+			} else if (bench_buf.bad_rows != 0) {
+				// Known bad rows, only silent corruption counts against the frame
+				flagged_frames++;
+			} else if ((replay_path == NULL) && !check_frame(sim_last_frame_num())) {
+				bad_frames++;
+			}
+
+			// Recovery time from the most recent injected fault
+			fault = sim_last_fault_usec();
+			if ((fault >= 0) && (fault != handled_fault)) {
+				handled_fault = fault;
+				recoveries++;
+				recover_sum += vsync - fault;
+				if ((vsync - fault) > recover_max) recover_max = vsync - fault;
+			}
+		} else {
+			acq_nsec += wall_nsec() - t0;
+		}
+
+		switch (vospi_resync_update(got_frame, vospi_get_sync(), esp_timer_get_time())) {
+			case VOSPI_RESYNC_NONE:
+				break;
+
+			case VOSPI_RESYNC_RESET:
+				// Reset pulse and Lepton boot
+				resets++;
+				sim_delay_usec(1010000);
+				break;
+
+			default:
+				resync_waits++;
+				sim_delay_usec(LEP_RESYNC_IDLE_MSEC * 1000);
+				break;
+		}
+	}
+
+	sim_get_stats(&st);
+	sim_close();
+	vospi_get_counters(&cnt);
+	vospi_resync_get_stats(&rs);
+
+	printf("frames               : %llu (%llu offered, %llu bad)\n",
+	       (unsigned long long) frames, (unsigned long long) st.frames_generated,
+	       (unsigned long long) bad_frames);
+	printf("segment slots        : %llu (%llu serviced, %llu missed)\n",
+	       (unsigned long long) st.slots, (unsigned long long) serviced,
+	       (unsigned long long) st.missed_slots);
+	printf("packets / discards   : %llu / %llu\n",
+	       (unsigned long long) st.packets, (unsigned long long) st.discards);
+	printf("spi transactions     : %llu (%.1f per serviced slot)\n",
+	       (unsigned long long) st.transactions, (double) st.transactions / serviced);
+	printf("host frames/sec      : %.1f\n", frames * 1e9 / acq_nsec);
+	printf("host packets/sec     : %.0f\n", st.packets * 1e9 / acq_nsec);
+	printf("host nsec/slot       : %.0f\n", (double) acq_nsec / serviced);
+	printf("modeled spi usec/slot: %.1f (of %d usec window)\n",
+	       st.xfer_nsec / 1000.0 / serviced, LEP_MAX_FRAME_XFER_WAIT_USEC);
+	printf("modeled cpu usec/slot: %.1f (transaction setup/completion)\n",
+	       (double) st.transactions * SIM_XFER_OVERHEAD_NSEC / 1000.0 / serviced);
+	printf("injected faults      : %llu\n", (unsigned long long) st.faults);
+	printf("crc errors           : %u (%llu frames flagged, %u dropped)\n",
+	       cnt.crc_errors, (unsigned long long) flagged_frames, cnt.crc_frames_dropped);
+	printf("resync waits         : %llu (%llu stream realignments, %llu resets)\n",
+	       (unsigned long long) resync_waits, (unsigned long long) st.resyncs,
+	       (unsigned long long) resets);
+	printf("resync events        : %u (%u frames lost, %u sync lost reads, %u bad headers)\n",
+	       rs.events, rs.frames_lost, cnt.sync_lost, cnt.bad_headers);
+	if (recoveries > 0) {
+		printf("recovery usec        : mean %lld, max %lld\n",
+		       (long long) (recover_sum / recoveries), (long long) recover_max);
+	}
+
+	return (bad_frames == 0) ? 0 : 2;
+}
+
+
+//
+// Benchmark internal functions
+//
+static int64_t wall_nsec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+/**
+ * Compare the delivered frame against what the simulated sensor produced
+ */
+static bool check_frame(uint32_t frame)
+{
+	uint16_t t16, min = 0xFFFF, max = 0;
+	uint32_t sum = 0;
+	int r, c;
+
+	for (r = 0; r < LEP_HEIGHT; r++) {
+		for (c = 0; c < LEP_WIDTH; c++) {
+			t16 = sim_pixel(frame, r, c);
+			if (bench_buf.lep_bufferP[r*LEP_WIDTH + c] != t16) {
+				return false;
+			}
+			if (t16 < min) min = t16;
+			if (t16 > max) max = t16;
+			sum += t16;
+		}
+	}
+
+	if ((bench_buf.lep_min_val != min) || (bench_buf.lep_max_val != max) || (bench_buf.lep_sum != sum)) {
+		return false;
+	}
+
+	if (bench_buf.telem_valid && (bench_buf.lep_telemP[LEP_TEL_FC_LOW] != ((frame * 3) & 0xFFFF))) {
+		return false;
+	}
+
+	return true;
+}
+
+
+static void usage(const char* name)
+{
+	fprintf(stderr, "Usage: %s [-n frames] [-p pkts_per_xfer] [-T] [-l lead_discards] [-s slip_every]\n"
+	                "       [-m miss_every] [-c corrupt_ppm] [-C crc_mode] [-x seed]\n"
+	                "       [-r replay_file] [-w record_file] [-v]\n"
+	                "  -p  packets per SPI transaction once a segment is located (1 = per packet)\n"
+	                "  -T  telemetry disabled (60 packets/segment)\n"
+	                "  -C  0 = no CRC check, 1 = count, 2 = drop rows, 3 = drop frames\n", name);
+}
@@ -0,0 +1,385 @@
+/* ***************************************************************************
+ * Copyright(C) 2021 Robert Mysza
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ * ***************************************************************************
+ */
+/*
+ * WebSocket test client for the camera's /ws endpoint (http_task.c).
+ *
+ * Connects, receives one binary message per frame and reports the delivered frame
+ * rate, lost and skipped frames and where the latency goes.  The device and host
+ * clocks are not shared, so the latency is pieced together: the device side
+ * (acquisition to the start of the send) comes from each frame's header, the network
+ * delay is half the round trip of the pings the client sends, and the transfer time
+ * is how long each message took to arrive once its first byte did.
+ *
+ *   ws_client                      # 192.168.4.1:80/ws until Ctrl-C
+ *   ws_client -n 300 192.168.4.1
+ *
+ * Usage: ws_client [-v] [-n frames] [-p ping_msec] [host[:port][/path]]
+ *   -v prints every frame
+ */
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "rsp_protocol.h"
+
+
+//
+// Client constants
+//
+#define WS_OP_CLOSE  0x8
+#define WS_OP_PING   0x9
+#define WS_OP_PONG   0xA
+#define WS_OP_BINARY 0x2
+
+#define DEF_HOST "192.168.4.1"
+#define DEF_PORT "80"
+#define DEF_PATH "/ws"
+
+
+//
+// Client variables
+//
+static volatile sig_atomic_t stop;
+static uint32_t crc_table[256];
+
+
+//
+// Client Forward Declarations for internal functions
+//
+static int ws_connect(const char* host, const char* port, const char* path);
+static bool ws_send(int fd, int opcode, const void* data, size_t len);
+static bool read_full(int fd, void* dst, size_t len);
+static int64_t now_usec();
+static void crc32_init();
+static uint32_t crc32_update(uint32_t crc, const uint8_t* p, size_t len);
+static void on_signal(int sig);
+
+
+int main(int argc, char** argv)
+{
+	char target[256] = DEF_HOST;
+	char path[256] = DEF_PATH;
+	const char* host = target;
+	const char* port = DEF_PORT;
+	char* p;
+	uint8_t hdr[14];
+	uint8_t* msg = NULL;
+	uint64_t msg_cap = 0;
+	uint64_t len;
+	rsp_frame_hdr_t fh;
+	uint64_t max_frames = 0;
+	int ping_msec = 1000;
+	bool verbose = false;
+	struct pollfd pfd;
+	int64_t t_start, t_first, t_last = 0, t_ping, t, rtt;
+	uint64_t frames = 0, lost = 0, bad = 0, crc_errors = 0, bytes = 0, pongs = 0;
+	uint32_t last_seq = 0;
+	double device = 0, transfer = 0, rtt_sum = 0;
+	int64_t rtt_min = INT64_MAX, rtt_max = 0, gap_max = 0;
+	uint32_t crc;
+	int fd, opt, i, opcode, wait;
+
+	while ((opt = getopt(argc, argv, "vn:p:")) != -1) {
+		switch (opt) {
+			case 'v': verbose = true; break;
+			case 'n': max_frames = strtoull(optarg, NULL, 0); break;
+			case 'p': ping_msec = atoi(optarg); break;
+			default:
+				fprintf(stderr, "Usage: %s [-v] [-n frames] [-p ping_msec] [host[:port][/path]]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind < argc) {
+		snprintf(target, sizeof(target), "%s", argv[optind]);
+		if ((p = strchr(target, '/')) != NULL) {
+			snprintf(path, sizeof(path), "%s", p);
+			*p = '\0';
+		}
+		if ((p = strchr(target, ':')) != NULL) {
+			*p = '\0';
+			port = p + 1;
+		}
+	}
+	if (ping_msec < 10) ping_msec = 10;
+
+	crc32_init();
+	signal(SIGINT, on_signal);
+	if ((fd = ws_connect(host, port, path)) < 0) {
+		return 1;
+	}
+	fprintf(stderr, "Connected to %s:%s%s\n", host, port, path);
+
+	t_start = now_usec();
+	t_ping = t_start;
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	while (!stop && ((max_frames == 0) || (frames < max_frames))) {
+		// Ping on schedule while waiting for the next message
+		t = now_usec();
+		if (t >= t_ping) {
+			if (!ws_send(fd, WS_OP_PING, &t, sizeof(t))) break;
+			t_ping = t + ping_msec * 1000LL;
+		}
+		wait = (int) ((t_ping - t + 999) / 1000);
+		if ((i = poll(&pfd, 1, wait)) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll");
+			break;
+		}
+		if (i == 0) continue;
+
+		// One message (the server never fragments them)
+		if (!read_full(fd, hdr, 2)) break;
+		t_first = now_usec();
+		opcode = hdr[0] & 0x0F;
+		len = hdr[1] & 0x7F;
+		if (len == 126) {
+			if (!read_full(fd, hdr + 2, 2)) break;
+			len = (hdr[2] << 8) | hdr[3];
+		} else if (len == 127) {
+			if (!read_full(fd, hdr + 2, 8)) break;
+			for (len = 0, i = 2; i < 10; i++) len = (len << 8) | hdr[i];
+		}
+		if (len > msg_cap) {
+			msg_cap = len;
+			if ((msg = realloc(msg, msg_cap)) == NULL) {
+				fprintf(stderr, "Message of %llu bytes is too big\n", (unsigned long long) len);
+				break;
+			}
+		}
+		if (!read_full(fd, msg, len)) break;
+		t = now_usec();
+
+		if (opcode == WS_OP_CLOSE) {
+			fprintf(stderr, "Server closed the connection\n");
+			break;
+		}
+		if (opcode == WS_OP_PING) {
+			ws_send(fd, WS_OP_PONG, msg, len);
+			continue;
+		}
+		if ((opcode == WS_OP_PONG) && (len == sizeof(int64_t))) {
+			memcpy(&rtt, msg, sizeof(rtt));
+			rtt = t - rtt;
+			pongs++;
+			rtt_sum += rtt;
+			if (rtt < rtt_min) rtt_min = rtt;
+			if (rtt > rtt_max) rtt_max = rtt;
+			continue;
+		}
+		if (opcode != WS_OP_BINARY) continue;
+
+		// A frame: rsp_frame_hdr_t, telemetry and payload
+		if (len < sizeof(fh)) {
+			bad++;
+			continue;
+		}
+		memcpy(&fh, msg, sizeof(fh));
+		if ((fh.magic != RSP_PROTO_MAGIC) || (fh.version != RSP_PROTO_VERSION) ||
+		    (len != (uint64_t) fh.hdr_len + fh.telem_words * 2 + fh.payload_len)) {
+			bad++;
+			continue;
+		}
+		if (fh.flags & RSP_FLAG_CRC) {
+			crc = crc32_update(0, msg + fh.hdr_len, len - fh.hdr_len);
+			if (crc != fh.payload_crc) crc_errors++;
+		}
+
+		if ((frames != 0) && ((int32_t) (fh.frame_seq - last_seq) > 1)) lost += fh.frame_seq - last_seq - 1;
+		if ((frames != 0) && ((t - t_last) > gap_max)) gap_max = t - t_last;
+		last_seq = fh.frame_seq;
+		t_last = t;
+		frames++;
+		bytes += len;
+		device += fh.send_usec - fh.acq_usec;
+		transfer += t - t_first;
+		if (verbose) {
+			printf("frame %u: %llu bytes, device %lld usec, transfer %lld usec\n", fh.frame_seq,
+			       (unsigned long long) len, (long long) (fh.send_usec - fh.acq_usec), (long long) (t - t_first));
+		}
+	}
+	close(fd);
+
+	t = now_usec() - t_start;
+	printf("frames        : %llu in %.1f sec, %.2f fps (%llu skipped or lost, %llu bad, %llu crc errors)\n",
+	       (unsigned long long) frames, t / 1e6, frames * 1e6 / t, (unsigned long long) lost,
+	       (unsigned long long) bad, (unsigned long long) crc_errors);
+	if (frames != 0) {
+		printf("throughput    : %.0f bytes per frame, %.1f kB/sec, longest gap %.1f msec\n",
+		       (double) bytes / frames, bytes * 1e3 / t, gap_max / 1e3);
+	}
+	if (pongs != 0) {
+		printf("ping rtt usec : %.0f avg, %lld min, %lld max (%llu pings)\n", rtt_sum / pongs, (long long) rtt_min,
+		       (long long) rtt_max, (unsigned long long) pongs);
+	}
+	if (frames != 0) {
+		printf("latency usec  : device %.0f + network %.0f + transfer %.0f = %.0f\n", device / frames,
+		       (pongs != 0) ? rtt_sum / pongs / 2 : 0.0, transfer / frames,
+		       device / frames + ((pongs != 0) ? rtt_sum / pongs / 2 : 0.0) + transfer / frames);
+	}
+
+	free(msg);
+	return 0;
+}
+
+
+//
+// Client internal functions
+//
+
+/**
+ * Connect and do the WebSocket handshake.  Returns the socket or -1.
+ */
+static int ws_connect(const char* host, const char* port, const char* path)
+{
+	struct addrinfo hints, *res;
+	char buf[1024];
+	int fd, n, one = 1;
+	size_t got = 0;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((n = getaddrinfo(host, port, &hints, &res)) != 0) {
+		fprintf(stderr, "%s: %s\n", host, gai_strerror(n));
+		return -1;
+	}
+	fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if ((fd < 0) || (connect(fd, res->ai_addr, res->ai_addrlen) != 0)) {
+		perror(host);
+		freeaddrinfo(res);
+		return -1;
+	}
+	freeaddrinfo(res);
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+	n = snprintf(buf, sizeof(buf),
+	             "GET %s HTTP/1.1\r\n"
+	             "Host: %s:%s\r\n"
+	             "Upgrade: websocket\r\n"
+	             "Connection: Upgrade\r\n"
+	             "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	             "Sec-WebSocket-Version: 13\r\n\r\n", path, host, port);
+	if (write(fd, buf, n) != n) {
+		perror("handshake");
+		close(fd);
+		return -1;
+	}
+
+	// Read the response headers a byte at a time so no frame bytes are consumed
+	while (got < sizeof(buf) - 1) {
+		if (!read_full(fd, &buf[got], 1)) break;
+		got++;
+		if ((got >= 4) && (memcmp(&buf[got - 4], "\r\n\r\n", 4) == 0)) break;
+	}
+	buf[got] = '\0';
+	if (strncmp(buf, "HTTP/1.1 101", 12) != 0) {
+		fprintf(stderr, "Handshake refused: %.*s\n", (int) strcspn(buf, "\r\n"), buf);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+
+/**
+ * Send a small masked frame (client frames must be masked)
+ */
+static bool ws_send(int fd, int opcode, const void* data, size_t len)
+{
+	uint8_t frame[2 + 4 + 125];
+	const uint8_t mask[4] = {0x12, 0x34, 0x56, 0x78};
+	size_t i;
+
+	if (len > 125) return false;
+	frame[0] = 0x80 | opcode;
+	frame[1] = 0x80 | len;
+	memcpy(&frame[2], mask, 4);
+	for (i = 0; i < len; i++) frame[6 + i] = ((const uint8_t*) data)[i] ^ mask[i % 4];
+
+	return write(fd, frame, 6 + len) == (ssize_t) (6 + len);
+}
+
+
+static bool read_full(int fd, void* dst, size_t len)
+{
+	uint8_t* p = dst;
+	ssize_t n;
+
+	while (len > 0) {
+		n = read(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		if (n == 0) return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+
+static int64_t now_usec()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/**
+ * zlib CRC-32 (the ESP32 ROM crc32_le)
+ */
+static void crc32_init()
+{
+	uint32_t c;
+	int i, k;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++) c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+		crc_table[i] = c;
+	}
+}
+
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* p, size_t len)
+{
+	crc = ~crc;
+	while (len--) crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+
+static void on_signal(int sig)
+{
+	stop = 1;
+}